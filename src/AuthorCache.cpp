@@ -0,0 +1,275 @@
+#include "AuthorCache.h"
+#include <Autolock.h>
+#include <View.h>
+#include <algorithm>
+#include <cmath>
+#include <translation/TranslationUtils.h>
+
+#define AUTHORS_KEPT 4096
+#define LOOKUP_BATCH 256
+#define PICTURE_SIZE 32.0
+
+namespace {
+std::shared_ptr<BBitmap> scaledPicture(const entry_ref &ref) {
+  BBitmap *unscaled = BTranslationUtils::GetBitmap(&ref, NULL);
+  if (unscaled == NULL)
+    return NULL;
+  float scale = 1.0;
+  BRect bounds(unscaled->Bounds());
+  {
+    float s = PICTURE_SIZE / bounds.Width();
+    if (scale > s)
+      scale = s;
+    s = PICTURE_SIZE / bounds.Height();
+    if (scale > s)
+      scale = s;
+  }
+  auto scaled = std::make_shared<BBitmap>(
+      BRect(0, 0, std::floor(bounds.Width() * scale - 1),
+            std::floor(bounds.Height() * scale - 1)),
+      B_RGBA32, true);
+  auto view = new BView(scaled->Bounds(), "scale", B_FOLLOW_NONE, B_WILL_DRAW);
+  scaled->AddChild(view);
+  scaled->Lock();
+  view->SetDrawingMode(B_OP_ALPHA);
+  view->SetBlendingMode(B_PIXEL_ALPHA, B_ALPHA_OVERLAY);
+  view->DrawBitmap(unscaled, unscaled->Bounds(), scaled->Bounds());
+  view->Sync();
+  scaled->Unlock();
+  scaled->RemoveChild(view);
+  delete view;
+  delete unscaled;
+  return scaled;
+}
+
+// Waits for one picture to be fetched, decodes it on the cache's thread and
+// goes away.
+class PictureFetch : public BHandler {
+public:
+  PictureFetch(const BString &image);
+  void MessageReceived(BMessage *message) override;
+
+private:
+  BString image;
+};
+
+PictureFetch::PictureFetch(const BString &image)
+    : image(image) {}
+
+void PictureFetch::MessageReceived(BMessage *message) {
+  std::shared_ptr<BBitmap> picture;
+  if (entry_ref ref; message->FindRef("result", &ref) == B_OK)
+    picture = scaledPicture(ref);
+  AuthorCache::instance()->pictureLoaded(this->image, picture);
+  this->Looper()->RemoveHandler(this);
+  delete this;
+}
+} // namespace
+
+AuthorCache::AuthorCache()
+    : BLooper("author cache"),
+      entriesLock("author cache entries") {}
+
+AuthorCache *AuthorCache::instance() {
+  static AuthorCache *result = [] {
+    auto cache = new AuthorCache();
+    cache->Run();
+    BMessage subscribe('USUB');
+    subscribe.AddSpecifier("Profile");
+    subscribe.AddMessenger("subscriber", BMessenger(cache));
+    BMessenger("application/x-vnd.habitat").SendMessage(&subscribe);
+    return cache;
+  }();
+  return result;
+}
+
+// Starts sending `watcher` changes to `author`, and fills in `display` if
+// anything is known about them yet.
+bool AuthorCache::watch(const BString &author, BMessenger watcher,
+                        AuthorDisplay *display) {
+  BAutolock lock(this->entriesLock);
+  Entry &entry = this->entries[author];
+  entry.watchers.push_back(watcher);
+  this->want(author);
+  if (entry.known)
+    *display = entry.display;
+  return entry.known;
+}
+
+void AuthorCache::unwatch(const BString &author, BMessenger watcher) {
+  BAutolock lock(this->entriesLock);
+  if (auto entry = this->entries.find(author); entry != this->entries.end()) {
+    auto &watchers = entry->second.watchers;
+    if (auto found = std::find(watchers.begin(), watchers.end(), watcher);
+        found != watchers.end()) {
+      watchers.erase(found);
+    }
+  }
+  this->trim();
+}
+
+bool AuthorCache::find(const BString &author, AuthorDisplay *display) {
+  BAutolock lock(this->entriesLock);
+  if (auto entry = this->entries.find(author);
+      entry != this->entries.end() && entry->second.known) {
+    *display = entry->second.display;
+    return true;
+  }
+  return false;
+}
+
+// Looks up whichever of `authors` aren't known yet together, ahead of the
+// views that will show them.
+void AuthorCache::prefetch(const std::vector<BString> &authors) {
+  BAutolock lock(this->entriesLock);
+  for (const BString &author : authors) {
+    if (author.Length() > 0)
+      this->want(author);
+  }
+  this->trim();
+}
+
+// Queues `author` to be looked up, unless that's done or already underway.
+// Everything queued before the looper gets to it goes in one lookup.
+void AuthorCache::want(const BString &author) {
+  Entry &entry = this->entries[author];
+  if (entry.known || entry.asked)
+    return;
+  entry.asked = true;
+  if (this->wanted.empty())
+    this->PostMessage('ALKP');
+  this->wanted.push_back(author);
+}
+
+// Drops feeds nobody is showing once there are too many.
+void AuthorCache::trim() {
+  if (this->entries.size() <= AUTHORS_KEPT)
+    return;
+  for (auto entry = this->entries.begin(); entry != this->entries.end();) {
+    if (entry->second.watchers.empty() && !entry->second.asked)
+      entry = this->entries.erase(entry);
+    else
+      entry++;
+  }
+}
+
+void AuthorCache::lookup() {
+  std::vector<BString> authors;
+  {
+    BAutolock lock(this->entriesLock);
+    authors.swap(this->wanted);
+  }
+  for (size_t start = 0; start < authors.size(); start += LOOKUP_BATCH) {
+    BMessage rq(B_GET_PROPERTY);
+    rq.AddSpecifier("Profile");
+    for (size_t i = start; i < authors.size() && i < start + LOOKUP_BATCH;
+         i++) {
+      rq.AddString("author", authors[i]);
+    }
+    BMessenger("application/x-vnd.habitat").SendMessage(&rq, this);
+  }
+}
+
+// Takes in a name and picture key from the profile store, fetching the
+// picture if it's new.
+void AuthorCache::update(const BMessage &result,
+                         std::vector<BMessenger> *notify) {
+  BString author;
+  if (result.FindString("about", &author) != B_OK)
+    return;
+  auto found = this->entries.find(author);
+  if (found == this->entries.end())
+    return;
+  Entry &entry = found->second;
+  entry.known = true;
+  entry.asked = false;
+  entry.display.name = result.GetString("name", "");
+  BString image = result.GetString("image", "");
+  if (image != entry.display.image) {
+    entry.display.image = image;
+    entry.display.picture = NULL;
+    if (image.Length() > 0) {
+      auto &waiting = this->loading[image];
+      if (waiting.empty()) {
+        auto fetch = new PictureFetch(image);
+        this->AddHandler(fetch);
+        BMessage rq(B_CREATE_PROPERTY);
+        rq.AddSpecifier("Blob");
+        rq.AddString("cypherkey", image);
+        BMessenger("application/x-vnd.habitat").SendMessage(&rq, fetch);
+      }
+      waiting.push_back(author);
+    }
+  }
+  *notify = entry.watchers;
+}
+
+void AuthorCache::pictureLoaded(const BString &image,
+                                std::shared_ptr<BBitmap> picture) {
+  std::vector<std::pair<BString, std::vector<BMessenger>>> notices;
+  {
+    BAutolock lock(this->entriesLock);
+    auto waiting = this->loading.find(image);
+    if (waiting == this->loading.end())
+      return;
+    for (const BString &author : waiting->second) {
+      if (auto entry = this->entries.find(author);
+          entry != this->entries.end() &&
+          entry->second.display.image == image) {
+        entry->second.display.picture = picture;
+        notices.emplace_back(author, entry->second.watchers);
+      }
+    }
+    this->loading.erase(waiting);
+  }
+  for (auto &[author, watchers] : notices)
+    send(author, watchers);
+}
+
+void AuthorCache::send(const BString &author,
+                       const std::vector<BMessenger> &watchers) {
+  BMessage notice('AUTH');
+  notice.AddString("author", author);
+  for (const BMessenger &watcher : watchers)
+    watcher.SendMessage(&notice);
+}
+
+void AuthorCache::MessageReceived(BMessage *message) {
+  if (message->what == 'ALKP') {
+    this->lookup();
+  } else if (message->what == B_OBSERVER_NOTICE_CHANGE) {
+    // Changed profiles are looked up again if anyone is showing them.
+    BAutolock lock(this->entriesLock);
+    BString author;
+    for (int32 i = 0; message->FindString("author", i, &author) == B_OK;
+         i++) {
+      auto entry = this->entries.find(author);
+      if (entry == this->entries.end())
+        continue;
+      if (entry->second.watchers.empty()) {
+        this->entries.erase(entry);
+      } else {
+        entry->second.known = false;
+        entry->second.asked = false;
+        this->want(author);
+      }
+    }
+  } else if (message->IsReply()) {
+    std::vector<std::pair<BString, std::vector<BMessenger>>> notices;
+    {
+      BAutolock lock(this->entriesLock);
+      BMessage result;
+      for (int32 i = 0; message->FindMessage("result", i, &result) == B_OK;
+           i++) {
+        std::vector<BMessenger> watchers;
+        this->update(result, &watchers);
+        if (!watchers.empty())
+          notices.emplace_back(result.GetString("about", ""), watchers);
+      }
+    }
+    for (auto &[author, watchers] : notices)
+      send(author, watchers);
+  } else {
+    BLooper::MessageReceived(message);
+  }
+}
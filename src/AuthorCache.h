@@ -0,0 +1,56 @@
+#ifndef AUTHOR_CACHE_H
+#define AUTHOR_CACHE_H
+
+#include <Bitmap.h>
+#include <Locker.h>
+#include <Looper.h>
+#include <Messenger.h>
+#include <String.h>
+#include <map>
+#include <memory>
+#include <vector>
+
+// What is shown beside a feed's messages.
+struct AuthorDisplay {
+  BString name;
+  BString image;
+  std::shared_ptr<BBitmap> picture;
+};
+
+// Names and pictures of feeds, shared by every view in the process. Each feed
+// is looked up and its picture decoded once however many views show it, and
+// whoever watches a feed is sent 'AUTH' with its "author" whenever more about
+// it is known or its profile changes.
+class AuthorCache : public BLooper {
+public:
+  static AuthorCache *instance();
+  bool watch(const BString &author, BMessenger watcher,
+             AuthorDisplay *display);
+  void unwatch(const BString &author, BMessenger watcher);
+  bool find(const BString &author, AuthorDisplay *display);
+  void prefetch(const std::vector<BString> &authors);
+  void MessageReceived(BMessage *message) override;
+  void pictureLoaded(const BString &image, std::shared_ptr<BBitmap> picture);
+
+private:
+  struct Entry {
+    AuthorDisplay display;
+    bool known = false;
+    bool asked = false;
+    std::vector<BMessenger> watchers;
+  };
+  AuthorCache();
+  void want(const BString &author);
+  void trim();
+  void lookup();
+  void update(const BMessage &result, std::vector<BMessenger> *notify);
+  static void send(const BString &author,
+                   const std::vector<BMessenger> &watchers);
+  BLocker entriesLock;
+  std::map<BString, Entry> entries;
+  std::vector<BString> wanted;
+  // Authors waiting on each picture being loaded.
+  std::map<BString, std::vector<BString>> loading;
+};
+
+#endif // AUTHOR_CACHE_H
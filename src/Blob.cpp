@@ -2,22 +2,235 @@
 #include "Base64.h"
 #include "Listener.h"
 #include "Logging.h"
+#include "MigrateDB.h"
+#include <Autolock.h>
 #include <NodeMonitor.h>
+#include <OS.h>
+#include <Path.h>
 #include <algorithm>
+#include <atomic>
 #include <ctime>
+#include <deque>
 #include <iostream>
 #include <sodium.h>
 
 namespace blob {
 
-Wanted::Wanted(BDirectory dir)
-    : dir(dir) {
+#define BLOB_BUFFER_SIZE (256 * 1024)
+#define BLOOM_HASHES 4
+#define BLOOM_MIN_BITS (1 << 20)
+#define BLOOM_BITS_PER_ENTRY 16
+#define BLOB_RANGE_SIZE (512 * 1024)
+#define BLOB_MIN_STEAL (64 * 1024)
+#define BLOB_TRANSFERS_PER_CONNECTION 2
+#define BLOB_SOURCE_FAILURES 3
+#define WANT_BATCH 64
+#define TOUCH_BATCH 256
+
+BlobIndex::BlobIndex(sqlite3 *database)
+    : database(database),
+      lock("Blob index") {
+  sqlite3_prepare_v2(this->database,
+                     "SELECT path, size FROM blobs WHERE cypherkey = ?", -1,
+                     &this->lookup, NULL);
+  sqlite3_prepare_v2(this->database,
+                     "INSERT OR REPLACE INTO blobs(cypherkey, size, path, "
+                     "accessed) VALUES(?, ?, ?, ?)",
+                     -1, &this->insert, NULL);
+  sqlite3_prepare_v2(this->database,
+                     "UPDATE blobs SET accessed = ? WHERE cypherkey = ?", -1,
+                     &this->touch, NULL);
+  sqlite3_prepare_v2(this->database, "DELETE FROM blobs WHERE cypherkey = ?",
+                     -1, &this->erase, NULL);
+  this->rebuild();
+}
+
+BlobIndex::~BlobIndex() {
+  this->flushTouched();
+  sqlite3_finalize(this->lookup);
+  sqlite3_finalize(this->insert);
+  sqlite3_finalize(this->touch);
+  sqlite3_finalize(this->erase);
+  sqlite3_close(this->database);
+}
+
+static inline void bloomHashes(const BString &cypherkey, uint64 *h1,
+                               uint64 *h2) {
+  uint64 hash = 14695981039346656037ULL;
+  for (int32 i = 0; i < cypherkey.Length(); i++) {
+    hash ^= (unsigned char)cypherkey[i];
+    hash *= 1099511628211ULL;
+  }
+  *h1 = hash;
+  *h2 = ((hash >> 33) ^ hash) * 0xff51afd7ed558ccdULL | 1;
+}
+
+void BlobIndex::remember(const BString &cypherkey) {
+  uint64 h1, h2;
+  bloomHashes(cypherkey, &h1, &h2);
+  uint64 bits = this->bloom.size() * 64;
+  for (int i = 0; i < BLOOM_HASHES; i++) {
+    uint64 bit = (h1 + i * h2) % bits;
+    this->bloom[bit / 64] |= (uint64)1 << (bit % 64);
+  }
+  this->entries++;
+}
+
+bool BlobIndex::mayHave(const BString &cypherkey) {
+  uint64 h1, h2;
+  bloomHashes(cypherkey, &h1, &h2);
+  uint64 bits = this->bloom.size() * 64;
+  for (int i = 0; i < BLOOM_HASHES; i++) {
+    uint64 bit = (h1 + i * h2) % bits;
+    if ((this->bloom[bit / 64] & ((uint64)1 << (bit % 64))) == 0)
+      return false;
+  }
+  return true;
+}
+
+void BlobIndex::rebuild() {
+  sqlite3_stmt *count;
+  uint64 rows = 0;
+  if (sqlite3_prepare_v2(this->database, "SELECT COUNT(*) FROM blobs", -1,
+                         &count, NULL) == SQLITE_OK &&
+      sqlite3_step(count) == SQLITE_ROW) {
+    rows = sqlite3_column_int64(count, 0);
+  }
+  sqlite3_finalize(count);
+  uint64 bits = BLOOM_MIN_BITS;
+  while (bits < rows * 2 * BLOOM_BITS_PER_ENTRY)
+    bits *= 2;
+  this->bloom.assign(bits / 64, 0);
+  this->entries = 0;
+  sqlite3_stmt *keys;
+  if (sqlite3_prepare_v2(this->database, "SELECT cypherkey FROM blobs", -1,
+                         &keys, NULL) == SQLITE_OK) {
+    while (sqlite3_step(keys) == SQLITE_ROW)
+      this->remember((const char *)sqlite3_column_text(keys, 0));
+  }
+  sqlite3_finalize(keys);
+}
+
+bool BlobIndex::has(const BString &cypherkey) {
+  return this->find(cypherkey, NULL) == B_OK;
+}
+
+status_t BlobIndex::find(const BString &cypherkey, entry_ref *ref,
+                         off_t *size) {
+  BAutolock lock(this->lock);
+  if (!this->mayHave(cypherkey))
+    return B_ENTRY_NOT_FOUND;
+  sqlite3_bind_text(this->lookup, 1, cypherkey.String(), cypherkey.Length(),
+                    SQLITE_STATIC);
+  status_t result = B_ENTRY_NOT_FOUND;
+  bool stale = false;
+  if (sqlite3_step(this->lookup) == SQLITE_ROW) {
+    BEntry entry((const char *)sqlite3_column_text(this->lookup, 0));
+    if (entry.Exists()) {
+      if (size != NULL)
+        *size = sqlite3_column_int64(this->lookup, 1);
+      result = ref != NULL ? entry.GetRef(ref) : B_OK;
+    } else {
+      stale = true;
+    }
+  }
+  sqlite3_reset(this->lookup);
+  if (stale) {
+    sqlite3_bind_text(this->erase, 1, cypherkey.String(), cypherkey.Length(),
+                      SQLITE_STATIC);
+    sqlite3_step(this->erase);
+    sqlite3_reset(this->erase);
+  } else if (result == B_OK && ref != NULL) {
+    this->touched.insert(cypherkey);
+    if (this->touched.size() >= TOUCH_BATCH)
+      this->flushTouched();
+  }
+  return result;
+}
+
+// Writes the access times of blobs read since the last time, together.
+void BlobIndex::flushTouched() {
+  if (this->touched.empty())
+    return;
+  sqlite3_exec(this->database, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+  sqlite3_bind_int64(this->touch, 1, time(NULL));
+  for (const BString &cypherkey : this->touched) {
+    sqlite3_bind_text(this->touch, 2, cypherkey.String(), cypherkey.Length(),
+                      SQLITE_STATIC);
+    sqlite3_step(this->touch);
+    sqlite3_reset(this->touch);
+  }
+  sqlite3_exec(this->database, "END TRANSACTION;", NULL, NULL, NULL);
+  this->touched.clear();
+}
+
+status_t BlobIndex::add(const BString &cypherkey, const entry_ref *ref,
+                        off_t size) {
+  BPath path(ref);
+  if (status_t result = path.InitCheck(); result != B_OK)
+    return result;
+  BAutolock lock(this->lock);
+  sqlite3_bind_text(this->insert, 1, cypherkey.String(), cypherkey.Length(),
+                    SQLITE_STATIC);
+  sqlite3_bind_int64(this->insert, 2, size);
+  sqlite3_bind_text(this->insert, 3, path.Path(), -1, SQLITE_STATIC);
+  sqlite3_bind_int64(this->insert, 4, time(NULL));
+  int stepResult = sqlite3_step(this->insert);
+  sqlite3_reset(this->insert);
+  if (stepResult != SQLITE_DONE)
+    return B_ERROR;
+  if (this->mayHave(cypherkey))
+    return B_OK;
+  this->remember(cypherkey);
+  if (this->entries * BLOOM_BITS_PER_ENTRY > this->bloom.size() * 64)
+    this->rebuild();
+  return B_OK;
+}
+
+status_t BlobIndex::remove(const BString &cypherkey) {
+  BAutolock lock(this->lock);
+  sqlite3_bind_text(this->erase, 1, cypherkey.String(), cypherkey.Length(),
+                    SQLITE_STATIC);
+  int stepResult = sqlite3_step(this->erase);
+  sqlite3_reset(this->erase);
+  return stepResult == SQLITE_DONE ? B_OK : B_ERROR;
+}
+
+// Blobs fetched before the index existed are only known by their attribute.
+status_t BlobIndex::import(BVolume *volume) {
+  if (upkeepDone(this->database, kUpkeepBlobs))
+    return B_OK;
+  BQuery query;
+  query.SetVolume(volume);
+  query.PushAttr("HABITAT:cypherkey");
+  query.PushString("&*");
+  query.PushOp(B_EQ);
+  if (status_t result = query.Fetch(); result != B_OK)
+    return result;
+  entry_ref ref;
+  while (query.GetNextRef(&ref) == B_OK) {
+    BNode node(&ref);
+    BString cypherkey;
+    off_t size;
+    if (node.ReadAttrString("HABITAT:cypherkey", &cypherkey) == B_OK &&
+        node.GetSize(&size) == B_OK) {
+      this->add(cypherkey, &ref, size);
+    }
+  }
+  markUpkeepDone(this->database, kUpkeepBlobs);
+  return B_OK;
+}
+
+Wanted::Wanted(BDirectory dir, sqlite3 *database)
+    : dir(dir),
+      index(std::make_unique<BlobIndex>(database)) {
   this->dir.GetVolume(&this->volume);
+  this->index->import(&this->volume);
 }
 
-Get::Get(BLooper *looper, BVolume volume)
+Get::Get(BLooper *looper, BlobIndex *index)
     : looper(looper),
-      volume(volume) {
+      index(index) {
   this->name = {"blobs", "get"};
   this->expectedType = muxrpc::RequestType::SOURCE;
 }
@@ -55,18 +268,26 @@ void GetSender::MessageReceived(BMessage *message) {
 
 class Reopen : public BDataIO {
 public:
-  Reopen(entry_ref *ref);
+  Reopen(entry_ref *ref, off_t start = 0, off_t end = -1);
   ssize_t Read(void *buffer, size_t size) override;
 
 private:
   entry_ref ref;
-  ssize_t position = 0;
+  off_t position;
+  off_t end;
 };
 
-Reopen::Reopen(entry_ref *ref)
-    : ref(*ref) {}
+Reopen::Reopen(entry_ref *ref, off_t start, off_t end)
+    : ref(*ref),
+      position(start),
+      end(end) {}
 
 ssize_t Reopen::Read(void *buffer, size_t size) {
+  if (this->end >= 0) {
+    if (this->position >= this->end)
+      return 0;
+    size = std::min<off_t>(size, this->end - this->position);
+  }
   BFile file(&this->ref, B_READ_ONLY);
   ssize_t result = file.ReadAt(this->position, buffer, size);
   if (result > 0)
@@ -82,7 +303,7 @@ status_t Get::call(muxrpc::Connection *connection, muxrpc::RequestType type,
   {
     BMessage arg0;
     if (args->FindMessage("0", &arg0) == B_OK) {
-      if (double size; arg0.FindDouble("max", &size))
+      if (double size; arg0.FindDouble("max", &size) == B_OK)
         maxSize = (int64)size;
       if (arg0.FindString("key", &cypherkey) == B_OK)
         goto beginSend;
@@ -90,28 +311,17 @@ status_t Get::call(muxrpc::Connection *connection, muxrpc::RequestType type,
   }
   if (args->FindString("0", &cypherkey) == B_OK) {
   beginSend:
-    BQuery query;
-    query.SetVolume(&this->volume);
-    query.PushAttr("HABITAT:cypherkey");
-    query.PushString(cypherkey.String());
-    query.PushOp(B_EQ);
-    if (query.Fetch() == B_OK) {
-      entry_ref ref;
-      if (query.GetNextRef(&ref) == B_OK) {
-        {
-          BNode node(&ref);
-          off_t size;
-          node.GetSize(&size);
-          if (size > maxSize)
-            goto failed;
-        }
-        auto sender = new GetSender(std::make_unique<Reopen>(&ref), replyTo);
-        this->looper->Lock();
-        this->looper->AddHandler(sender);
-        this->looper->Unlock();
-        BMessenger(sender).SendMessage(B_PULSE);
-        return B_OK;
-      }
+    entry_ref ref;
+    off_t size;
+    if (this->index->find(cypherkey, &ref, &size) == B_OK) {
+      if (size > maxSize)
+        goto failed;
+      auto sender = new GetSender(std::make_unique<Reopen>(&ref), replyTo);
+      this->looper->Lock();
+      this->looper->AddHandler(sender);
+      this->looper->Unlock();
+      BMessenger(sender).SendMessage(B_PULSE);
+      return B_OK;
     }
   }
 failed: {
@@ -123,6 +333,49 @@ failed: {
   return B_ERROR;
 }
 
+GetSlice::GetSlice(BLooper *looper, BlobIndex *index)
+    : looper(looper),
+      index(index) {
+  this->name = {"blobs", "getSlice"};
+  this->expectedType = muxrpc::RequestType::SOURCE;
+}
+
+status_t GetSlice::call(muxrpc::Connection *connection,
+                        muxrpc::RequestType type, BMessage *args,
+                        BMessenger replyTo, BMessenger *inbound) {
+  BMessage arg0;
+  BString cypherkey;
+  entry_ref ref;
+  off_t size;
+  if (args->FindMessage("0", &arg0) == B_OK &&
+      arg0.FindString("key", &cypherkey) == B_OK &&
+      this->index->find(cypherkey, &ref, &size) == B_OK) {
+    off_t start = (off_t)arg0.GetDouble("start", 0);
+    off_t end = (off_t)arg0.GetDouble("end", (double)size);
+    if (end > size)
+      end = size;
+    bool valid = start >= 0 && start <= end;
+    if (double expected; arg0.FindDouble("size", &expected) == B_OK)
+      valid = valid && (off_t)expected == size;
+    if (double max; arg0.FindDouble("max", &max) == B_OK)
+      valid = valid && end - start <= (off_t)max;
+    if (valid) {
+      auto sender = new GetSender(std::make_unique<Reopen>(&ref, start, end),
+                                  replyTo);
+      this->looper->Lock();
+      this->looper->AddHandler(sender);
+      this->looper->Unlock();
+      BMessenger(sender).SendMessage(B_PULSE);
+      return B_OK;
+    }
+  }
+  BMessage reply('JSOB');
+  reply.AddString("message", "could not get blob slice");
+  reply.AddString("name", "Error");
+  muxrpc::Sender(replyTo).send(&reply, true, true, false);
+  return B_ERROR;
+}
+
 CreateWants::CreateWants(Wanted *wanted)
     : wanted(wanted) {
   this->name = {"blobs", "createWants"};
@@ -147,32 +400,25 @@ void Wanted::MessageReceived(BMessage *message) {
         BString cypherkey;
         if (node.ReadAttrString("HABITAT:cypherkey", &cypherkey) != B_OK)
           return;
-        for (auto item = this->wanted.begin(); item != this->wanted.end();
-             item++) {
-          if (std::get<0>(*item) == cypherkey) {
-            for (auto &target : std::get<2>(*item))
-              target.SendMessage(message);
-            this->wanted.erase(item);
-            return;
-          }
+        if (auto item = this->wanted.find(cypherkey);
+            item != this->wanted.end()) {
+          for (auto &target : item->second.subscribers)
+            target.SendMessage(message);
+          this->wanted.erase(item);
         }
       }
     }
   } break;
-  case 'TNXT': {
+  case 'FWNT':
+    this->flushWants();
+    break;
+  case 'BDON': {
     BString cypherkey;
     if (message->FindString("cypherkey", &cypherkey) != B_OK)
       break;
-    for (auto &item : this->wanted) {
-      if (std::get<0>(item) == cypherkey) {
-        auto &q = std::get<3>(item);
-        if (!q.empty())
-          q.pop();
-        if (!q.empty())
-          this->fetch(cypherkey, q.front());
-        break;
-      }
-    }
+    this->downloads.erase(cypherkey);
+    if (message->GetBool("abandon", false))
+      this->wanted.erase(cypherkey);
   } break;
   case 'ADDW': {
     BString cypherkey;
@@ -193,6 +439,7 @@ public:
   void MessageReceived(BMessage *message) override;
 
 private:
+  friend class blob::Wanted;
   void checkWantStream();
   muxrpc::Connection *connection;
   Wanted *registry;
@@ -238,7 +485,8 @@ void WantSink::MessageReceived(BMessage *message) {
           this->registry->addWant(cypherkey, (int8)(-distance) + 1,
                                   BMessenger(this));
         } else if (distance > 0 && distance <= 5242880) {
-          this->registry->sawSource(BString(attrName), this->connection);
+          this->registry->sawSource(BString(attrName), this->connection,
+                                    (off_t)distance);
         }
       }
       index++;
@@ -310,12 +558,13 @@ void WantSource::MessageReceived(BMessage *message) {
     BMessage forward('JSOB');
     BString blobID;
     int8 distance;
-    if (message->FindString("cypherkey", &blobID) != B_OK)
-      break;
-    if (message->FindInt8("distance", &distance) != B_OK)
-      break;
-    forward.AddDouble(blobID, -(double)distance);
-    this->sender.send(&forward, true, false, false);
+    for (int32 i = 0; message->FindString("cypherkey", i, &blobID) == B_OK &&
+         message->FindInt8("distance", i, &distance) == B_OK;
+         i++) {
+      forward.AddDouble(blobID, -(double)distance);
+    }
+    if (!forward.IsEmpty())
+      this->sender.send(&forward, true, false, false);
   } break;
   case 'HAVE': {
     int64 size;
@@ -332,75 +581,437 @@ void WantSource::MessageReceived(BMessage *message) {
   return BHandler::MessageReceived(message);
 }
 
-class FetchSink : public BHandler {
+} // namespace
+
+class RangeSink;
+
+// A blob is split into ranges which are fetched with blobs.getSlice from every
+// peer that has it, at most BLOB_TRANSFERS_PER_CONNECTION at a time per peer.
+// Ranges are written in place through a single open file, and the hash is
+// advanced over the contiguous prefix as it fills in. A peer that runs out of
+// work takes over the second half of the slowest range still in flight. A peer
+// whose ranges keep failing or coming up short is given up on.
+class Download {
 public:
-  FetchSink(unsigned char expectedHash[crypto_hash_sha256_BYTES],
-            BDirectory dir);
-  void MessageReceived(BMessage *message) override;
+  Download(Wanted *registry,
+           unsigned char expectedHash[crypto_hash_sha256_BYTES],
+           const BString &cypherkey, BDirectory dir, BlobIndex *index);
+  ~Download();
+  void addSource(muxrpc::Connection *connection, off_t size);
+  bool dropSource(muxrpc::Connection *connection);
+  void schedule();
 
 private:
+  friend class RangeSink;
+  struct Source {
+    muxrpc::Connection *connection;
+    RangeSink *active;
+    bool slice;
+    int32 failures = 0;
+  };
+  bool takeRange(bool whole, off_t *start, off_t *end);
+  bool steal(off_t *start, off_t *end);
+  void write(RangeSink *sink, const unsigned char *data, ssize_t bytes);
+  void rangeEnded(RangeSink *sink, bool error);
+  void advance();
+  void finish();
+  void restart();
+  void giveUp(bool abandon);
+  Wanted *registry;
+  BlobIndex *index;
+  BString cypherkey;
   BEntry entry;
+  BFile file;
   unsigned char expectedHash[crypto_hash_sha256_BYTES];
   crypto_hash_sha256_state hashState;
+  std::unique_ptr<unsigned char[]> buffer;
+  std::vector<Source> sources;
+  std::deque<std::pair<off_t, off_t>> pending;
+  std::map<off_t, off_t> written;
+  off_t size = -1;
+  off_t hashed = 0;
+  bool finished = false;
+  // Whoever wrote the bytes that completed the blob, blamed if it is wrong.
+  muxrpc::Connection *lastWriter = NULL;
 };
 
-FetchSink::FetchSink(unsigned char expectedHash[crypto_hash_sha256_BYTES],
-                     BDirectory dir) {
+class RangeSink : public BHandler {
+public:
+  RangeSink(Download *download, Wanted *registry,
+            muxrpc::Connection *connection, off_t start, off_t end,
+            bool slice);
+  status_t request(const BString &cypherkey);
+  void MessageReceived(BMessage *message) override;
+
+private:
+  friend class Download;
+  friend class Wanted;
+  Download *download;
+  Wanted *registry;
+  muxrpc::Connection *connection;
+  off_t position;
+  off_t end;
+  off_t skip = 0;
+  off_t received = 0;
+  bool slice;
+};
+
+Download::Download(Wanted *registry,
+                   unsigned char expectedHash[crypto_hash_sha256_BYTES],
+                   const BString &cypherkey, BDirectory dir, BlobIndex *index)
+    : registry(registry),
+      index(index),
+      cypherkey(cypherkey),
+      buffer(new unsigned char[BLOB_BUFFER_SIZE]) {
   memcpy(this->expectedHash, expectedHash, crypto_hash_sha256_BYTES);
   BString filename =
       base64::encode(this->expectedHash, crypto_hash_sha256_BYTES, base64::URL);
   this->entry.SetTo(&dir, filename);
-  BFile file;
-  dir.CreateFile(filename.String(), &file, false);
   crypto_hash_sha256_init(&this->hashState);
+  if (this->file.SetTo(&this->entry, B_READ_WRITE | B_CREATE_FILE) != B_OK)
+    return;
+  // Bytes left behind by an earlier attempt are hashed again and kept.
+  ssize_t readBytes;
+  while ((readBytes = this->file.Read(this->buffer.get(), BLOB_BUFFER_SIZE)) >
+         0) {
+    crypto_hash_sha256_update(&this->hashState, this->buffer.get(), readBytes);
+    this->hashed += readBytes;
+  }
+  if (readBytes < 0) {
+    this->file.SetSize(0);
+    crypto_hash_sha256_init(&this->hashState);
+    this->hashed = 0;
+  }
 }
 
-void FetchSink::MessageReceived(BMessage *message) {
+Download::~Download() {
+  for (auto &source : this->sources) {
+    if (source.active != NULL)
+      source.active->download = NULL;
+  }
+  // Anything past the verified prefix may have holes; drop it so that a
+  // later attempt can resume from the file length.
+  if (!this->finished && this->file.InitCheck() == B_OK)
+    this->file.SetSize(this->hashed);
+}
+
+void Download::addSource(muxrpc::Connection *connection, off_t size) {
+  if (this->finished || this->file.InitCheck() != B_OK)
+    return;
+  if (this->size < 0) {
+    if (size < this->hashed) {
+      this->file.SetSize(0);
+      crypto_hash_sha256_init(&this->hashState);
+      this->hashed = 0;
+    }
+    this->size = size;
+    for (off_t start = this->hashed; start < size; start += BLOB_RANGE_SIZE)
+      this->pending.push_back({start, std::min(start + BLOB_RANGE_SIZE, size)});
+  } else if (size != this->size) {
+    return;
+  }
+  for (auto &source : this->sources) {
+    if (source.connection == connection)
+      return;
+  }
+  this->sources.push_back({connection, NULL, true, 0});
+  if (this->hashed >= this->size)
+    this->finish();
+  else
+    this->schedule();
+}
+
+// Forgets a peer that has gone away, putting back whatever it was fetching.
+// Returns whether anyone is left to fetch from.
+bool Download::dropSource(muxrpc::Connection *connection) {
+  for (auto source = this->sources.begin(); source != this->sources.end();) {
+    if (source->connection != connection) {
+      source++;
+      continue;
+    }
+    if (RangeSink *sink = source->active; sink != NULL) {
+      if (sink->position < sink->end)
+        this->pending.push_front({sink->position, sink->end});
+      sink->download = NULL;
+    }
+    source = this->sources.erase(source);
+  }
+  return !this->sources.empty();
+}
+
+bool Download::takeRange(bool whole, off_t *start, off_t *end) {
+  if (this->pending.empty())
+    return false;
+  *start = this->pending.front().first;
+  *end = this->pending.front().second;
+  this->pending.pop_front();
+  while (whole && !this->pending.empty() &&
+         this->pending.front().first == *end) {
+    *end = this->pending.front().second;
+    this->pending.pop_front();
+  }
+  return true;
+}
+
+bool Download::steal(off_t *start, off_t *end) {
+  RangeSink *slowest = NULL;
+  for (auto &source : this->sources) {
+    if (RangeSink *sink = source.active; sink != NULL && sink->slice &&
+        (slowest == NULL ||
+         sink->end - sink->position > slowest->end - slowest->position)) {
+      slowest = sink;
+    }
+  }
+  if (slowest == NULL || slowest->end - slowest->position < BLOB_MIN_STEAL)
+    return false;
+  *end = slowest->end;
+  *start = slowest->position + (slowest->end - slowest->position) / 2;
+  slowest->end = *start;
+  return true;
+}
+
+void Download::schedule() {
+  if (this->finished || this->size < 0)
+    return;
+  for (auto &source : this->sources) {
+    if (source.active != NULL)
+      continue;
+    if (!source.slice) {
+      // Peers without getSlice are only used while nobody else is working.
+      bool busy = false;
+      for (auto &other : this->sources)
+        busy = busy || other.active != NULL || other.slice;
+      if (busy)
+        continue;
+    }
+    off_t start, end;
+    if (!this->takeRange(!source.slice, &start, &end) &&
+        (!source.slice || !this->steal(&start, &end))) {
+      return;
+    }
+    if (!this->registry->reserveTransfer(source.connection)) {
+      this->pending.push_front({start, end});
+      continue;
+    }
+    auto sink = new RangeSink(this, this->registry, source.connection, start,
+                              end, source.slice);
+    BLooper *looper = this->registry->Looper();
+    looper->Lock();
+    looper->AddHandler(sink);
+    looper->Unlock();
+    source.active = sink;
+    if (sink->request(this->cypherkey) != B_OK) {
+      source.active = NULL;
+      sink->download = NULL;
+      this->pending.push_front({start, end});
+      this->registry->releaseTransfer(source.connection);
+      looper->Lock();
+      looper->RemoveHandler(sink);
+      looper->Unlock();
+      delete sink;
+    }
+  }
+}
+
+void Download::write(RangeSink *sink, const unsigned char *data,
+                     ssize_t bytes) {
+  off_t start = sink->position;
+  bytes = std::min<off_t>(bytes, sink->end - start);
+  if (bytes <= 0)
+    return;
+  if (this->file.WriteAt(start, data, bytes) != bytes)
+    return;
+  sink->position += bytes;
+  this->lastWriter = sink->connection;
+  if (start == this->hashed) {
+    crypto_hash_sha256_update(&this->hashState, data, bytes);
+    this->hashed += bytes;
+  } else if (auto next = this->written.lower_bound(start);
+             next != this->written.begin() &&
+             std::prev(next)->second == start) {
+    std::prev(next)->second = start + bytes;
+  } else {
+    this->written[start] = start + bytes;
+  }
+  this->advance();
+  if (!this->finished && sink->position >= sink->end) {
+    // The rest of the stream belongs to a range someone else took over.
+    for (auto &source : this->sources) {
+      if (source.active == sink)
+        source.active = NULL;
+    }
+    sink->download = NULL;
+    this->schedule();
+  }
+}
+
+// Hash whatever has become contiguous with the verified prefix.
+void Download::advance() {
+  for (auto block = this->written.begin();
+       block != this->written.end() && block->first <= this->hashed;
+       block = this->written.erase(block)) {
+    while (this->hashed < block->second) {
+      ssize_t readBytes = this->file.ReadAt(
+          this->hashed, this->buffer.get(),
+          std::min<off_t>(BLOB_BUFFER_SIZE, block->second - this->hashed));
+      if (readBytes <= 0)
+        return;
+      crypto_hash_sha256_update(&this->hashState, this->buffer.get(),
+                                readBytes);
+      this->hashed += readBytes;
+    }
+  }
+  if (this->hashed >= this->size)
+    this->finish();
+}
+
+void Download::rangeEnded(RangeSink *sink, bool error) {
+  bool failed = error || sink->position < sink->end;
+  for (auto source = this->sources.begin(); source != this->sources.end();) {
+    if (source->active != sink) {
+      source++;
+      continue;
+    }
+    source->active = NULL;
+    if (error && sink->slice && sink->received == 0) {
+      // Most likely it just doesn't know getSlice; try it with get.
+      source->slice = false;
+    } else if (!failed) {
+      source->failures = 0;
+    } else if (++source->failures >= BLOB_SOURCE_FAILURES) {
+      source = this->sources.erase(source);
+      continue;
+    }
+    source++;
+  }
+  if (sink->position < sink->end)
+    this->pending.push_front({sink->position, sink->end});
+  if (this->sources.empty())
+    this->giveUp(false);
+  else
+    this->schedule();
+}
+
+// Starts over from nothing after the finished blob didn't match its hash,
+// without the peer that completed it.
+void Download::restart() {
+  this->finished = false;
+  this->file.SetSize(0);
+  crypto_hash_sha256_init(&this->hashState);
+  this->hashed = 0;
+  this->written.clear();
+  this->pending.clear();
+  for (off_t start = 0; start < this->size; start += BLOB_RANGE_SIZE)
+    this->pending.push_back(
+        {start, std::min(start + BLOB_RANGE_SIZE, this->size)});
+  for (auto source = this->sources.begin(); source != this->sources.end();) {
+    if (source->connection == this->lastWriter)
+      source = this->sources.erase(source);
+    else
+      source++;
+  }
+  this->lastWriter = NULL;
+  if (this->sources.empty())
+    this->giveUp(true);
+  else
+    this->schedule();
+}
+
+// Asks the registry to put this download away, and with `abandon` to stop
+// wanting the blob too.
+void Download::giveUp(bool abandon) {
+  BMessage done('BDON');
+  done.AddString("cypherkey", this->cypherkey);
+  done.AddBool("abandon", abandon);
+  BMessenger(this->registry).SendMessage(&done);
+}
+
+void Download::finish() {
+  if (this->finished)
+    return;
+  this->finished = true;
+  for (auto &source : this->sources) {
+    if (source.active != NULL) {
+      source.active->download = NULL;
+      source.active = NULL;
+    }
+  }
+  unsigned char gotHash[crypto_hash_sha256_BYTES];
+  crypto_hash_sha256_final(&this->hashState, gotHash);
+  if (std::equal(gotHash, gotHash + crypto_hash_sha256_BYTES,
+                 this->expectedHash)) {
+    this->file.WriteAttrString("HABITAT:cypherkey", &this->cypherkey);
+    entry_ref ref;
+    this->entry.GetRef(&ref);
+    this->index->add(this->cypherkey, &ref, this->size);
+    BMessage mimic(B_QUERY_UPDATE);
+    mimic.AddInt32("opcode", B_ENTRY_CREATED);
+    mimic.AddInt32("device", ref.device);
+    mimic.AddInt64("directory", ref.directory);
+    mimic.AddString("name", ref.name);
+    BMessenger(this->registry).SendMessage(&mimic);
+    this->giveUp(false);
+  } else {
+    this->restart();
+  }
+}
+
+RangeSink::RangeSink(Download *download, Wanted *registry,
+                     muxrpc::Connection *connection, off_t start, off_t end,
+                     bool slice)
+    : download(download),
+      registry(registry),
+      connection(connection),
+      position(start),
+      end(end),
+      slice(slice) {}
+
+status_t RangeSink::request(const BString &cypherkey) {
+  BMessage args('JSAR');
+  std::vector<BString> methodName = {"blobs", "get"};
+  if (this->slice) {
+    methodName = {"blobs", "getSlice"};
+    BMessage arg0('JSOB');
+    arg0.AddString("key", cypherkey);
+    arg0.AddDouble("start", (double)this->position);
+    arg0.AddDouble("end", (double)this->end);
+    args.AddMessage("0", &arg0);
+  } else {
+    args.AddString("0", cypherkey.String());
+    this->skip = this->position;
+  }
+  return this->connection->request(methodName, muxrpc::RequestType::SOURCE,
+                                   &args, BMessenger(this), NULL);
+}
+
+void RangeSink::MessageReceived(BMessage *message) {
   unsigned char *data;
   ssize_t bytes;
   if (message->FindData("content", B_RAW_TYPE, (const void **)&data, &bytes) ==
       B_OK) {
-    BFile file(&this->entry, B_WRITE_ONLY | B_OPEN_AT_END);
-    file.WriteExactly(data, bytes);
-    crypto_hash_sha256_update(&this->hashState, data, bytes);
+    if (this->skip > 0) {
+      ssize_t skipped = (ssize_t)std::min<off_t>(this->skip, bytes);
+      this->skip -= skipped;
+      data += skipped;
+      bytes -= skipped;
+    }
+    this->received += bytes;
+    if (this->download != NULL && bytes > 0)
+      this->download->write(this, data, bytes);
   }
   if (message->GetBool("end", false)) {
-    BNode file(&this->entry);
-    unsigned char gotHash[crypto_hash_sha256_BYTES];
-    crypto_hash_sha256_final(&this->hashState, gotHash);
-    BString cypherkey("&");
-    cypherkey.Append(
-        base64::encode(gotHash, crypto_hash_sha256_BYTES, base64::STANDARD));
-    cypherkey.Append(".sha256");
+    BMessage error;
+    bool failed = message->FindMessage("content", &error) == B_OK;
+    if (this->download != NULL)
+      this->download->rangeEnded(this, failed);
+    this->registry->releaseTransfer(this->connection);
     BLooper *looper = this->Looper();
-    if (std::equal(gotHash, gotHash + crypto_hash_sha256_BYTES,
-                   this->expectedHash)) {
-      file.WriteAttrString("HABITAT:cypherkey", &cypherkey);
-      entry_ref ref;
-      this->entry.GetRef(&ref);
-      BMessage mimic(B_QUERY_UPDATE);
-      mimic.AddInt32("opcode", B_ENTRY_CREATED);
-      mimic.AddInt32("device", ref.device);
-      mimic.AddInt64("directory", ref.directory);
-      mimic.AddString("name", ref.name);
-      this->Looper()->Lock();
-      for (int i = 0; i < this->Looper()->CountHandlers(); i++)
-        if (auto w = dynamic_cast<Wanted *>(this->Looper()->HandlerAt(i)))
-          BMessenger(w).SendMessage(&mimic);
-      this->Looper()->Unlock();
-    } else {
-      this->entry.Remove();
-      BMessage msg('TNXT');
-      msg.AddString("cypherkey", cypherkey.String());
-      BMessenger(looper).SendMessage(&msg);
-    }
     looper->Lock();
     looper->RemoveHandler(this);
     looper->Unlock();
     delete this;
   }
 }
-} // namespace
 
 void Wanted::addWant(BString &cypherkey, int8 distance, BMessenger replyTo) {
   BMessage message('ADDW');
@@ -411,31 +1022,28 @@ void Wanted::addWant(BString &cypherkey, int8 distance, BMessenger replyTo) {
 }
 
 void Wanted::_addWant_(BString &cypherkey, int8 distance, BMessenger replyTo) {
-  for (auto &item : this->wanted) {
-    BString &existingKey = std::get<0>(item);
-    if (existingKey == cypherkey) {
-      if (distance < std::get<1>(item)) {
-        std::get<1>(item) = distance;
-        this->propagateWant(cypherkey, distance);
-      }
-      std::remove_if(std::get<2>(item).begin(), std::get<2>(item).end(),
-                     [&replyTo](auto existingTarget) {
-                       return !existingTarget.IsValid() ||
-                           existingTarget == replyTo;
-                     });
-      if (replyTo.IsValid())
-        std::get<2>(item).push_back(replyTo);
-      return;
+  if (auto item = this->wanted.find(cypherkey); item != this->wanted.end()) {
+    Want &want = item->second;
+    if (distance < want.distance) {
+      want.distance = distance;
+      this->propagateWant(cypherkey, distance);
     }
+    want.subscribers.erase(
+        std::remove_if(want.subscribers.begin(), want.subscribers.end(),
+                       [&replyTo](auto &existingTarget) {
+                         return !existingTarget.IsValid() ||
+                             existingTarget == replyTo;
+                       }),
+        want.subscribers.end());
+    if (replyTo.IsValid()) {
+      want.subscribers.push_back(replyTo);
+      want.subscribed = true;
+    }
+    return;
   }
   {
-    BQuery check;
-    check.SetVolume(&this->volume);
-    check.PushAttr("HABITAT:cypherkey");
-    check.PushString(cypherkey.String());
-    check.PushOp(B_EQ);
     entry_ref ref;
-    if (check.Fetch() == B_OK && check.GetNextRef(&ref) == B_OK) {
+    if (this->index->find(cypherkey, &ref) == B_OK) {
       BMessage mimic(B_QUERY_UPDATE);
       mimic.AddInt32("opcode", B_ENTRY_CREATED);
       mimic.AddInt32("device", ref.device);
@@ -445,30 +1053,67 @@ void Wanted::_addWant_(BString &cypherkey, int8 distance, BMessenger replyTo) {
     }
   }
   {
-    this->wanted.push_back(std::tuple(BString(cypherkey), distance,
-                                      std::vector<BMessenger>{replyTo},
-                                      std::queue<muxrpc::Connection *>()));
+    Want want{distance, {}, replyTo.IsValid()};
+    if (replyTo.IsValid())
+      want.subscribers.push_back(replyTo);
+    this->wanted.emplace(cypherkey, std::move(want));
     this->propagateWant(cypherkey, distance);
     BMessenger(this->Looper()).SendMessage('UQRY');
   }
 }
 
 void Wanted::sawSource(const BString &cypherkey,
-                       muxrpc::Connection *connection) {
-  for (auto &item : this->wanted) {
-    if (std::get<0>(item) == cypherkey) {
-      auto &q = std::get<3>(item);
-      bool needStart = q.empty();
-      q.push(connection);
-      if (needStart)
-        this->fetch(cypherkey, connection);
-      break;
+                       muxrpc::Connection *connection, off_t size) {
+  if (this->wanted.find(cypherkey) != this->wanted.end())
+    this->fetch(cypherkey, connection, size);
+}
+
+bool Wanted::reserveTransfer(muxrpc::Connection *connection) {
+  int32 &count = this->transfers[connection];
+  if (count >= BLOB_TRANSFERS_PER_CONNECTION)
+    return false;
+  count++;
+  return true;
+}
+
+void Wanted::releaseTransfer(muxrpc::Connection *connection) {
+  if (auto count = this->transfers.find(connection);
+      count != this->transfers.end() && --count->second <= 0) {
+    this->transfers.erase(count);
+  }
+  for (auto &download : this->downloads)
+    download.second->schedule();
+}
+
+// Called as `connection` closes. Downloads left with nobody to fetch from
+// are put away; what they verified stays on disk for the next attempt.
+void Wanted::dropSource(muxrpc::Connection *connection) {
+  this->transfers.erase(connection);
+  for (auto download = this->downloads.begin();
+       download != this->downloads.end();) {
+    if (download->second->dropSource(connection)) {
+      download->second->schedule();
+      download++;
+    } else {
+      download = this->downloads.erase(download);
+    }
+  }
+  // Streams from the peer will never end, and must not be answered.
+  BLooper *looper = this->Looper();
+  for (int32 i = looper->CountHandlers() - 1; i >= 0; i--) {
+    BHandler *handler = looper->HandlerAt(i);
+    auto range = dynamic_cast<RangeSink *>(handler);
+    auto wants = dynamic_cast<WantSink *>(handler);
+    if ((range != NULL && range->connection == connection) ||
+        (wants != NULL && wants->connection == connection)) {
+      looper->RemoveHandler(handler);
+      delete handler;
     }
   }
 }
 
 status_t Wanted::fetch(const BString &cypherkey,
-                       muxrpc::Connection *connection) {
+                       muxrpc::Connection *connection, off_t size) {
   std::vector<unsigned char> rawHash;
   {
     if (!cypherkey.StartsWith("&") || !cypherkey.EndsWith(".sha256"))
@@ -479,26 +1124,17 @@ status_t Wanted::fetch(const BString &cypherkey,
   }
   if (rawHash.size() != crypto_hash_sha256_BYTES)
     return B_BAD_VALUE;
-  {
-    BQuery check;
-    check.SetVolume(&this->volume);
-    check.PushAttr("HABITAT:cypherkey");
-    check.PushString(cypherkey.String());
-    check.PushOp(B_EQ);
-    entry_ref ref;
-    if (check.Fetch() == B_OK && check.GetNextRef(&ref) == B_OK)
-      return B_OK;
+  if (this->index->has(cypherkey))
+    return B_OK;
+  auto download = this->downloads.find(cypherkey);
+  if (download == this->downloads.end()) {
+    download = this->downloads
+                   .emplace(cypherkey, std::make_unique<Download>(
+                                           this, rawHash.data(), cypherkey,
+                                           this->dir, this->index.get()))
+                   .first;
   }
-  FetchSink *sink = new FetchSink(rawHash.data(), this->dir);
-  BLooper *looper = this->Looper();
-  looper->Lock();
-  looper->AddHandler(sink);
-  looper->Unlock();
-  std::vector<BString> methodName = {"blobs", "get"};
-  BMessage args('JSAR');
-  args.AddString("0", cypherkey.String());
-  connection->request(methodName, muxrpc::RequestType::SOURCE, &args,
-                      BMessenger(sink), NULL);
+  download->second->addSource(connection, size);
   return B_OK;
 }
 
@@ -540,65 +1176,201 @@ void Wanted::pullWants(muxrpc::Connection *connection) {
   BMessage args('JSAR');
   connection->request(name, muxrpc::RequestType::SOURCE, &args,
                       BMessenger(sink), &outbound);
+  connection->addCloseHook([registry = BMessenger(this), connection]() {
+    if (!registry.LockTarget())
+      return;
+    BLooper *looper;
+    if (auto wanted = dynamic_cast<Wanted *>(registry.Target(&looper)))
+      wanted->dropSource(connection);
+    looper->Unlock();
+  });
+}
+
+static bool nearestFirst(const std::pair<int8, BString> &a,
+                         const std::pair<int8, BString> &b) {
+  return a.first > b.first;
 }
 
 void Wanted::sendWants(BMessenger target) {
-  for (auto &want : this->wanted) {
+  this->expireWants();
+  std::vector<std::pair<int8, BString>> order;
+  order.reserve(this->wanted.size());
+  for (auto &want : this->wanted)
+    order.push_back({want.second.distance, want.first});
+  std::make_heap(order.begin(), order.end(), nearestFirst);
+  while (!order.empty()) {
     BMessage message('WANT');
-    message.AddString("cypherkey", std::get<0>(want));
-    message.AddInt8("distance", std::get<1>(want));
+    for (int i = 0; i < WANT_BATCH && !order.empty(); i++) {
+      std::pop_heap(order.begin(), order.end(), nearestFirst);
+      message.AddString("cypherkey", order.back().second);
+      message.AddInt8("distance", order.back().first);
+      order.pop_back();
+    }
     target.SendMessage(&message);
   }
 }
 
+// Wants are queued and sent to every WantSource in batches, nearest first,
+// once the current burst of messages has been handled.
 void Wanted::propagateWant(BString &cypherkey, int8 distance) {
-  {
-    BQuery query;
-    query.SetVolume(&this->volume);
-    query.PushAttr("HABITAT:cypherkey");
-    query.PushString(cypherkey.String());
-    query.PushOp(B_EQ);
-    if (query.Fetch() != B_OK)
-      goto propagate;
-    entry_ref ref;
-    if (query.GetNextRef(&ref) == B_OK)
-      return;
+  if (this->index->has(cypherkey))
+    return;
+  this->unsent.push_back({distance, cypherkey});
+  std::push_heap(this->unsent.begin(), this->unsent.end(), nearestFirst);
+  if (!this->flushPending) {
+    this->flushPending = true;
+    BMessenger(this).SendMessage('FWNT');
   }
-propagate:
-  if (BLooper *looper = this->Looper(); looper) {
-    std::vector<WantSource *> targets;
-    looper->Lock();
-    for (int32 i = looper->CountHandlers() - 1; i >= 0; i--) {
-      if (WantSource *source = dynamic_cast<WantSource *>(looper->HandlerAt(i));
-          source) {
-        targets.push_back(source);
-      }
+}
+
+void Wanted::flushWants() {
+  this->flushPending = false;
+  this->expireWants();
+  std::vector<BMessage> batches;
+  std::unordered_map<BString, bool, BStringHash> sent;
+  int inBatch = 0;
+  while (!this->unsent.empty()) {
+    std::pop_heap(this->unsent.begin(), this->unsent.end(), nearestFirst);
+    auto [distance, cypherkey] = std::move(this->unsent.back());
+    this->unsent.pop_back();
+    auto want = this->wanted.find(cypherkey);
+    if (want == this->wanted.end() || want->second.distance != distance ||
+        !sent.emplace(cypherkey, true).second) {
+      continue;
     }
-    looper->Unlock();
-    BMessage message('WANT');
-    message.AddString("cypherkey", cypherkey);
-    message.AddInt8("distance", distance);
+    if (inBatch == WANT_BATCH || batches.empty()) {
+      batches.push_back(BMessage('WANT'));
+      inBatch = 0;
+    }
+    batches.back().AddString("cypherkey", cypherkey);
+    batches.back().AddInt8("distance", distance);
+    inBatch++;
+  }
+  BLooper *looper = this->Looper();
+  if (batches.empty() || looper == NULL)
+    return;
+  std::vector<WantSource *> targets;
+  looper->Lock();
+  for (int32 i = looper->CountHandlers() - 1; i >= 0; i--) {
+    if (WantSource *source = dynamic_cast<WantSource *>(looper->HandlerAt(i));
+        source) {
+      targets.push_back(source);
+    }
+  }
+  looper->Unlock();
+  for (auto &message : batches) {
     for (auto target : targets)
       BMessenger(target).SendMessage(&message);
   }
 }
 
-status_t Wanted::hashFile(entry_ref *ref) {
+void Wanted::expireWants() {
+  for (auto item = this->wanted.begin(); item != this->wanted.end();) {
+    auto &subscribers = item->second.subscribers;
+    subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(),
+                                     [](auto &target) {
+                                       return !target.IsValid();
+                                     }),
+                      subscribers.end());
+    if (item->second.subscribed && subscribers.empty()) {
+      this->downloads.erase(item->first);
+      item = this->wanted.erase(item);
+    } else {
+      item++;
+    }
+  }
+}
+
+namespace {
+status_t hashOne(const entry_ref *ref, BlobIndex *index) {
   ssize_t readBytes;
   BFile file(ref, B_READ_ONLY);
-  unsigned char buffer[1024];
+  if (status_t result = file.InitCheck(); result != B_OK)
+    return result;
+  std::unique_ptr<unsigned char[]> buffer(
+      new unsigned char[BLOB_BUFFER_SIZE]);
   crypto_hash_sha256_state state;
   crypto_hash_sha256_init(&state);
-  while ((readBytes = file.Read(buffer, sizeof(buffer))) > 0)
-    if (crypto_hash_sha256_update(&state, buffer, readBytes) < 0)
+  while ((readBytes = file.Read(buffer.get(), BLOB_BUFFER_SIZE)) > 0)
+    if (crypto_hash_sha256_update(&state, buffer.get(), readBytes) < 0)
       return B_ERROR;
-  if (crypto_hash_sha256_final(&state, buffer) < 0)
+  if (readBytes < 0)
+    return readBytes;
+  if (crypto_hash_sha256_final(&state, buffer.get()) < 0)
     return B_ERROR;
   BString attr("&");
   attr.Append(
-      base64::encode(buffer, crypto_hash_sha256_BYTES, base64::STANDARD));
+      base64::encode(buffer.get(), crypto_hash_sha256_BYTES, base64::STANDARD));
   attr.Append(".sha256");
-  return file.WriteAttrString("HABITAT:cypherkey", &attr);
+  ssize_t written = file.WriteAttrString("HABITAT:cypherkey", &attr);
+  if (written < 0)
+    return written;
+  off_t size;
+  if (status_t result = file.GetSize(&size); result != B_OK)
+    return result;
+  return index->add(attr, ref, size);
+}
+
+struct HashBatch {
+  BlobIndex *index;
+  std::vector<entry_ref> refs;
+  std::atomic<size_t> next = 0;
+  std::atomic<status_t> result = B_OK;
+};
+
+int32 hashWorker(void *data) {
+  HashBatch *batch = (HashBatch *)data;
+  for (size_t i = batch->next++; i < batch->refs.size(); i = batch->next++) {
+    if (status_t result = hashOne(&batch->refs[i], batch->index);
+        result != B_OK) {
+      status_t expected = B_OK;
+      batch->result.compare_exchange_strong(expected, result);
+    }
+  }
+  return B_OK;
+}
+
+void collectFiles(BDirectory *dir, std::vector<entry_ref> *refs) {
+  BEntry entry;
+  while (dir->GetNextEntry(&entry, true) == B_OK) {
+    if (entry.IsDirectory()) {
+      BDirectory child(&entry);
+      collectFiles(&child, refs);
+    } else if (entry_ref ref; entry.IsFile() && entry.GetRef(&ref) == B_OK) {
+      refs->push_back(ref);
+    }
+  }
+}
+} // namespace
+
+status_t Wanted::hashFile(entry_ref *ref) {
+  BEntry entry(ref, true);
+  if (!entry.IsDirectory())
+    return hashOne(ref, this->index.get());
+  // Importing a directory hashes its files on a pool of threads, one per CPU.
+  HashBatch batch{this->index.get()};
+  {
+    BDirectory dir(&entry);
+    collectFiles(&dir, &batch.refs);
+  }
+  system_info info;
+  uint32 workers = 1;
+  if (get_system_info(&info) == B_OK && info.cpu_count > 1)
+    workers = info.cpu_count;
+  workers = std::min<size_t>(workers, batch.refs.size());
+  std::vector<thread_id> threads;
+  for (uint32 i = 1; i < workers; i++) {
+    thread_id thread =
+        spawn_thread(hashWorker, "Blob hasher", B_LOW_PRIORITY, &batch);
+    if (thread >= B_OK && resume_thread(thread) == B_OK)
+      threads.push_back(thread);
+  }
+  hashWorker(&batch);
+  for (auto thread : threads) {
+    status_t exitValue;
+    wait_for_thread(thread, &exitValue);
+  }
+  return batch.result;
 }
 
 Has::Has(Wanted *wanted)
@@ -626,7 +1398,10 @@ void Wanted::registerMethods(muxrpc::MethodSuite &methods) {
     Wanted *registry;
   };
   methods.registerConnectionHook(std::make_shared<CallCreateWants>(this));
-  methods.registerMethod(std::make_shared<Get>(this->Looper(), this->volume));
+  methods.registerMethod(
+      std::make_shared<Get>(this->Looper(), this->index.get()));
+  methods.registerMethod(
+      std::make_shared<GetSlice>(this->Looper(), this->index.get()));
   methods.registerMethod(std::make_shared<CreateWants>(this));
 }
 
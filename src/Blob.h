@@ -4,16 +4,52 @@
 #include "MUXRPC.h"
 #include "Post.h"
 #include <Directory.h>
+#include <Locker.h>
 #include <Query.h>
 #include <Volume.h>
+#include <map>
 #include <memory>
 #include <queue>
-#include <tuple>
+#include <set>
+#include <sqlite3.h>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 namespace blob {
 
 class Wanted;
+class Download;
+
+// Which blobs we hold, and where. A bloom filter answers most "do we have
+// this?" questions without touching the database. Safe to use from any
+// thread.
+class BlobIndex {
+public:
+  BlobIndex(sqlite3 *database);
+  ~BlobIndex();
+  bool has(const BString &cypherkey);
+  status_t find(const BString &cypherkey, entry_ref *ref, off_t *size = NULL);
+  status_t add(const BString &cypherkey, const entry_ref *ref, off_t size);
+  status_t remove(const BString &cypherkey);
+  status_t import(BVolume *volume);
+
+private:
+  void remember(const BString &cypherkey);
+  bool mayHave(const BString &cypherkey);
+  void rebuild();
+  void flushTouched();
+  sqlite3 *database;
+  sqlite3_stmt *lookup = NULL;
+  sqlite3_stmt *insert = NULL;
+  sqlite3_stmt *touch = NULL;
+  sqlite3_stmt *erase = NULL;
+  std::vector<uint64> bloom;
+  uint64 entries = 0;
+  // Blobs read since their access times were last written.
+  std::set<BString> touched;
+  BLocker lock;
+};
 
 class LocalHandler : public BHandler {
 public:
@@ -26,17 +62,27 @@ private:
 
 class Get : public muxrpc::Method {
 public:
-  Get(BLooper *looper, BVolume volume);
+  Get(BLooper *looper, BlobIndex *index);
   status_t call(muxrpc::Connection *connection, muxrpc::RequestType type,
                 BMessage *args, BMessenger replyTo,
                 BMessenger *inbound) override;
 
 private:
   BLooper *looper;
-  BVolume volume;
+  BlobIndex *index;
 };
 
-class GetSlice : public muxrpc::Method {};
+class GetSlice : public muxrpc::Method {
+public:
+  GetSlice(BLooper *looper, BlobIndex *index);
+  status_t call(muxrpc::Connection *connection, muxrpc::RequestType type,
+                BMessage *args, BMessenger replyTo,
+                BMessenger *inbound) override;
+
+private:
+  BLooper *looper;
+  BlobIndex *index;
+};
 
 class Has : public muxrpc::Method {
 public:
@@ -60,9 +106,23 @@ private:
   Wanted *wanted;
 };
 
+struct BStringHash {
+  size_t operator()(const BString &key) const {
+    return std::hash<std::string_view>()(
+        std::string_view(key.String(), key.Length()));
+  }
+};
+
+struct Want {
+  int8 distance;
+  std::vector<BMessenger> subscribers;
+  // Wants that had subscribers expire once all of them have gone away.
+  bool subscribed;
+};
+
 class Wanted : public BHandler {
 public:
-  Wanted(BDirectory dir);
+  Wanted(BDirectory dir, sqlite3 *database);
   ~Wanted();
   void MessageReceived(BMessage *message) override;
   void addWant(BString &cypherkey, int8 distance,
@@ -72,17 +132,27 @@ public:
   void propagateWant(BString &cypherkey, int8 distance);
   void registerMethods(muxrpc::MethodSuite &methods);
   status_t hashFile(entry_ref *ref);
-  void sawSource(const BString &cypherkey, muxrpc::Connection *connection);
+  void sawSource(const BString &cypherkey, muxrpc::Connection *connection,
+                 off_t size);
+  bool reserveTransfer(muxrpc::Connection *connection);
+  void releaseTransfer(muxrpc::Connection *connection);
+  void dropSource(muxrpc::Connection *connection);
 
 private:
   void _addWant_(BString &cypherkey, int8 distance,
                  BMessenger replyTo = BMessenger());
-  status_t fetch(const BString &cypherkey, muxrpc::Connection *connection);
-  std::vector<std::tuple<BString, int8, std::vector<BMessenger>,
-                         std::queue<muxrpc::Connection *>>>
-      wanted;
+  status_t fetch(const BString &cypherkey, muxrpc::Connection *connection,
+                 off_t size);
+  void flushWants();
+  void expireWants();
+  std::unordered_map<BString, Want, BStringHash> wanted;
+  std::vector<std::pair<int8, BString>> unsent;
+  bool flushPending = false;
+  std::map<BString, std::unique_ptr<Download>> downloads;
+  std::map<muxrpc::Connection *, int32> transfers;
   BDirectory dir;
   BVolume volume;
+  std::unique_ptr<BlobIndex> index;
 };
 } // namespace blob
 
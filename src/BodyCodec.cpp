@@ -0,0 +1,279 @@
+#include "BodyCodec.h"
+#include <Autolock.h>
+#include <Locker.h>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <vector>
+#include <zdict.h>
+#include <zstd.h>
+
+#define BODY_COMPRESSION_LEVEL 3
+#define BODY_DICTIONARY_SIZE (112 * 1024)
+#define BODY_TRAINING_SAMPLES 16384
+#define BODY_TRAINING_MINIMUM 256
+
+namespace body {
+namespace {
+// Decoding dictionaries are only ever added, never freed, so one that has been
+// looked up can still be used after the lock is released. The encoder is
+// shared instead, as a newer dictionary replaces it.
+struct Dictionaries {
+  BLocker lock{"Body dictionaries"};
+  std::map<uint32, ZSTD_DDict *> decoders;
+  std::shared_ptr<ZSTD_CDict> encoder;
+  uint32 encoderID = 0;
+  bool compressing = false;
+};
+
+Dictionaries &dictionaries() {
+  static Dictionaries instance;
+  return instance;
+}
+
+struct Contexts {
+  Contexts()
+      : compress(ZSTD_createCCtx()),
+        decompress(ZSTD_createDCtx()) {}
+  ~Contexts() {
+    ZSTD_freeCCtx(this->compress);
+    ZSTD_freeDCtx(this->decompress);
+  }
+  ZSTD_CCtx *compress;
+  ZSTD_DCtx *decompress;
+};
+
+Contexts &contexts() {
+  thread_local Contexts instance;
+  return instance;
+}
+
+bool isFrame(const void *data, size_t size) {
+  return size >= 4 && memcmp(data, "\x28\xb5\x2f\xfd", 4) == 0;
+}
+
+status_t expand(const void *data, size_t size, std::vector<char> *raw) {
+  unsigned long long rawSize = ZSTD_getFrameContentSize(data, size);
+  if (rawSize == ZSTD_CONTENTSIZE_ERROR || rawSize == ZSTD_CONTENTSIZE_UNKNOWN)
+    return B_BAD_DATA;
+  ZSTD_DDict *decoder;
+  {
+    auto &d = dictionaries();
+    BAutolock lock(d.lock);
+    auto found = d.decoders.find(ZSTD_getDictID_fromFrame(data, size));
+    if (found == d.decoders.end())
+      return B_NAME_NOT_FOUND;
+    decoder = found->second;
+  }
+  raw->resize(rawSize);
+  size_t result = ZSTD_decompress_usingDDict(
+      contexts().decompress, raw->data(), raw->size(), data, size, decoder);
+  if (ZSTD_isError(result) || result != rawSize)
+    return B_BAD_DATA;
+  return B_OK;
+}
+
+// Compresses `raw` into a new buffer, unless that would not make it smaller.
+bool pack(const char *raw, size_t rawSize, ZSTD_CDict *encoder, char **buffer,
+          size_t *size) {
+  size_t bound = ZSTD_compressBound(rawSize);
+  std::unique_ptr<char[]> packed(new char[bound]);
+  size_t packedSize = ZSTD_compress_usingCDict(
+      contexts().compress, packed.get(), bound, raw, rawSize, encoder);
+  if (ZSTD_isError(packedSize) || packedSize >= rawSize)
+    return false;
+  *buffer = packed.release();
+  *size = packedSize;
+  return true;
+}
+
+std::shared_ptr<ZSTD_CDict> currentEncoder(uint32 *id = NULL) {
+  auto &d = dictionaries();
+  BAutolock lock(d.lock);
+  if (id != NULL)
+    *id = d.encoderID;
+  return d.encoder;
+}
+} // namespace
+
+// Loads any dictionaries in `database` that we don't have yet. The newest is
+// used for compressing, and only built into an encoder when it changes.
+status_t load(sqlite3 *database) {
+  sqlite3_stmt *query;
+  if (sqlite3_prepare_v2(
+          database, "SELECT dictionary FROM dictionaries ORDER BY rowid DESC",
+          -1, &query, NULL) != SQLITE_OK) {
+    return B_ERROR;
+  }
+  auto &d = dictionaries();
+  BAutolock lock(d.lock);
+  bool newest = true;
+  while (sqlite3_step(query) == SQLITE_ROW) {
+    const void *dictionary = sqlite3_column_blob(query, 0);
+    size_t size = sqlite3_column_bytes(query, 0);
+    uint32 id = ZDICT_getDictID(dictionary, size);
+    if (id == 0)
+      continue;
+    if (d.decoders.count(id) == 0)
+      d.decoders[id] = ZSTD_createDDict(dictionary, size);
+    if (newest && d.encoderID != id) {
+      d.encoder.reset(
+          ZSTD_createCDict(dictionary, size, BODY_COMPRESSION_LEVEL),
+          ZSTD_freeCDict);
+      d.encoderID = id;
+    }
+    newest = false;
+  }
+  sqlite3_finalize(query);
+  return d.encoder != NULL ? B_OK : B_NAME_NOT_FOUND;
+}
+
+// Trains a new dictionary on a random sample of the stored bodies and makes
+// it the one used for compressing.
+status_t train(sqlite3 *database) {
+  sqlite3_stmt *query;
+  sqlite3_prepare_v2(database,
+                     "SELECT body FROM messages WHERE rowid IN "
+                     "(SELECT rowid FROM messages ORDER BY random() LIMIT ?)",
+                     -1, &query, NULL);
+  sqlite3_bind_int(query, 1, BODY_TRAINING_SAMPLES);
+  std::vector<char> samples;
+  std::vector<size_t> sizes;
+  while (sqlite3_step(query) == SQLITE_ROW) {
+    auto data = (const char *)sqlite3_column_blob(query, 0);
+    size_t size = sqlite3_column_bytes(query, 0);
+    if (data == NULL)
+      continue;
+    if (isFrame(data, size)) {
+      std::vector<char> raw;
+      if (expand(data, size, &raw) != B_OK)
+        continue;
+      samples.insert(samples.end(), raw.begin(), raw.end());
+      sizes.push_back(raw.size());
+    } else {
+      samples.insert(samples.end(), data, data + size);
+      sizes.push_back(size);
+    }
+  }
+  sqlite3_finalize(query);
+  if (sizes.size() < BODY_TRAINING_MINIMUM)
+    return B_NOT_ALLOWED;
+  std::vector<char> dictionary(BODY_DICTIONARY_SIZE);
+  size_t dictionarySize =
+      ZDICT_trainFromBuffer(dictionary.data(), dictionary.size(),
+                            samples.data(), sizes.data(), sizes.size());
+  if (ZDICT_isError(dictionarySize))
+    return B_ERROR;
+  sqlite3_stmt *insert;
+  sqlite3_prepare_v2(database,
+                     "INSERT INTO dictionaries(dictionary) VALUES(?)", -1,
+                     &insert, NULL);
+  sqlite3_bind_blob64(insert, 1, dictionary.data(), dictionarySize,
+                      SQLITE_STATIC);
+  int result = sqlite3_step(insert);
+  sqlite3_finalize(insert);
+  if (result != SQLITE_DONE)
+    return B_ERROR;
+  return load(database);
+}
+
+void setCompressing(bool compressing) {
+  auto &d = dictionaries();
+  BAutolock lock(d.lock);
+  d.compressing = compressing;
+}
+
+bool isCompressing() {
+  auto &d = dictionaries();
+  BAutolock lock(d.lock);
+  return d.compressing && d.encoder != NULL;
+}
+
+// Flattens `message` into a buffer allocated with new[], compressed if that
+// is turned on and helps.
+status_t flatten(const BMessage &message, char **buffer, size_t *size) {
+  ssize_t flatSize = message.FlattenedSize();
+  if (flatSize < 0)
+    return flatSize;
+  char *flat = new char[flatSize];
+  if (status_t error = message.Flatten(flat, flatSize); error != B_OK) {
+    delete[] flat;
+    return error;
+  }
+  std::shared_ptr<ZSTD_CDict> encoder;
+  if (isCompressing())
+    encoder = currentEncoder();
+  if (encoder != NULL && pack(flat, flatSize, encoder.get(), buffer, size)) {
+    delete[] flat;
+    return B_OK;
+  }
+  *buffer = flat;
+  *size = flatSize;
+  return B_OK;
+}
+
+status_t unflatten(BMessage *message, const void *data, size_t size) {
+  if (data == NULL)
+    return B_BAD_VALUE;
+  if (!isFrame(data, size))
+    return message->Unflatten((const char *)data);
+  std::vector<char> raw;
+  if (status_t error = expand(data, size, &raw); error != B_OK)
+    return error;
+  return message->Unflatten(raw.data());
+}
+
+// Rewrites up to `limit` bodies after `*cursor` with the current dictionary,
+// moving the cursor on. Returns B_ENTRY_NOT_FOUND once there are none left.
+status_t recompress(sqlite3 *database, int64 *cursor, int32 limit) {
+  uint32 encoderID;
+  std::shared_ptr<ZSTD_CDict> encoder = currentEncoder(&encoderID);
+  if (encoder == NULL)
+    return B_NO_INIT;
+  std::vector<std::pair<int64, std::vector<char>>> rows;
+  int32 seen = 0;
+  {
+    sqlite3_stmt *query;
+    sqlite3_prepare_v2(database,
+                       "SELECT rowid, body FROM messages WHERE rowid > ? "
+                       "ORDER BY rowid LIMIT ?",
+                       -1, &query, NULL);
+    sqlite3_bind_int64(query, 1, *cursor);
+    sqlite3_bind_int(query, 2, limit);
+    while (sqlite3_step(query) == SQLITE_ROW) {
+      seen++;
+      *cursor = sqlite3_column_int64(query, 0);
+      auto data = (const char *)sqlite3_column_blob(query, 1);
+      size_t size = sqlite3_column_bytes(query, 1);
+      if (data == NULL)
+        continue;
+      if (!isFrame(data, size)) {
+        rows.push_back({*cursor, std::vector<char>(data, data + size)});
+      } else if (ZSTD_getDictID_fromFrame(data, size) != encoderID) {
+        std::vector<char> raw;
+        if (expand(data, size, &raw) == B_OK)
+          rows.push_back({*cursor, std::move(raw)});
+      }
+    }
+    sqlite3_finalize(query);
+  }
+  if (seen == 0)
+    return B_ENTRY_NOT_FOUND;
+  sqlite3_stmt *update;
+  sqlite3_prepare_v2(database, "UPDATE messages SET body = ? WHERE rowid = ?",
+                     -1, &update, NULL);
+  for (auto &[rowid, raw] : rows) {
+    char *packed;
+    size_t packedSize;
+    if (!pack(raw.data(), raw.size(), encoder.get(), &packed, &packedSize))
+      continue;
+    sqlite3_bind_blob64(update, 1, packed, packedSize,
+                        [](void *arg) { delete[] (char *)arg; });
+    sqlite3_bind_int64(update, 2, rowid);
+    sqlite3_step(update);
+    sqlite3_reset(update);
+  }
+  sqlite3_finalize(update);
+  return B_OK;
+}
+} // namespace body
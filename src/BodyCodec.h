@@ -0,0 +1,21 @@
+#ifndef BODY_CODEC_H
+#define BODY_CODEC_H
+
+#include <Message.h>
+#include <SupportDefs.h>
+#include <sqlite3.h>
+
+// Message bodies are stored either as a flattened BMessage or as a zstd frame
+// of one, compressed against a dictionary kept in the `dictionaries` table.
+// Readers don't need to know which; the frame names its own dictionary.
+namespace body {
+status_t load(sqlite3 *database);
+status_t train(sqlite3 *database);
+void setCompressing(bool compressing);
+bool isCompressing();
+status_t flatten(const BMessage &message, char **buffer, size_t *size);
+status_t unflatten(BMessage *message, const void *data, size_t size);
+status_t recompress(sqlite3 *database, int64 *cursor, int32 limit);
+} // namespace body
+
+#endif // BODY_CODEC_H
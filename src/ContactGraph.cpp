@@ -5,6 +5,10 @@
 #include <Looper.h>
 #include <Query.h>
 
+#define COMPACT_PENDING_MIN 1024
+#define GRAPH_CHANGES_KEPT 65536
+#define CONTACT_BATCH 64
+
 ContactSelection &ContactSelection::operator+=(const ContactSelection &other) {
 #define MERGE_ONE(prop)                                                        \
   if (other.prop.size() > 0)                                                   \
@@ -12,6 +16,7 @@ ContactSelection &ContactSelection::operator+=(const ContactSelection &other) {
   MERGE_ONE(selected);
   MERGE_ONE(blocked);
   MERGE_ONE(own);
+  MERGE_ONE(changed);
 #undef MERGE_ONE
   return *this;
 }
@@ -35,14 +40,272 @@ std::set<BString> ContactSelection::combine() const {
   return result;
 }
 
+void HopDistances::reset(const CompactGraph &graph,
+                         const std::vector<node_id> &roots, uint32 limit,
+                         std::vector<node_id> *changed) {
+  node_id size = graph.size();
+  this->roots = roots;
+  this->limit = limit;
+  this->distances.assign(size, kUnreached);
+  this->isRoot.assign(size, false);
+  this->blocks.assign(size, false);
+  for (node_id root : roots) {
+    this->isRoot[root] = true;
+    graph.forEachOut(root, [&](node_id other, uint8 flags) {
+      if (flags & CompactGraph::kBlocking)
+        this->blocks[other] = true;
+    });
+  }
+  std::vector<node_id> queue;
+  for (node_id root : roots) {
+    if (!this->blocks[root] && this->distances[root] != 0) {
+      this->distances[root] = 0;
+      queue.push_back(root);
+    }
+  }
+  this->relax(graph, &queue);
+  this->previous.clear();
+  changed->resize(size);
+  for (node_id node = 0; node < size; node++)
+    (*changed)[node] = node;
+}
+
+// Nodes can only get further away when an edge into them goes, or when they
+// are blocked, and then only if nothing else at the same depth still leads to
+// them. Those, and whatever was only reached through them, are found level by
+// level and searched for again from their neighbours, along with the targets
+// of the changed edges, which may have come closer.
+void HopDistances::update(const CompactGraph &graph,
+                          const GraphChange *changes, size_t count,
+                          std::vector<node_id> *changed) {
+  node_id size = graph.size();
+  if (this->distances.size() < size) {
+    this->distances.resize(size, kUnreached);
+    this->isRoot.resize(size, false);
+    this->blocks.resize(size, false);
+  }
+  std::vector<node_id> touched;
+  for (size_t i = 0; i < count; i++) {
+    node_id to = changes[i].to;
+    touched.push_back(to);
+    if (!this->isRoot[changes[i].from])
+      continue;
+    bool blocked = std::any_of(
+        this->roots.begin(), this->roots.end(), [&](node_id root) {
+          return graph.flags(root, to) & CompactGraph::kBlocking;
+        });
+    if (blocked != this->blocks[to]) {
+      this->remember(to);
+      this->blocks[to] = blocked;
+    }
+  }
+
+  std::vector<std::vector<node_id>> levels(this->limit + 1);
+  for (node_id node : touched) {
+    if (this->distances[node] <= this->limit)
+      levels[this->distances[node]].push_back(node);
+  }
+  std::unordered_set<node_id> affected;
+  for (uint32 level = 0; level <= this->limit; level++) {
+    for (node_id node : levels[level]) {
+      if (this->distances[node] != level || affected.count(node) > 0)
+        continue;
+      if (!this->blocks[node]) {
+        bool parent = level == 0 && this->isRoot[node];
+        graph.forEachIn(node, [&](node_id other, uint8 flags) {
+          parent = parent || (follows(flags) && level > 0 &&
+                               this->distances[other] == level - 1 &&
+                               affected.count(other) == 0);
+        });
+        if (parent)
+          continue;
+      }
+      affected.insert(node);
+      if (level == this->limit)
+        continue;
+      graph.forEachOut(node, [&](node_id other, uint8 flags) {
+        if (follows(flags) && this->distances[other] == level + 1)
+          levels[level + 1].push_back(other);
+      });
+    }
+  }
+
+  for (node_id node : affected) {
+    this->remember(node);
+    this->distances[node] = kUnreached;
+  }
+  std::vector<node_id> queue;
+  auto seed = [&](node_id node) {
+    if (uint32 hops = this->supported(graph, node);
+        hops < this->distances[node]) {
+      this->remember(node);
+      this->distances[node] = hops;
+      queue.push_back(node);
+    }
+  };
+  for (node_id node : affected)
+    seed(node);
+  for (node_id node : touched)
+    seed(node);
+  this->relax(graph, &queue);
+
+  for (auto &[node, before] : this->previous) {
+    if (before != std::make_pair(this->selected(node), this->blocked(node)))
+      changed->push_back(node);
+  }
+  this->previous.clear();
+}
+
+// The distance `node` could have given its neighbours as they are now.
+uint32 HopDistances::supported(const CompactGraph &graph, node_id node) const {
+  if (this->blocks[node])
+    return kUnreached;
+  if (this->isRoot[node])
+    return 0;
+  uint32 best = kUnreached;
+  graph.forEachIn(node, [&](node_id other, uint8 flags) {
+    if (follows(flags) && this->distances[other] < this->limit)
+      best = std::min(best, this->distances[other] + 1);
+  });
+  return best;
+}
+
+void HopDistances::remember(node_id node) {
+  this->previous.try_emplace(node, this->selected(node), this->blocked(node));
+}
+
+// Passes shorter distances on from the nodes in `queue`.
+void HopDistances::relax(const CompactGraph &graph,
+                         std::vector<node_id> *queue) {
+  for (size_t head = 0; head < queue->size(); head++) {
+    node_id node = (*queue)[head];
+    uint32 hops = this->distances[node];
+    if (hops >= this->limit)
+      continue;
+    graph.forEachOut(node, [&](node_id other, uint8 flags) {
+      if (follows(flags) && !this->blocks[other] &&
+          hops + 1 < this->distances[other]) {
+        this->remember(other);
+        this->distances[other] = hops + 1;
+        queue->push_back(other);
+      }
+    });
+  }
+}
+
+// Whether `feed` is in what combine() would return.
+bool ContactSelection::contains(const BString &feed) const {
+  return this->own.count(feed) > 0 || (this->selected.count(feed) > 0 &&
+                                       this->blocked.count(feed) == 0);
+}
+
 ContactLinkState::ContactLinkState()
     : following(false),
       blocking(false),
       pub(false) {}
 
-ContactGraph::ContactGraph(BMessenger db, BMessenger store)
-    : db(db),
-      store(store) {}
+CompactGraph::node_id CompactGraph::intern(const BString &feed) {
+  auto [entry, added] = this->ids.try_emplace(feed, this->names.size());
+  if (added)
+    this->names.push_back(feed);
+  return entry->second;
+}
+
+bool CompactGraph::find(const BString &feed, node_id *id) const {
+  auto entry = this->ids.find(feed);
+  if (entry == this->ids.end())
+    return false;
+  *id = entry->second;
+  return true;
+}
+
+int64 CompactGraph::edgeIndex(node_id from, node_id to) const {
+  if (from + 1 < this->outOffsets.size()) {
+    auto begin = this->outIndex.begin() + this->outOffsets[from];
+    auto end = this->outIndex.begin() + this->outOffsets[from + 1];
+    auto found =
+        std::lower_bound(begin, end, to, [&](uint32 edge, node_id other) {
+          return this->edges[edge].to < other;
+        });
+    if (found != end && this->edges[*found].to == to)
+      return *found;
+  }
+  auto [first, last] = this->pendingOut.equal_range(from);
+  for (; first != last; first++) {
+    if (this->edges[first->second].to == to)
+      return first->second;
+  }
+  return -1;
+}
+
+uint8 CompactGraph::flags(node_id from, node_id to) const {
+  int64 edge = this->edgeIndex(from, to);
+  return edge < 0 ? 0 : this->edges[edge].flags;
+}
+
+// Sets `flag` on the edge if `sequence` is newer than whatever set it last,
+// and returns whether it did.
+bool CompactGraph::update(node_id from, node_id to, uint8 flag, bool value,
+                          int64 sequence) {
+  int64 edge = this->edgeIndex(from, to);
+  if (edge < 0) {
+    edge = this->edges.size();
+    this->edges.push_back({from, to, 0, {-1, -1, -1}});
+    this->pendingOut.insert({from, edge});
+    this->pendingIn.insert({to, edge});
+  }
+  Edge &record = this->edges[edge];
+  int32 &last = record.sequence[flag >> 1];
+  if (sequence <= last)
+    return false;
+  last = sequence;
+  if (value)
+    record.flags |= flag;
+  else
+    record.flags &= ~flag;
+  if (this->pendingOut.size() >
+      std::max<size_t>(COMPACT_PENDING_MIN, this->edges.size() / 8)) {
+    this->compact();
+  }
+  return true;
+}
+
+void CompactGraph::compact() {
+  auto build = [&](std::vector<uint32> &offsets, std::vector<uint32> &index,
+                   auto key, auto other) {
+    offsets.assign(this->names.size() + 1, 0);
+    for (auto &edge : this->edges)
+      offsets[key(edge) + 1]++;
+    for (size_t i = 1; i < offsets.size(); i++)
+      offsets[i] += offsets[i - 1];
+    index.resize(this->edges.size());
+    std::vector<uint32> fill(offsets.begin(), offsets.end() - 1);
+    for (uint32 i = 0; i < this->edges.size(); i++)
+      index[fill[key(this->edges[i])]++] = i;
+    for (size_t node = 0; node + 1 < offsets.size(); node++) {
+      std::sort(index.begin() + offsets[node],
+                index.begin() + offsets[node + 1], [&](uint32 a, uint32 b) {
+                  return other(this->edges[a]) < other(this->edges[b]);
+                });
+    }
+  };
+  auto from = [](const Edge &edge) { return edge.from; };
+  auto to = [](const Edge &edge) { return edge.to; };
+  build(this->outOffsets, this->outIndex, from, to);
+  build(this->inOffsets, this->inIndex, to, from);
+  this->pendingOut.clear();
+  this->pendingIn.clear();
+}
+
+namespace {
+const std::pair<const char *, uint8> linkProperties[] = {
+    {"following", CompactGraph::kFollowing},
+    {"blocking", CompactGraph::kBlocking},
+    {"pub", CompactGraph::kPub}};
+} // namespace
+
+ContactGraph::ContactGraph(BMessenger store)
+    : store(store) {}
 
 void ContactGraph::MessageReceived(BMessage *message) {
   switch (message->what) {
@@ -50,7 +313,23 @@ void ContactGraph::MessageReceived(BMessage *message) {
     this->sendState(message);
     break;
   case 'JSOB':
-    return logContact(message);
+    this->logContact(message);
+    // Contacts that arrive one at a time are stored together with whatever
+    // else is already queued.
+    if (this->batched == 1)
+      BMessenger(this).SendMessage('CFLS');
+    else if (this->batched >= CONTACT_BATCH)
+      this->flush();
+    break;
+  case 'PSTS': {
+    BMessage post;
+    for (int32 i = 0; message->FindMessage("post", i, &post) == B_OK; i++)
+      this->logContact(&post);
+    this->flush();
+  } break;
+  case 'CFLS':
+    this->flush();
+    break;
   case 'DONE':
     break;
   case B_REPLY:
@@ -63,9 +342,7 @@ void ContactGraph::MessageReceived(BMessage *message) {
                                    &attrtype)) != B_BAD_INDEX) {
         if (err == B_OK) {
           if (BMessage mNode; result.FindMessage(author, &mNode) == B_OK) {
-            this->graph.try_emplace(author,
-                                    std::map<BString, ContactLinkState>());
-            auto &node = this->graph.find(author)->second;
+            auto from = this->graph.intern(author);
             char *contact;
             int32 cIndex = 0;
             while ((err = mNode.GetInfo(B_MESSAGE_TYPE, cIndex, &contact,
@@ -73,25 +350,15 @@ void ContactGraph::MessageReceived(BMessage *message) {
               if (err == B_OK) {
                 if (BMessage mEdge;
                     mNode.FindMessage(contact, &mEdge) == B_OK) {
-                  node.try_emplace(contact, ContactLinkState());
-                  auto &edge = node.find(contact)->second;
-                  std::pair<const char *, Updatable<bool> *> properties[] = {
-                      {"following", &edge.following},
-                      {"blocking", &edge.blocking},
-                      {"pub", &edge.pub}};
-                  for (auto &[property, data] : properties) {
+                  auto to = this->graph.intern(contact);
+                  for (auto &[property, flag] : linkProperties) {
                     int64 sequence;
                     bool value;
                     if (BMessage mData;
                         mEdge.FindMessage(property, &mData) == B_OK &&
                         mData.FindInt64("sequence", &sequence) == B_OK &&
                         mData.FindBool("value", &value) == B_OK) {
-                      data->check(
-                          [&](auto &oldValue) {
-                            oldValue = value;
-                            return true;
-                          },
-                          sequence);
+                      this->graph.update(from, to, flag, value, sequence);
                     }
                   }
                 }
@@ -102,6 +369,10 @@ void ContactGraph::MessageReceived(BMessage *message) {
         }
         aIndex++;
       }
+      this->graph.compact();
+      // Nothing before this is described by `changes`.
+      this->changes.clear();
+      this->changeBase = ++this->generation;
       this->loaded = true;
       this->SendNotices('CTAC');
     }
@@ -111,136 +382,103 @@ void ContactGraph::MessageReceived(BMessage *message) {
   }
 }
 
+// Adds what `message` says about a link to the batch for the store, which
+// also marks it as processed.
 void ContactGraph::logContact(BMessage *message) {
+  int64 sequence;
   {
-    int64 sequence;
-    {
-      double sq;
-      if (message->FindDouble("sequence", &sq) != B_OK)
-        return;
-      sequence = (int64)sq;
-    }
-    BString author;
-    if (message->FindString("author", &author) != B_OK)
-      goto mark;
-    BMessage content;
-    if (message->FindMessage("content", &content) != B_OK)
-      goto mark;
-    BString type;
-    if (content.FindString("type", &type) != B_OK || type != "contact")
-      goto mark;
-    BString contact;
-    if (content.FindString("contact", &contact) != B_OK)
-      goto mark;
-    this->graph.try_emplace(author, std::map<BString, ContactLinkState>());
-    auto &node = this->graph.find(author)->second;
-    node.try_emplace(contact, ContactLinkState());
-    auto &edge = node.find(contact)->second;
-    bool changed = false;
-    BMessage data;
-    // TODO: DRY
-    edge.following.check(
-        [&](auto &oldValue) {
-          bool value = oldValue;
-          if (content.FindBool("following", &value) == B_OK) {
-            changed = true;
-            oldValue = value;
-            {
-              BMessage prop;
-              prop.AddBool("value", value);
-              prop.AddInt64("sequence", sequence);
-              data.AddMessage("following", &prop);
-            }
-            return true;
-          } else {
-            return false;
-          }
-        },
-        sequence);
-    edge.blocking.check(
-        [&](auto &oldValue) {
-          bool value = oldValue;
-          if (content.FindBool("blocking", &value) == B_OK) {
-            changed = true;
-            oldValue = value;
-            {
-              BMessage prop;
-              prop.AddBool("value", value);
-              prop.AddInt64("sequence", sequence);
-              data.AddMessage("blocking", &prop);
-            }
-            return true;
-          } else {
-            return false;
-          }
-        },
-        sequence);
-    edge.pub.check(
-        [&](auto &oldValue) {
-          bool value = oldValue;
-          if (content.FindBool("pub", &value) == B_OK) {
-            changed = true;
-            oldValue = value;
-            {
-              BMessage prop;
-              prop.AddBool("value", value);
-              prop.AddInt64("sequence", sequence);
-              data.AddMessage("pub", &prop);
-            }
-            return true;
-          } else {
-            return false;
-          }
-        },
-        sequence);
-    if (changed) {
-      BMessage setter(B_SET_PROPERTY);
-      setter.AddMessage("data", &data);
-      BString linkName(author);
-      linkName << ":";
-      linkName << contact;
-      setter.AddSpecifier("Contact", linkName);
-      BMessage reply;
-      status_t err;
-      if (this->loaded)
-        this->SendNotices('CTAC');
-      if (this->store.SendMessage(&setter, &reply) == B_OK &&
-          (reply.FindInt32("error", &err) != B_OK || err == B_OK)) {
-        goto mark;
-      }
-    } else {
-      goto mark;
-    }
+    double sq;
+    if (message->FindDouble("sequence", &sq) != B_OK)
+      return;
+    sequence = (int64)sq;
   }
-  if (false) {
-  mark:
-    BMessage setter2(B_SET_PROPERTY);
-    BMessage data2;
-    data2.AddBool("processed", true);
-    setter2.AddMessage("data", &data2);
+  BString cypherkey;
+  if (message->FindString("cypherkey", &cypherkey) != B_OK) {
     unsigned char msgHash[crypto_hash_sha256_BYTES];
     {
       JSON::RootSink rootSink(std::make_unique<JSON::Hash>(msgHash));
       JSON::fromBMessage(&rootSink, message);
     }
-    setter2.AddSpecifier("Post", messageCypherkey(msgHash));
-    this->db.SendMessage(&setter2);
+    cypherkey = messageCypherkey(msgHash);
+  }
+  this->batch.AddString("processed", cypherkey);
+  this->batched++;
+  BString author;
+  BMessage content;
+  BString type;
+  BString contact;
+  if (message->FindString("author", &author) != B_OK ||
+      message->FindMessage("content", &content) != B_OK ||
+      content.FindString("type", &type) != B_OK || type != "contact" ||
+      content.FindString("contact", &contact) != B_OK) {
+    return;
+  }
+  auto from = this->graph.intern(author);
+  auto to = this->graph.intern(contact);
+  uint8 before = this->graph.flags(from, to);
+  for (auto &[property, flag] : linkProperties) {
+    if (bool value; content.FindBool(property, &value) == B_OK &&
+        this->graph.update(from, to, flag, value, sequence)) {
+      BMessage link;
+      link.AddString("author", author);
+      link.AddString("contact", contact);
+      link.AddString("property", property);
+      link.AddInt64("sequence", sequence);
+      link.AddBool("value", value);
+      this->batch.AddMessage("link", &link);
+    }
+  }
+  if (uint8 after = this->graph.flags(from, to); after != before) {
+    this->changes.push_back({from, to, before, after});
+    this->generation++;
+    if (this->changes.size() >= 2 * GRAPH_CHANGES_KEPT) {
+      this->changes.erase(this->changes.begin(),
+                          this->changes.end() - GRAPH_CHANGES_KEPT);
+      this->changeBase = this->generation - GRAPH_CHANGES_KEPT;
+    }
   }
 }
 
+// Sends the batch to the store, which writes it in one transaction. The graph
+// here is already up to date, so nothing waits for the reply.
+void ContactGraph::flush() {
+  if (this->batched == 0)
+    return;
+  bool changed = this->batch.HasMessage("link");
+  this->batch.what = B_SET_PROPERTY;
+  this->batch.AddSpecifier("Contact");
+  this->store.SendMessage(&this->batch);
+  this->batch.MakeEmpty();
+  this->batched = 0;
+  if (changed && this->loaded)
+    this->SendNotices('CTAC');
+}
+
+GraphView ContactGraph::view(uint64 since) const {
+  GraphView result{&this->graph, this->generation, since, NULL, 0};
+  if (since >= this->changeBase && since <= this->generation &&
+      this->changeBase > 0) {
+    result.changes = this->changes.data() + (since - this->changeBase);
+    result.changeCount = this->generation - since;
+  }
+  return result;
+}
+
 void ContactGraph::sendState(BMessage *request) {
   BMessage reply(B_REPLY);
   BMessage result;
-  for (const auto &[node, edges] : this->graph) {
+  for (CompactGraph::node_id node = 0; node < this->graph.size(); node++) {
     BMessage branch;
-    for (const auto &[subject, edge] : edges) {
+    this->graph.forEachOut(node, [&](CompactGraph::node_id subject,
+                                     uint8 flags) {
       BMessage leaf;
-      leaf.AddBool("following", edge.following.peek());
-      leaf.AddBool("blocked", edge.blocking.peek());
-      leaf.AddBool("pub", edge.pub.peek());
-      branch.AddMessage(subject, &leaf);
-    }
-    result.AddMessage(node, &branch);
+      leaf.AddBool("following", flags & CompactGraph::kFollowing);
+      leaf.AddBool("blocked", flags & CompactGraph::kBlocking);
+      leaf.AddBool("pub", flags & CompactGraph::kPub);
+      branch.AddMessage(this->graph.name(subject), &leaf);
+    });
+    if (!branch.IsEmpty())
+      result.AddMessage(this->graph.name(node), &branch);
   }
   reply.AddMessage("result", &result);
   reply.AddInt32("error", B_OK);
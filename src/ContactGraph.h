@@ -3,19 +3,28 @@
 
 #include "Updatable.h"
 #include <Handler.h>
+#include <Message.h>
 #include <Messenger.h>
 #include <String.h>
+#include <algorithm>
+#include <cstdint>
 #include <map>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 struct ContactSelection {
   std::set<BString> selected;
   std::set<BString> blocked;
   std::set<BString> own;
+  // Feeds whose membership of the sets above changed since whoever reads the
+  // selection last looked, for selections that are updated in place.
+  std::set<BString> changed;
   ContactSelection &operator+=(const ContactSelection &other);
   ContactSelection operator+(const ContactSelection &other) const;
   std::set<BString> combine() const;
+  bool contains(const BString &feed) const;
 };
 
 struct ContactLinkState {
@@ -25,17 +34,151 @@ struct ContactLinkState {
   Updatable<bool> pub;
 };
 
+// The contact graph with feeds interned as dense ids. Edges live in one array
+// and are indexed in compressed sparse row form in both directions, sorted by
+// the id at the other end. Edges added since the index was last built are
+// kept on the side until there are enough of them to rebuild it.
+class CompactGraph {
+public:
+  typedef uint32 node_id;
+  enum : uint8 { kFollowing = 1, kBlocking = 2, kPub = 4 };
+
+  node_id intern(const BString &feed);
+  bool find(const BString &feed, node_id *id) const;
+  const BString &name(node_id id) const { return this->names[id]; }
+  node_id size() const { return this->names.size(); }
+  size_t edgeCount() const { return this->edges.size(); }
+  uint8 flags(node_id from, node_id to) const;
+  bool update(node_id from, node_id to, uint8 flag, bool value,
+              int64 sequence);
+  void compact();
+  // `visit(node_id other, uint8 flags)` is called for each edge.
+  template <class F> void forEachOut(node_id from, F &&visit) const {
+    this->forEach(this->outOffsets, this->outIndex, this->pendingOut, from,
+                  [&](const Edge &edge) { visit(edge.to, edge.flags); });
+  }
+  template <class F> void forEachIn(node_id to, F &&visit) const {
+    this->forEach(this->inOffsets, this->inIndex, this->pendingIn, to,
+                  [&](const Edge &edge) { visit(edge.from, edge.flags); });
+  }
+
+private:
+  // Sequence numbers are kept per flag, so that each one only takes updates
+  // from messages newer than the one that last set it.
+  struct Edge {
+    node_id from;
+    node_id to;
+    uint8 flags;
+    int32 sequence[3];
+  };
+  typedef std::unordered_multimap<node_id, uint32> Pending;
+  template <class F>
+  void forEach(const std::vector<uint32> &offsets,
+               const std::vector<uint32> &index, const Pending &pending,
+               node_id node, F &&visit) const {
+    if (node + 1 < offsets.size()) {
+      for (uint32 i = offsets[node]; i < offsets[node + 1]; i++)
+        visit(this->edges[index[i]]);
+    }
+    auto [first, last] = pending.equal_range(node);
+    for (; first != last; first++)
+      visit(this->edges[first->second]);
+  }
+  int64 edgeIndex(node_id from, node_id to) const;
+
+  std::vector<BString> names;
+  std::map<BString, node_id> ids;
+  std::vector<Edge> edges;
+  std::vector<uint32> outOffsets;
+  std::vector<uint32> outIndex;
+  std::vector<uint32> inOffsets;
+  std::vector<uint32> inIndex;
+  Pending pendingOut;
+  Pending pendingIn;
+};
+
+struct GraphChange {
+  CompactGraph::node_id from;
+  CompactGraph::node_id to;
+  uint8 before;
+  uint8 after;
+};
+
+// What selection plugins of ABI version 2 are given: the graph itself,
+// read-only, and the edges that changed after generation `since`. `changes`
+// is NULL when those aren't all known, on a first call or after a long gap,
+// and the whole graph should be looked at instead.
+struct GraphView {
+  const CompactGraph *graph;
+  uint64 generation;
+  uint64 since;
+  const GraphChange *changes;
+  size_t changeCount;
+};
+
+// Follow distances from a set of roots, up to a limit, kept up to date as
+// edges change by repairing only the part of the search tree they touch. A
+// feed a root blocks is never reached, and isn't followed through.
+class HopDistances {
+public:
+  typedef CompactGraph::node_id node_id;
+  static constexpr uint32 kUnreached = UINT32_MAX;
+
+  // Searches the whole graph again. Every node is reported in `changed`.
+  void reset(const CompactGraph &graph, const std::vector<node_id> &roots,
+             uint32 limit, std::vector<node_id> *changed);
+  // Repairs the distances after `changes`, which must all have happened
+  // since the last reset or update, and reports the nodes that became or
+  // stopped being selected or blocked.
+  void update(const CompactGraph &graph, const GraphChange *changes,
+              size_t count, std::vector<node_id> *changed);
+  uint32 distance(node_id node) const {
+    return node < this->distances.size() ? this->distances[node]
+                                         : kUnreached;
+  }
+  bool blocked(node_id node) const {
+    return node < this->blocks.size() && this->blocks[node];
+  }
+  // Reached within the limit, other than as a root.
+  bool selected(node_id node) const {
+    uint32 hops = this->distance(node);
+    return hops > 0 && hops <= this->limit;
+  }
+
+private:
+  static bool follows(uint8 flags) {
+    return (flags & CompactGraph::kFollowing) &&
+           !(flags & CompactGraph::kBlocking);
+  }
+  uint32 supported(const CompactGraph &graph, node_id node) const;
+  void remember(node_id node);
+  void relax(const CompactGraph &graph, std::vector<node_id> *queue);
+  std::vector<node_id> roots;
+  std::vector<uint32> distances;
+  std::vector<bool> isRoot;
+  std::vector<bool> blocks;
+  uint32 limit = 0;
+  // What nodes were before the current update, by node.
+  std::unordered_map<node_id, std::pair<bool, bool>> previous;
+};
+
 class ContactGraph : public BHandler {
 public:
-  ContactGraph(BMessenger db, BMessenger store);
+  ContactGraph(BMessenger store);
   void MessageReceived(BMessage *message) override;
+  GraphView view(uint64 since) const;
 
 private:
   void logContact(BMessage *message);
+  void flush();
   void sendState(BMessage *request);
-  std::map<BString, std::map<BString, ContactLinkState>> graph;
-  BMessenger db;
+  CompactGraph graph;
+  std::vector<GraphChange> changes;
+  uint64 changeBase = 0;
+  uint64 generation = 0;
   BMessenger store;
+  BMessage batch;
+  int32 batched = 0;
   bool loaded = false;
 };
 
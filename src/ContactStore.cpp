@@ -5,9 +5,26 @@
 #include <map>
 
 ContactStore::ContactStore(sqlite3 *database)
-    : database(database) {}
+    : database(database) {
+  sqlite3_prepare_v2(database,
+                     "INSERT INTO contacts("
+                     "author, contact, property, sequence, value) "
+                     "VALUES(?, ?, ?, ?, ?) "
+                     "ON CONFLICT(author, contact, property) DO UPDATE "
+                     "SET sequence = excluded.sequence, value = excluded.value "
+                     "WHERE excluded.sequence > contacts.sequence",
+                     -1, &this->upsert, NULL);
+  sqlite3_prepare_v2(database,
+                     "UPDATE messages SET processed = 1 WHERE cypherkey = ?",
+                     -1, &this->processed, NULL);
+}
+
+ContactStore::~ContactStore() {
+  sqlite3_finalize(this->upsert);
+  sqlite3_finalize(this->processed);
+}
 
-enum { kContact };
+enum { kContact, kContacts };
 
 static property_info properties[] = {{"Contact",
                                       {B_GET_PROPERTY, 0},
@@ -21,8 +38,69 @@ static property_info properties[] = {{"Contact",
                                       "Contact details",
                                       kContact,
                                       {}},
+                                     {"Contact",
+                                      {B_SET_PROPERTY, 0},
+                                      {B_DIRECT_SPECIFIER, 0},
+                                      "Contact details for many links, and "
+                                      "the messages they came from",
+                                      kContacts,
+                                      {}},
                                      {0}};
 
+// Stores one property of a link, unless what we have is newer.
+status_t ContactStore::store(const BString &author, const BString &contact,
+                             const char *property, int64 sequence,
+                             bool value) {
+  sqlite3_bind_text(this->upsert, 1, author.String(), author.Length(),
+                    SQLITE_STATIC);
+  sqlite3_bind_text(this->upsert, 2, contact.String(), contact.Length(),
+                    SQLITE_STATIC);
+  sqlite3_bind_text(this->upsert, 3, property, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(this->upsert, 4, sequence);
+  sqlite3_bind_int64(this->upsert, 5, value ? 1 : 0);
+  int status = sqlite3_step(this->upsert);
+  sqlite3_reset(this->upsert);
+  return status == SQLITE_DONE ? B_OK : B_IO_ERROR;
+}
+
+// Stores the links in `message` and marks the messages they came from as
+// processed, all or nothing.
+status_t ContactStore::storeBatch(BMessage *message) {
+  status_t error = B_OK;
+  sqlite3_exec(this->database, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+  BMessage link;
+  for (int32 i = 0;
+       error == B_OK && message->FindMessage("link", i, &link) == B_OK; i++) {
+    BString author;
+    BString contact;
+    const char *property;
+    int64 sequence;
+    bool value;
+    if (link.FindString("author", &author) != B_OK ||
+        link.FindString("contact", &contact) != B_OK ||
+        link.FindString("property", &property) != B_OK ||
+        link.FindInt64("sequence", &sequence) != B_OK ||
+        link.FindBool("value", &value) != B_OK) {
+      error = B_BAD_VALUE;
+      break;
+    }
+    error = this->store(author, contact, property, sequence, value);
+  }
+  const char *cypherkey;
+  for (int32 i = 0; error == B_OK &&
+                    message->FindString("processed", i, &cypherkey) == B_OK;
+       i++) {
+    sqlite3_bind_text(this->processed, 1, cypherkey, -1, SQLITE_STATIC);
+    if (sqlite3_step(this->processed) != SQLITE_DONE)
+      error = B_IO_ERROR;
+    sqlite3_reset(this->processed);
+  }
+  sqlite3_exec(this->database,
+               error == B_OK ? "END TRANSACTION;" : "ROLLBACK TRANSACTION;",
+               NULL, NULL, NULL);
+  return error;
+}
+
 void ContactStore::MessageReceived(BMessage *message) {
   if (message->HasSpecifiers()) {
     BMessage reply(B_REPLY);
@@ -125,63 +203,10 @@ void ContactStore::MessageReceived(BMessage *message) {
               bool value;
               if (state.FindInt64("sequence", &sequence) == B_OK &&
                   state.FindBool("value", &value) == B_OK) {
-                // If we ever switch to using multiple database threads then
-                // these will need to be in a transaction.
-                sqlite3_stmt *qry;
-                sqlite3_prepare_v2(this->database,
-                                   "SELECT 1 FROM contacts "
-                                   "WHERE author = ? "
-                                   "AND contact = ? "
-                                   "AND property = ?",
-                                   -1, &qry, NULL);
-                sqlite3_bind_text(qry, 1, author.String(), author.Length(),
-                                  SQLITE_STATIC);
-                sqlite3_bind_text(qry, 2, contact.String(), contact.Length(),
-                                  SQLITE_STATIC);
-                sqlite3_bind_text(qry, 3, property, -1, SQLITE_STATIC);
-                int status = sqlite3_step(qry);
-                sqlite3_finalize(qry);
-                switch (status) {
-                case SQLITE_ROW: {
-                  status = sqlite3_prepare_v2(
-                      this->database,
-                      "UPDATE contacts SET sequence = ?, value = ? "
-                      "WHERE author = ? "
-                      "AND contact = ? "
-                      "AND property = ?",
-                      -1, &qry, NULL);
-                  sqlite3_bind_int64(qry, 1, sequence);
-                  sqlite3_bind_int64(qry, 2, value ? 1 : 0);
-                  sqlite3_bind_text(qry, 3, author.String(), author.Length(),
-                                    SQLITE_STATIC);
-                  sqlite3_bind_text(qry, 4, contact.String(), contact.Length(),
-                                    SQLITE_STATIC);
-                  sqlite3_bind_text(qry, 5, property, -1, SQLITE_STATIC);
-                  status = sqlite3_step(qry);
-                  sqlite3_finalize(qry);
-                } break;
-                case SQLITE_DONE: {
-                  status = sqlite3_prepare_v2(
-                      this->database,
-                      "INSERT INTO contacts("
-                      "author, contact, property, sequence, value) "
-                      "VALUES(?,?,?,?,?)",
-                      -1, &qry, NULL);
-                  sqlite3_bind_text(qry, 1, author.String(), author.Length(),
-                                    SQLITE_STATIC);
-                  sqlite3_bind_text(qry, 2, contact.String(), contact.Length(),
-                                    SQLITE_STATIC);
-                  sqlite3_bind_text(qry, 3, property, -1, SQLITE_STATIC);
-                  sqlite3_bind_int64(qry, 4, sequence);
-                  sqlite3_bind_int64(qry, 5, value ? 1 : 0);
-                  status = sqlite3_step(qry);
-                  sqlite3_finalize(qry);
-                } break;
-                default:
+                if (this->store(author, contact, property, sequence,
+                                value) != B_OK) {
                   error = B_IO_ERROR;
                 }
-                if (status != SQLITE_DONE && status != SQLITE_ROW)
-                  error = B_IO_ERROR;
               }
             }
           }
@@ -189,6 +214,9 @@ void ContactStore::MessageReceived(BMessage *message) {
       } break;
       }
     } break;
+    case kContacts:
+      error = this->storeBatch(message);
+      break;
     default:
       return BHandler::MessageReceived(message);
     }
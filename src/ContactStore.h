@@ -2,18 +2,25 @@
 #define CONTACTSTORE_H
 
 #include <Handler.h>
+#include <String.h>
 #include <sqlite3.h>
 
 class ContactStore : public BHandler {
 public:
   ContactStore(sqlite3 *database);
+  ~ContactStore();
   void MessageReceived(BMessage *message) override;
   status_t GetSupportedSuites(BMessage *data) override;
   BHandler *ResolveSpecifier(BMessage *msg, int32 index, BMessage *specifier,
                              int32 what, const char *property) override;
 
 private:
+  status_t store(const BString &author, const BString &contact,
+                 const char *property, int64 sequence, bool value);
+  status_t storeBatch(BMessage *message);
   sqlite3 *database;
+  sqlite3_stmt *upsert;
+  sqlite3_stmt *processed;
 };
 
 #endif
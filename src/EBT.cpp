@@ -33,6 +33,99 @@ static Note compose(const LocalState &state, const LinkLocalState &linkState) {
           state.sequence, state.savedSequence};
 }
 
+void OutQueue::offer(const BString &author, uint64 next, uint64 available) {
+  if (author == this->stagedAuthor && !this->staged.empty()) {
+    if ((uint64)this->staged.front().GetDouble("sequence", 0) == next) {
+      next = (uint64)this->staged.back().GetDouble("sequence", 0) + 1;
+    } else {
+      this->clearStaged();
+    }
+  }
+  if (next > available) {
+    this->cursors.erase(author);
+    return;
+  }
+  this->cursors.insert_or_assign(author, OutCursor{next, available});
+}
+
+void OutQueue::drop(const BString &author) {
+  this->cursors.erase(author);
+  if (author == this->stagedAuthor)
+    this->clearStaged();
+}
+
+bool OutQueue::pick(size_t index, BString *author, uint64 *next) {
+  if (index >= this->cursors.size())
+    return false;
+  auto cursor = index > this->cursors.size() / 2
+      ? std::prev(this->cursors.end(), this->cursors.size() - index)
+      : std::next(this->cursors.begin(), index);
+  *author = cursor->first;
+  *next = cursor->second.next;
+  return true;
+}
+
+bool OutQueue::find(const BString &author, uint64 *next) const {
+  auto cursor = this->cursors.find(author);
+  if (cursor == this->cursors.end())
+    return false;
+  *next = cursor->second.next;
+  return true;
+}
+
+status_t OutQueue::stage(const BMessage &message) {
+  BString author;
+  JSON::number sequence;
+  if (message.FindString("author", &author) != B_OK ||
+      message.FindDouble("sequence", &sequence) != B_OK) {
+    return B_BAD_VALUE;
+  }
+  if (!this->staged.empty() && author != this->stagedAuthor)
+    return B_BUSY;
+  if (this->staged.size() >= EBT_OUT_BATCH)
+    return B_BUSY;
+  auto cursor = this->cursors.find(author);
+  if (cursor == this->cursors.end() || cursor->second.next != (uint64)sequence)
+    return B_MISMATCHED_VALUES;
+  this->stagedAuthor = author;
+  this->staged.push(message);
+  if (++cursor->second.next > cursor->second.available)
+    this->cursors.erase(cursor);
+  return B_OK;
+}
+
+BMessage *OutQueue::front() {
+  return this->staged.empty() ? NULL : &this->staged.front();
+}
+
+void OutQueue::pop() {
+  if (!this->staged.empty())
+    this->staged.pop();
+}
+
+void OutQueue::clearStaged() {
+  this->staged = std::queue<BMessage>();
+  this->stagedAuthor = "";
+}
+
+bool OutQueue::empty() const {
+  return this->cursors.empty() && this->staged.empty();
+}
+
+size_t OutQueue::cursorCount() const { return this->cursors.size(); }
+
+size_t OutQueue::stagedCount() const { return this->staged.size(); }
+
+static bool fetchedPosts(BMessage *reply) {
+  const BMessage *request = reply->Previous();
+  BMessage specifier;
+  BString property;
+  return request != NULL &&
+      request->FindMessage("specifiers", &specifier) == B_OK &&
+      specifier.FindString("property", &property) == B_OK &&
+      property == "Post";
+}
+
 Dispatcher::Dispatcher(SSBDatabase *db)
     : BLooper("EBT"),
       db(db) {}
@@ -86,44 +179,6 @@ void Dispatcher::MessageReceived(BMessage *msg) {
     if (toggled)
       this->startNotesTimer(0);
   }
-  if (msg->IsReply()) {
-    if (status_t response; msg->FindInt32("error", &response) == B_OK &&
-        (response == B_ENTRY_NOT_FOUND || response == B_NAME_NOT_FOUND)) {
-      const BMessage *request = msg->Previous();
-      BMessage specifier;
-      BString property;
-      BString feedId;
-      BString cypherkey;
-      bool gotSequence = false;
-      for (int32 i = 0;
-           request->FindMessage("specifiers", i, &specifier) == B_OK; i++) {
-        if (specifier.FindString("property", &property) == B_OK) {
-          if (property == "ReplicatedFeed") {
-            BString feedId;
-            if (specifier.FindString("name", &feedId) == B_OK)
-              cypherkey = feedId;
-          } else if (int32 sequence; property == "Post" &&
-                     specifier.FindInt32("index", &sequence) == B_OK) {
-            gotSequence = true;
-          }
-        }
-      }
-      if (response != B_NAME_NOT_FOUND && gotSequence && cypherkey != "") {
-        BMessage timerMsg('CKSR');
-        timerMsg.AddString("cypherkey", cypherkey);
-        BMessageRunner::StartSending(BMessenger(this), &timerMsg, 1000000, 1);
-        return;
-      } else if (cypherkey != "") {
-        for (int32 i = this->CountHandlers() - 1; i >= 0; i--) {
-          if (Link *link = dynamic_cast<Link *>(this->HandlerAt(i)); link) {
-            link->sendSequence.push(cypherkey);
-            this->startNotesTimer(1000);
-            return;
-          }
-        }
-      }
-    }
-  }
   if (BString cypherkey;
       msg->what == 'CKSR' && msg->FindString("cypherkey", &cypherkey) == B_OK) {
     Link *bestSoFar = NULL;
@@ -170,19 +225,6 @@ void Dispatcher::MessageReceived(BMessage *msg) {
     this->sendNotes();
     return;
   }
-  {
-    BMessage result;
-    for (int32 i = 0; msg->FindMessage("result", i, &result) == B_OK; i++) {
-      BString author;
-      JSON::number sequence;
-      if (result.FindDouble("sequence", &sequence) == B_OK &&
-          result.FindString("author", &author) == B_OK) {
-        for (int i = this->CountHandlers() - 1; i >= 0; i--)
-          if (Link *link = dynamic_cast<Link *>(this->HandlerAt(i)); link)
-            link->pushOut(&result);
-      }
-    }
-  }
 }
 
 void Dispatcher::Quit() {
@@ -214,46 +256,60 @@ void Dispatcher::noticeChange(BMessage *msg) {
   int64 sequence;
   if (msg->FindString("feed", &cypherkey) == B_OK &&
       msg->FindInt64("sequence", &sequence) == B_OK) {
-    {
-      BString logText("Observer notice for ");
-      logText << cypherkey;
-      logText << ": sequence = " << sequence;
-      writeLog('EBT_', logText);
-    }
-    bool changed = false;
+    // Subscribing yields one notice carrying every feed's head, so walk all
+    // of the entries rather than just the first.
+    bool anyChanged = false;
     bool justOne = !this->polyLink();
-    bool forked = msg->GetBool("forked", false);
-    bool fixup = msg->GetBool("broken", false);
-    if (auto state = this->ourState.find(cypherkey);
-        state != this->ourState.end()) {
-      if (state->second.savedSequence != sequence) {
-        changed = true;
-        state->second.savedSequence = sequence;
+    for (int32 i = 0; msg->FindString("feed", i, &cypherkey) == B_OK &&
+                      msg->FindInt64("sequence", i, &sequence) == B_OK;
+         i++) {
+      {
+        BString logText("Observer notice for ");
+        logText << cypherkey;
+        logText << ": sequence = " << sequence;
+        writeLog('EBT_', logText);
       }
-      if (fixup || state->second.sequence < sequence) {
-        changed = true;
-        state->second.sequence = sequence;
+      bool changed = false;
+      bool forked = false;
+      bool fixup = false;
+      msg->FindBool("forked", i, &forked);
+      msg->FindBool("broken", i, &fixup);
+      if (auto state = this->ourState.find(cypherkey);
+          state != this->ourState.end()) {
+        if (state->second.savedSequence != sequence) {
+          changed = true;
+          state->second.savedSequence = sequence;
+        }
+        if (fixup || state->second.sequence < sequence) {
+          changed = true;
+          state->second.sequence = sequence;
+        }
+        if (forked != state->second.forked) {
+          changed = true;
+          state->second.forked = forked;
+        }
+      } else {
+        this->ourState.insert(
+            {cypherkey, {(uint64)sequence, (uint64)sequence, forked}});
       }
-      if (forked != state->second.forked) {
-        changed = true;
-        state->second.forked = forked;
+      for (int32 j = this->CountHandlers() - 1; j >= 0; j--) {
+        if (Link *link = dynamic_cast<Link *>(this->HandlerAt(j)); link) {
+          if (changed)
+            link->sendSequence.push(cypherkey);
+          link->offerFeed(cypherkey);
+        }
       }
-    } else {
-      this->ourState.insert(
-          {cypherkey, {(uint64)sequence, (uint64)sequence, forked}});
+      anyChanged = anyChanged || changed;
     }
-    if (changed) {
-      for (int32 i = this->CountHandlers() - 1; i >= 0; i--)
-        if (Link *link = dynamic_cast<Link *>(this->HandlerAt(i)); link)
-          link->sendSequence.push(cypherkey);
+    if (anyChanged)
       this->startNotesTimer(1000);
-    }
   } else if (BString cypherkey; msg->GetBool("deleted", false) &&
              msg->FindString("feed", &cypherkey) == B_OK) {
     this->ourState.erase(cypherkey);
     for (int32 i = this->CountHandlers() - 1; i >= 0; i--) {
       if (Link *link = dynamic_cast<Link *>(this->HandlerAt(i)); link) {
         link->ourState.erase(cypherkey);
+        link->outQueue.drop(cypherkey);
         link->sendSequence.push(cypherkey);
       }
     }
@@ -261,20 +317,6 @@ void Dispatcher::noticeChange(BMessage *msg) {
   }
 }
 
-void Dispatcher::checkForMessage(const BString &author, uint64 sequence) {
-  if (auto s = this->ourState.find(author);
-      s != this->ourState.end() && s->second.savedSequence >= sequence) {
-    BMessage message(B_GET_PROPERTY);
-    BMessage specifier(B_INDEX_SPECIFIER);
-    specifier.AddInt32("index", (int32)sequence);
-    specifier.AddUInt16("count", 16);
-    specifier.AddString("property", "Post");
-    message.AddSpecifier(&specifier);
-    message.AddSpecifier("ReplicatedFeed", author);
-    BMessenger(this->db).SendMessage(&message, BMessenger(this));
-  }
-}
-
 bool Dispatcher::polyLink() {
   int count = 0;
   for (int32 i = this->CountHandlers(); i >= 0; i--)
@@ -340,7 +382,10 @@ Link::Link(muxrpc::Sender sender, bool waiting)
 
 void Link::MessageReceived(BMessage *message) {
   if (message->what == 'SENT') {
+    this->sending = false;
     this->sendOne();
+  } else if (message->IsReply() && this->fetching && fetchedPosts(message)) {
+    this->receiveFetched(message);
   } else if (BMessage content;
              message->FindMessage("content", &content) == B_OK) {
     BString author;
@@ -373,31 +418,10 @@ void Link::MessageReceived(BMessage *message) {
           double note;
           if (content.FindDouble(attrname, &note) == B_OK) {
             this->stopWaiting();
-            const auto &inserted = this->remoteState.insert_or_assign(
-                BString(attrname), RemoteState(note));
-            Dispatcher *dispatcher = dynamic_cast<Dispatcher *>(this->Looper());
+            this->remoteState.insert_or_assign(BString(attrname),
+                                               RemoteState(note));
             if (this->ourState.find(attrname) != this->ourState.end()) {
-              if (inserted.first->second.note.receive) {
-                auto q = this->outMessages.find(attrname);
-                if (q != this->outMessages.end()) {
-                  while (!q->second.empty() &&
-                         q->second.front().GetDouble("sequence", 0.0) !=
-                             inserted.first->second.note.sequence + 1) {
-                    q->second.pop();
-                  }
-                  if (q->second.empty()) {
-                    this->outMessages.erase(q);
-                    q = this->outMessages.end();
-                  }
-                }
-                if (q == this->outMessages.end()) {
-                  dispatcher->checkForMessage(
-                      inserted.first->first,
-                      inserted.first->second.note.sequence + 1);
-                }
-              } else {
-                this->outMessages.erase(attrname);
-              }
+              this->offerFeed(attrname);
               this->tick(attrname);
             } else {
               this->sendSequence.push(attrname);
@@ -477,83 +501,118 @@ void Link::loadState() {
 
 BMessenger *Link::outbound() { return this->sender.outbound(); }
 
-void Link::pushOut(BMessage *message) {
-  BString author;
-  JSON::number sequence;
-  if (message->FindDouble("sequence", &sequence) == B_OK &&
-      message->FindString("author", &author) == B_OK) {
-    if (auto state = this->remoteState.find(author);
-        state != this->remoteState.end()) {
-      double oldSequence = state->second.note.sequence;
-      auto q = this->outMessages.find(author);
-      if (q != this->outMessages.end() && !q->second.empty())
-        oldSequence = q->second.back().GetDouble("sequence", oldSequence);
-      if (oldSequence + 1 == sequence) {
-        if (q != this->outMessages.end())
-          q->second.push(*message);
-        else
-          this->outMessages[author].push(*message);
-        if (!this->sending) {
-          this->sending = true;
-          this->sendOne();
-        }
-        // TODO: Use different numbers for queued and sent
-      }
-    }
+void Link::offerFeed(const BString &author) {
+  this->queueFeed(author);
+  this->sendOne();
+}
+
+// Points the cursor for `author` at what the peer is missing, or drops it if
+// there is nothing we can send.
+void Link::queueFeed(const BString &author) {
+  auto dispatcher = dynamic_cast<Dispatcher *>(this->Looper());
+  if (dispatcher == NULL)
+    return;
+  auto remote = this->remoteState.find(author);
+  auto local = dispatcher->ourState.find(author);
+  if (remote == this->remoteState.end() || !remote->second.note.receive ||
+      local == dispatcher->ourState.end() ||
+      this->ourState.find(author) == this->ourState.end()) {
+    this->outQueue.drop(author);
+    return;
   }
+  this->outQueue.offer(author, remote->second.note.sequence + 1,
+                       local->second.savedSequence);
 }
 
-void Link::sendOne() {
-  while (true) {
-    if (this->outMessages.empty()) {
-      this->sending = false;
+void Link::fetchNext(const BString &author, uint64 sequence) {
+  SSBDatabase *db = this->db();
+  BMessage message(B_GET_PROPERTY);
+  BMessage specifier(B_INDEX_SPECIFIER);
+  specifier.AddInt32("index", (int32)sequence);
+  specifier.AddUInt16("count", EBT_OUT_BATCH);
+  specifier.AddString("property", "Post");
+  message.AddSpecifier(&specifier);
+  message.AddSpecifier("ReplicatedFeed", author);
+  if (db != NULL &&
+      BMessenger(db).SendMessage(&message, BMessenger(this)) == B_OK) {
+    this->fetching = true;
+    this->fetchingAuthor = author;
+    this->fetchingSequence = sequence;
+  } else {
+    this->outQueue.drop(author);
+  }
+}
+
+void Link::receiveFetched(BMessage *reply) {
+  this->fetching = false;
+  BString author = this->fetchingAuthor;
+  this->fetchingAuthor = "";
+  bool staged = false;
+  BMessage result;
+  for (int32 i = 0; reply->FindMessage("result", i, &result) == B_OK; i++) {
+    if (this->outQueue.stage(result) == B_OK)
+      staged = true;
+  }
+  if (!staged) {
+    status_t response = reply->GetInt32("error", B_OK);
+    uint64 next;
+    if (response != B_ENTRY_NOT_FOUND && response != B_NAME_NOT_FOUND &&
+        this->outQueue.find(author, &next) && next != this->fetchingSequence) {
+      // The cursor was offered again from somewhere else while we were
+      // fetching, so start over from there.
+      this->fetchNext(author, next);
       return;
     }
-    size_t index =
-        std::uniform_int_distribution<size_t>(0, this->outMessages.size() - 1)(
-            static_cast<Dispatcher *>(this->Looper())->rng);
-    auto q = index > this->outMessages.size() / 2
-        ? std::prev(this->outMessages.end(), this->outMessages.size() - index)
-        : std::next(this->outMessages.begin(), index);
-    const BString author = q->first;
-    if (auto state = this->remoteState.find(author);
-        state != this->remoteState.end()) {
-      if (!state->second.note.receive) {
-        this->outMessages.erase(q);
+    // We don't have what we thought we had; wait for the next notice.
+    this->outQueue.drop(author);
+    if (response == B_ENTRY_NOT_FOUND) {
+      BMessage timerMsg('CKSR');
+      timerMsg.AddString("cypherkey", author);
+      BMessageRunner::StartSending(BMessenger(this->Looper()), &timerMsg,
+                                   1000000, 1);
+    } else if (auto dispatcher = dynamic_cast<Dispatcher *>(this->Looper());
+               response == B_NAME_NOT_FOUND && dispatcher != NULL) {
+      // We don't have the feed at all, so the peer is told so.
+      this->sendSequence.push(author);
+      dispatcher->startNotesTimer(1000);
+    }
+  }
+  this->sendOne();
+}
+
+void Link::sendOne() {
+  while (!this->sending && !this->fetching) {
+    if (BMessage *message = this->outQueue.front(); message != NULL) {
+      BString author;
+      message->FindString("author", &author);
+      auto state = this->remoteState.find(author);
+      if (state == this->remoteState.end() || !state->second.note.receive) {
+        this->outQueue.drop(author);
         continue;
       }
-      bool wasEmpty = true;
-      while (!q->second.empty() &&
-             q->second.front().GetDouble("sequence", 0) !=
-                 state->second.note.sequence + 1) {
-        q->second.pop();
-        wasEmpty = false;
-      }
-      if (q->second.empty()) {
-        this->outMessages.erase(q);
-        if (!wasEmpty) {
-          static_cast<Dispatcher *>(this->Looper())
-              ->checkForMessage(author,
-                                (uint64)state->second.note.sequence + 1);
-        }
+      if ((uint64)message->GetDouble("sequence", 0) !=
+          state->second.note.sequence + 1) {
+        this->outQueue.clearStaged();
+        this->queueFeed(author);
         continue;
       }
-      this->sender.send(&q->second.front(), true, false, false,
-                        BMessenger(this));
+      this->sending = true;
+      this->sender.send(message, true, false, false, BMessenger(this));
       state->second.note.sequence++;
-      q->second.pop();
-      if (q->second.empty()) {
-        this->outMessages.erase(q);
-        static_cast<Dispatcher *>(this->Looper())
-            ->checkForMessage(author, (uint64)state->second.note.sequence + 1);
-      }
-      break;
-    } else {
-      this->outMessages.erase(q);
+      this->outQueue.pop();
+      return;
     }
+    if (this->outQueue.cursorCount() == 0)
+      return;
+    size_t index = std::uniform_int_distribution<size_t>(
+        0, this->outQueue.cursorCount() - 1)(
+        static_cast<Dispatcher *>(this->Looper())->rng);
+    BString author;
+    uint64 next;
+    if (this->outQueue.pick(index, &author, &next))
+      this->fetchNext(author, next);
   }
 }
-
 void Dispatcher::startNotesTimer(bigtime_t delay) {
   if (this->buildingNotes == false) {
     BMessage timerMsg('SDNT');
@@ -37,6 +37,36 @@ struct LinkLocalState {
   bool receive;
 };
 
+#define EBT_OUT_BATCH 16
+
+struct OutCursor {
+  uint64 next;
+  uint64 available;
+};
+
+// Messages waiting to go out on a link are tracked as (feed, sequence range)
+// cursors; message bodies are only pulled from the database a batch at a time
+// so memory use depends on the number of feeds rather than the backlog.
+class OutQueue {
+public:
+  void offer(const BString &author, uint64 next, uint64 available);
+  void drop(const BString &author);
+  bool pick(size_t index, BString *author, uint64 *next);
+  bool find(const BString &author, uint64 *next) const;
+  status_t stage(const BMessage &message);
+  BMessage *front();
+  void pop();
+  void clearStaged();
+  bool empty() const;
+  size_t cursorCount() const;
+  size_t stagedCount() const;
+
+private:
+  std::map<BString, OutCursor> cursors;
+  BString stagedAuthor;
+  std::queue<BMessage> staged;
+};
+
 class Dispatcher;
 
 class Link : public BHandler {
@@ -50,16 +80,22 @@ private:
   void tick(const BString &author);
   void stopWaiting();
   BMessenger *outbound();
-  void pushOut(BMessage *message);
+  void offerFeed(const BString &author);
+  void queueFeed(const BString &author);
+  void fetchNext(const BString &author, uint64 sequence);
+  void receiveFetched(BMessage *reply);
   void sendOne();
   muxrpc::Sender sender;
   std::map<BString, RemoteState> remoteState;
   std::map<BString, LinkLocalState> ourState;
   std::queue<BString> sendSequence;
   std::map<BString, int64> lastSent;
-  std::map<BString, std::queue<BMessage>> outMessages;
+  OutQueue outQueue;
+  BString fetchingAuthor;
+  uint64 fetchingSequence = 0;
   bool waiting;
   bool sending = false;
+  bool fetching = false;
   friend class Dispatcher;
 };
 
@@ -76,7 +112,6 @@ public:
 
 private:
   void noticeChange(BMessage *msg);
-  void checkForMessage(const BString &author, uint64 sequence);
   void startNotesTimer(bigtime_t delay);
   void sendNotes();
   bool polyLink();
@@ -1,4 +1,5 @@
 #include "FeedView.h"
+#include "AuthorCache.h"
 #include "Logging.h"
 #include "Plugin.h"
 #include <ScrollView.h>
@@ -6,18 +7,16 @@
 
 namespace {
 
-std::map<BString, std::function<BView *(BMessage *)>> initTypes() {
-  typedef status_t (*pview_t)(
-      std::map<BString, std::function<BView *(BMessage *)>> *);
-  std::map<BString, std::function<BView *(BMessage *)>> result;
-  for (auto &[pname, sym] : habitat_plugins.lookup("registerViewer")) {
-    auto f = (pview_t)sym;
-    f(&result);
+ViewerRegistry initTypes() {
+  ViewerRegistry result;
+  for (const Plugin &plugin : habitat_plugins.loaded()) {
+    if (plugin.registerViewer != NULL)
+      plugin.registerViewer(&result);
   }
   return result;
 }
 
-const std::map<BString, std::function<BView *(BMessage *)>> &messageTypes() {
+const ViewerRegistry &messageTypes() {
   static auto instance = initTypes();
   return instance;
 }
@@ -55,27 +54,56 @@ void FeedView::MessageReceived(BMessage *message) {
         i++;
     }
     this->accepting = true;
+  } else if (message->what == 'PSTS') {
+    if (!this->accepting)
+      return;
+    // Everyone in the batch is looked up together before their posts ask.
+    std::vector<BString> authors;
+    BMessage post;
+    for (int32 i = 0; message->FindMessage("post", i, &post) == B_OK; i++)
+      authors.push_back(post.GetString("author", ""));
+    AuthorCache::instance()->prefetch(authors);
+    bool added = false;
+    for (int32 i = 0; message->FindMessage("post", i, &post) == B_OK; i++)
+      added = this->addPost(&post) || added;
+    if (added)
+      this->postsAdded();
   } else if (BMessage content; this->accepting &&
              (message->FindMessage("content", &content) == B_OK ||
               message->FindMessage("cleartext", &content) == B_OK)) {
-    if (BString msgType; content.FindString("type", &msgType) == B_OK) {
-      if (auto vc = messageTypes().find(msgType); vc != messageTypes().end()) {
-        if (auto v = vc->second(message); v != NULL) {
-          // TODO: Sort the messages
-          this->glue->RemoveSelf();
-          this->GroupLayout()->AddView(v, 0.0f);
-          if (this->Parent())
-            this->Parent()->InvalidateLayout();
-          this->GroupLayout()->AddItem(this->glue);
-          this->updateScroll();
-        }
-      }
-    }
+    if (this->addPost(message))
+      this->postsAdded();
   } else {
     BGroupView::MessageReceived(message);
   }
 }
 
+bool FeedView::addPost(BMessage *message) {
+  BMessage content;
+  if (message->FindMessage("content", &content) != B_OK &&
+      message->FindMessage("cleartext", &content) != B_OK) {
+    return false;
+  }
+  if (BString msgType; content.FindString("type", &msgType) == B_OK) {
+    if (auto vc = messageTypes().find(msgType); vc != messageTypes().end()) {
+      if (auto v = vc->second(message); v != NULL) {
+        // TODO: Sort the messages
+        this->glue->RemoveSelf();
+        this->GroupLayout()->AddView(v, 0.0f);
+        this->GroupLayout()->AddItem(this->glue);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void FeedView::postsAdded() {
+  if (this->Parent())
+    this->Parent()->InvalidateLayout();
+  this->updateScroll();
+}
+
 status_t FeedView::setSpecifier(const BMessage &specifier) {
   if (specifier.what != B_NAME_SPECIFIER && specifier.what != 'CPLX')
     return B_BAD_VALUE;
@@ -156,6 +184,7 @@ void FeedView::sendQuery() {
       rq.AddSpecifier(&this->specifier);
       rq.AddMessenger("target", BMessenger(this));
       rq.AddBool("includeKey", true);
+      rq.AddInt32("batch", 32);
       BMessenger("application/x-vnd.habitat")
           .SendMessage(&rq, BMessenger(this));
     }
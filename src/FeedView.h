@@ -25,6 +25,8 @@ protected:
 private:
   void setQuery();
   void sendQuery();
+  bool addPost(BMessage *message);
+  void postsAdded();
   BMessage specifier;
   BMessenger doneMessenger;
   BRect lastKnownFrame;
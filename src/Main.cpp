@@ -5,6 +5,7 @@
 #include "Indices.h"
 #include "Logging.h"
 #include "MigrateDB.h"
+#include "Plugin.h"
 #include "Room.h"
 #include "SelectContacts.h"
 #include <Catalog.h>
@@ -49,7 +50,10 @@ enum {
   kCreatePost,
   kLogCategory,
   kServer,
-  kConnection
+  kConnection,
+  kStorageProfile,
+  kCompressBodies,
+  kPlugin
 };
 
 static property_info habitatProperties[] = {
@@ -101,11 +105,30 @@ static property_info habitatProperties[] = {
      "A one-time connection to another peer",
      kConnection,
      {}},
+    {"StorageProfile",
+     {B_GET_PROPERTY, B_SET_PROPERTY, 0},
+     {B_DIRECT_SPECIFIER, 0},
+     "How the database is tuned: desktop, pub or bulk-import",
+     kStorageProfile,
+     {B_STRING_TYPE}},
+    {"CompressBodies",
+     {B_GET_PROPERTY, B_SET_PROPERTY, 0},
+     {B_DIRECT_SPECIFIER, 0},
+     "Whether message bodies are stored compressed",
+     kCompressBodies,
+     {B_BOOL_TYPE}},
+    {"Plugin",
+     {B_GET_PROPERTY, 0},
+     {B_DIRECT_SPECIFIER, 0},
+     "Loaded plugins and how long each took to load",
+     kPlugin,
+     {}},
     {0}};
 
 // TODO: Move most of this into ReadyToRun
 Habitat::Habitat(void)
     : BApplication("application/x-vnd.habitat") {
+  habitat_plugins.preload();
   {
     std::random_device hwrng;
     this->rng.seed(hwrng());
@@ -163,7 +186,8 @@ Habitat::Habitat(void)
   {
     auto &settings = *this->settings;
     this->databaseLooper =
-        new SSBDatabase([settings]() { return migrateToSqlite(settings); });
+        new SSBDatabase([settings]() { return migrateToSqlite(settings); },
+                        [settings]() { return openReader(settings); });
   }
   this->ownFeed = new OwnFeed(this->myId.get());
   this->databaseLooper->AddHandler(this->ownFeed);
@@ -377,6 +401,47 @@ void Habitat::MessageReceived(BMessage *msg) {
       break;
     return;
   }
+  case kStorageProfile:
+    if (msg->what == B_SET_PROPERTY) {
+      BString name;
+      if ((error = msg->FindString("data", &name)) != B_OK)
+        break;
+      this->storageProfileName = storageProfile(name).name;
+      BMessage apply('DBSP');
+      apply.AddString("profile", this->storageProfileName);
+      BMessenger(this->databaseLooper).SendMessage(&apply);
+    } else {
+      reply.AddString("result", this->storageProfileName);
+      for (auto profile = storageProfiles; profile->name != NULL; profile++)
+        reply.AddString("profiles", profile->name);
+      error = B_OK;
+    }
+    break;
+  case kCompressBodies:
+    if (msg->what == B_SET_PROPERTY) {
+      bool compress;
+      if ((error = msg->FindBool("data", &compress)) != B_OK)
+        break;
+      this->compressBodies = compress;
+      BMessage apply('BZIP');
+      apply.AddBool("enable", compress);
+      BMessenger(this->databaseLooper).SendMessage(&apply);
+    } else {
+      reply.AddBool("result", this->compressBodies);
+      error = B_OK;
+    }
+    break;
+  case kPlugin:
+    for (const Plugin &plugin : habitat_plugins.loaded()) {
+      BMessage result;
+      result.AddString("name", plugin.name);
+      result.AddString("path", plugin.path);
+      result.AddInt32("abi", plugin.abi);
+      result.AddInt64("loadTime", plugin.loadTime);
+      reply.AddMessage("result", &result);
+    }
+    error = B_OK;
+    break;
   default:
     return BApplication::MessageReceived(msg);
   }
@@ -583,7 +648,7 @@ void Habitat::ReadyToRun() {
          !BMessenger(this->contactStore).IsValid()) {
     snooze(500000);
   }
-  auto graph = new ContactGraph(this->databaseLooper, this->contactStore);
+  auto graph = new ContactGraph(this->contactStore);
   worker->AddHandler(graph);
   auto selector =
       new SelectContacts(BMessenger(this->databaseLooper), BMessenger(graph));
@@ -597,7 +662,10 @@ void Habitat::ReadyToRun() {
       this->settings->FindEntry("blobs", &entry, true);
       blobsDir = BDirectory(&entry);
     }
-    this->wantedBlobs = new blob::Wanted(blobsDir);
+    sqlite3 *blobDatabase = openWriter(*this->settings);
+    if (blobDatabase == NULL)
+      throw (status_t)B_IO_ERROR;
+    this->wantedBlobs = new blob::Wanted(blobsDir, blobDatabase);
   }
   worker->AddHandler(this->wantedBlobs);
   this->wantedBlobs->registerMethods(this->serverMethods);
@@ -622,6 +690,8 @@ void Habitat::ReadyToRun() {
     specifier.AddString("type", "contact");
     specifier.AddBool("dregs", true);
     rq.AddSpecifier(&specifier);
+    rq.AddBool("includeKey", true);
+    rq.AddInt32("batch", 64);
     while (!BMessenger(graph).IsValid())
       snooze(500000);
     rq.AddMessenger("target", BMessenger(graph));
@@ -668,6 +738,19 @@ void Habitat::loadSettings() {
       for (int32 i = 0; settings.FindMessage("Server", i, &record) == B_OK; i++)
         this->servers.push_back(ServerRecord(&record));
     }
+    this->storageProfileName =
+        storageProfile(settings.GetString("StorageProfile", NULL)).name;
+    {
+      BMessage apply('DBSP');
+      apply.AddString("profile", this->storageProfileName);
+      BMessenger(this->databaseLooper).SendMessage(&apply);
+    }
+    if (settings.GetBool("CompressBodies", false)) {
+      this->compressBodies = true;
+      BMessage enable('BZIP');
+      enable.AddBool("enable", true);
+      BMessenger(this->databaseLooper).SendMessage(&enable);
+    }
   }
 }
 
@@ -684,6 +767,8 @@ void Habitat::saveSettings() {
     server.pack(&record, false);
     settings.AddMessage("Server", &record);
   }
+  settings.AddBool("CompressBodies", this->compressBodies);
+  settings.AddString("StorageProfile", this->storageProfileName);
   BFile output;
   if (this->settings->CreateFile("preferences~", &output, false) != B_OK)
     return;
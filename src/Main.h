@@ -82,6 +82,8 @@ private:
   std::vector<ServerRecord> servers;
   std::set<void *> cloggedChannels;
   std::default_random_engine rng;
+  BString storageProfileName = "desktop";
+  bool compressBodies = false;
 };
 
 extern Habitat *app;
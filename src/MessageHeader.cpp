@@ -2,8 +2,6 @@
 #include <DateTimeFormat.h>
 #include <LayoutBuilder.h>
 #include <MimeType.h>
-#include <cmath>
-#include <translation/TranslationUtils.h>
 
 namespace {
 // TODO: Make sure this handles daylight savings time.
@@ -29,9 +27,8 @@ std::shared_ptr<BBitmap> makePersonIcon() {
 
 MessageHeader::MessageHeader(const BMessage &message)
     : BView("", B_SUPPORTS_LAYOUT | B_WILL_DRAW) {
-  BString author;
-  if (message.FindString("author", &author) != B_OK)
-    author = "Error";
+  if (message.FindString("author", &this->author) != B_OK)
+    this->author = "Error";
 
   BString datetime;
   {
@@ -40,11 +37,11 @@ MessageHeader::MessageHeader(const BMessage &message)
     else
       datetime = "Error";
   }
-  this->authorValue = new BStringView("authorValue", author);
+  this->authorValue = new BStringView("authorValue", this->author);
   this->dateValue = new BStringView("dateValue", datetime);
   static std::shared_ptr<BBitmap> personIcon = makePersonIcon();
   this->userPicture = new UserPicture(personIcon);
-  this->userPicture->SetToolTip(author);
+  this->userPicture->SetToolTip(this->author);
   BLayoutBuilder::Grid<>(this, B_USE_DEFAULT_SPACING, B_USE_DEFAULT_SPACING)
       .Add(this->userPicture, 0, 0, 1, 2)
       .Add(this->authorValue, 1, 0)
@@ -56,68 +53,38 @@ MessageHeader::MessageHeader(const BMessage &message)
 MessageHeader::~MessageHeader() {}
 
 void MessageHeader::AttachedToWindow() {
-  BMessage rq(B_GET_PROPERTY);
-  rq.AddSpecifier("Profile", this->authorValue->Text());
-  BMessenger("application/x-vnd.habitat").SendMessage(&rq, this);
+  if (AuthorDisplay display; AuthorCache::instance()->watch(
+          this->author, BMessenger(this), &display)) {
+    this->show(display);
+  }
   BView::AttachedToWindow();
 }
 
+void MessageHeader::DetachedFromWindow() {
+  AuthorCache::instance()->unwatch(this->author, BMessenger(this));
+  BView::DetachedFromWindow();
+}
+
 void MessageHeader::MessageReceived(BMessage *message) {
-  if (!message->IsReply())
+  if (message->what != 'AUTH' ||
+      message->GetString("author", "") != this->author) {
     return BView::MessageReceived(message);
-  if (BMessage result; message->FindMessage("result", &result) == B_OK) {
-    BString author;
-    if (result.FindString("about", &author) != B_OK ||
-        author != this->authorValue->Text()) {
-      return BView::MessageReceived(message);
-    }
-    BString name;
-    if (result.FindString("name", &name) == B_OK && name.Length() != 0) {
-      this->authorValue->SetText(name);
-      this->authorValue->SetToolTip(author);
-    }
-    BString imageHash;
-    if (BMessage image; result.FindMessage("image", &image) == B_OK)
-      image.FindString("link", &imageHash);
-    if (imageHash.Length() != 0 ||
-        result.FindString("image", &imageHash) == B_OK) {
-      BMessage rq(B_CREATE_PROPERTY);
-      rq.AddSpecifier("Blob");
-      rq.AddString("cypherkey", imageHash);
-      BMessenger("application/x-vnd.habitat").SendMessage(&rq, this);
-    }
-  } else if (entry_ref result; message->FindRef("result", &result) == B_OK) {
-    // TODO: Factor out this logic into something reusable.
-    BBitmap *unscaled = BTranslationUtils::GetBitmap(&result, NULL);
-    float scale = 1.0;
-    BRect bounds(unscaled->Bounds());
-    {
-      float s = 32.0 / bounds.Width();
-      if (scale > s)
-        scale = s;
-      s = 32.0 / bounds.Height();
-      if (scale > s)
-        scale = s;
-    }
-    auto scaled = std::make_shared<BBitmap>(
-        BRect(0, 0, std::floor(bounds.Width() * scale - 1),
-              std::floor(bounds.Height() * scale - 1)),
-        B_RGBA32, true);
-    auto view =
-        new BView(scaled->Bounds(), "scale", B_FOLLOW_NONE, B_WILL_DRAW);
-    scaled->AddChild(view);
-    scaled->Lock();
-    view->SetDrawingMode(B_OP_ALPHA);
-    view->SetBlendingMode(B_PIXEL_ALPHA, B_ALPHA_OVERLAY);
-    view->DrawBitmap(unscaled, unscaled->Bounds(), scaled->Bounds());
-    view->Sync();
-    scaled->Unlock();
-    scaled->RemoveChild(view);
-    delete view;
-    this->userPicture->setSource(scaled);
+  }
+  if (AuthorDisplay display;
+      AuthorCache::instance()->find(this->author, &display)) {
+    this->show(display);
+  }
+}
+
+void MessageHeader::show(const AuthorDisplay &display) {
+  if (display.name.Length() != 0) {
+    this->authorValue->SetText(display.name);
+    this->authorValue->SetToolTip(this->author);
   } else {
-    return BView::MessageReceived(message);
+    this->authorValue->SetText(this->author);
   }
+  if (display.picture != NULL)
+    this->userPicture->setSource(display.picture);
 }
 
 UserPicture::UserPicture(std::shared_ptr<BBitmap> source)
@@ -1,6 +1,7 @@
 #ifndef MESSAGE_HEADER_H
 #define MESSAGE_HEADER_H
 
+#include "AuthorCache.h"
 #include <Bitmap.h>
 #include <StringView.h>
 #include <memory>
@@ -20,9 +21,12 @@ public:
   MessageHeader(const BMessage &message);
   ~MessageHeader();
   void AttachedToWindow() override;
+  void DetachedFromWindow() override;
   void MessageReceived(BMessage *message) override;
 
 private:
+  void show(const AuthorDisplay &display);
+  BString author;
   UserPicture *userPicture;
   BStringView *authorValue;
   BStringView *dateValue;
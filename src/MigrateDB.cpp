@@ -1,16 +1,66 @@
 #include "MigrateDB.h"
+#include <Autolock.h>
 #include <Entry.h>
 #include <File.h>
+#include <Locker.h>
+#include <Message.h>
+#include <OS.h>
 #include <Path.h>
 #include <Query.h>
 #include <String.h>
+#include <TypeConstants.h>
 #include <Volume.h>
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <iostream>
+#include <memory>
+#include <sodium.h>
+#include <vector>
+
+#define MIGRATE_BATCH 4096
+#define MIGRATE_QUEUE 1024
+// How long a connection waits for another one's write to finish.
+#define DATABASE_BUSY_MS 5000
+
+// The SQL that counts message `row` into its thread, or takes it back out.
+static BString joinThread(const char *row) {
+  BString sql;
+  sql << "INSERT INTO threads(root, replies, participants, lastActivity) "
+      << "VALUES(" << row << ".context, 1, 1, " << row << ".timestamp) "
+      << "ON CONFLICT(root) DO UPDATE SET replies = replies + 1, "
+      << "participants = participants + NOT EXISTS("
+      << "SELECT 1 FROM thread_participants WHERE root = " << row
+      << ".context AND author = " << row << ".author), "
+      << "lastActivity = max(lastActivity, excluded.lastActivity); "
+      << "INSERT OR IGNORE INTO thread_participants(root, author) "
+      << "VALUES(" << row << ".context, " << row << ".author);";
+  return sql;
+}
+
+static BString leaveThread(const char *row) {
+  BString sql;
+  sql << "DELETE FROM thread_participants WHERE root = " << row
+      << ".context AND author = " << row << ".author AND NOT EXISTS("
+      << "SELECT 1 FROM messages WHERE context = " << row
+      << ".context AND author = " << row << ".author AND type = 'post'); "
+      << "UPDATE threads SET replies = replies - 1, participants = ("
+      << "SELECT count(*) FROM thread_participants WHERE root = " << row
+      << ".context), lastActivity = ifnull(("
+      << "SELECT max(timestamp) FROM messages WHERE context = " << row
+      << ".context AND type = 'post'), lastActivity) WHERE root = " << row
+      << ".context; "
+      << "DELETE FROM threads WHERE root = " << row
+      << ".context AND replies <= 0;";
+  return sql;
+}
 
 status_t prepareDatabase(sqlite3 *database) {
   char *error = NULL;
+  // Only takes effect on a new database, before any tables exist.
+  sqlite3_exec(database, "PRAGMA auto_vacuum = INCREMENTAL", NULL, NULL, NULL);
   if (sqlite3_exec(database,
                    "CREATE TABLE IF NOT EXISTS messages("
                    "cypherkey TEXT NOT NULL UNIQUE ON CONFLICT IGNORE, "
@@ -41,8 +91,19 @@ status_t prepareDatabase(sqlite3 *database) {
     return B_ERROR;
   }
   sqlite3_exec(database, "DROP INDEX typectx", NULL, NULL, NULL);
+  // Paged queries are read in timestamp order, so each index that serves
+  // them ends in timestamp. See the query shapes in tests/PostQuerySpec.cpp.
+  if (sqlite3_exec(
+          database,
+          "CREATE INDEX IF NOT EXISTS ctxtime ON messages (context, timestamp)",
+          NULL, NULL, &error) != SQLITE_OK) {
+    std::cerr << error << std::endl;
+    return B_ERROR;
+  }
+  sqlite3_exec(database, "DROP INDEX proqueue", NULL, NULL, NULL);
   if (sqlite3_exec(database,
-                   "CREATE INDEX IF NOT EXISTS proqueue ON messages (type) "
+                   "CREATE INDEX IF NOT EXISTS protime "
+                   "ON messages (type, processed, timestamp) "
                    "WHERE processed = 0",
                    NULL, NULL, &error) != SQLITE_OK) {
     std::cerr << error << std::endl;
@@ -55,10 +116,18 @@ status_t prepareDatabase(sqlite3 *database) {
     std::cerr << error << std::endl;
     return B_ERROR;
   }
-  if (sqlite3_exec(
-          database,
-          "CREATE INDEX IF NOT EXISTS authortype ON messages (author, type)",
-          NULL, NULL, &error) != SQLITE_OK) {
+  sqlite3_exec(database, "DROP INDEX authortype", NULL, NULL, NULL);
+  if (sqlite3_exec(database,
+                   "CREATE INDEX IF NOT EXISTS authortypetime "
+                   "ON messages (author, type, timestamp)",
+                   NULL, NULL, &error) != SQLITE_OK) {
+    std::cerr << error << std::endl;
+    return B_ERROR;
+  }
+  if (sqlite3_exec(database,
+                   "CREATE INDEX IF NOT EXISTS authortime "
+                   "ON messages (author, timestamp)",
+                   NULL, NULL, &error) != SQLITE_OK) {
     std::cerr << error << std::endl;
     return B_ERROR;
   }
@@ -132,13 +201,366 @@ status_t prepareDatabase(sqlite3 *database) {
     std::cerr << error << std::endl;
     return B_ERROR;
   }
+  if (sqlite3_exec(database,
+                   "CREATE TABLE IF NOT EXISTS blobs("
+                   "cypherkey TEXT PRIMARY KEY, "
+                   "size INTEGER NOT NULL, "
+                   "path TEXT NOT NULL, "
+                   "accessed INTEGER NOT NULL) WITHOUT ROWID",
+                   NULL, NULL, &error) != SQLITE_OK) {
+    std::cerr << error << std::endl;
+    return B_ERROR;
+  }
+  if (sqlite3_exec(database,
+                   "CREATE TABLE IF NOT EXISTS feed_heads("
+                   "author TEXT PRIMARY KEY, "
+                   "sequence INTEGER NOT NULL DEFAULT 0, "
+                   "cypherkey TEXT, "
+                   "broken INTEGER NOT NULL DEFAULT 0, "
+                   "forked INTEGER NOT NULL DEFAULT 0, "
+                   "count INTEGER NOT NULL DEFAULT 0) WITHOUT ROWID",
+                   NULL, NULL, &error) != SQLITE_OK) {
+    std::cerr << error << std::endl;
+    return B_ERROR;
+  }
+  // Threads are kept in step with `messages` by the triggers below, so
+  // listing them or counting replies never has to look at the messages.
+  if (sqlite3_exec(database,
+                   "CREATE TABLE IF NOT EXISTS threads("
+                   "root TEXT PRIMARY KEY, "
+                   "replies INTEGER NOT NULL DEFAULT 0, "
+                   "participants INTEGER NOT NULL DEFAULT 0, "
+                   "lastActivity INTEGER NOT NULL) WITHOUT ROWID",
+                   NULL, NULL, &error) != SQLITE_OK) {
+    std::cerr << error << std::endl;
+    return B_ERROR;
+  }
+  if (sqlite3_exec(database,
+                   "CREATE INDEX IF NOT EXISTS threadtime "
+                   "ON threads(lastActivity)",
+                   NULL, NULL, &error) != SQLITE_OK) {
+    std::cerr << error << std::endl;
+    return B_ERROR;
+  }
+  if (sqlite3_exec(database,
+                   "CREATE TABLE IF NOT EXISTS thread_participants("
+                   "root TEXT NOT NULL, "
+                   "author TEXT NOT NULL, "
+                   "PRIMARY KEY(root, author)) WITHOUT ROWID",
+                   NULL, NULL, &error) != SQLITE_OK) {
+    std::cerr << error << std::endl;
+    return B_ERROR;
+  }
+  // Only posts are replies; votes, contacts and the like also carry a context
+  // but aren't counted.
+  {
+    BString triggers;
+    triggers << "CREATE TRIGGER IF NOT EXISTS thread_insert "
+             << "AFTER INSERT ON messages WHEN new.context IS NOT NULL "
+             << "AND new.type = 'post' "
+             << "BEGIN " << joinThread("new") << " END; "
+             << "CREATE TRIGGER IF NOT EXISTS thread_delete "
+             << "AFTER DELETE ON messages WHEN old.context IS NOT NULL "
+             << "AND old.type = 'post' "
+             << "BEGIN " << leaveThread("old") << " END; "
+             << "CREATE TRIGGER IF NOT EXISTS thread_leave "
+             << "AFTER UPDATE OF context ON messages "
+             << "WHEN old.context IS NOT NULL AND old.type = 'post' "
+             << "AND old.context IS NOT new.context "
+             << "BEGIN " << leaveThread("old") << " END; "
+             << "CREATE TRIGGER IF NOT EXISTS thread_join "
+             << "AFTER UPDATE OF context ON messages "
+             << "WHEN new.context IS NOT NULL AND new.type = 'post' "
+             << "AND old.context IS NOT new.context "
+             << "BEGIN " << joinThread("new") << " END;";
+    if (sqlite3_exec(database, triggers.String(), NULL, NULL, &error) !=
+        SQLITE_OK) {
+      std::cerr << error << std::endl;
+      return B_ERROR;
+    }
+  }
+  // Filled in behind ingest by the database looper's upkeep, keyed by the
+  // rowid of the message in `messages`.
+  if (sqlite3_exec(database,
+                   "CREATE VIRTUAL TABLE IF NOT EXISTS post_text "
+                   "USING fts5(text, "
+                   "tokenize = 'unicode61 remove_diacritics 2'); "
+                   "CREATE TRIGGER IF NOT EXISTS post_text_delete "
+                   "AFTER DELETE ON messages BEGIN "
+                   "DELETE FROM post_text WHERE rowid = old.rowid; END",
+                   NULL, NULL, &error) != SQLITE_OK) {
+    std::cerr << error << std::endl;
+    return B_ERROR;
+  }
+  // Display names, folded to lower case for looking up by prefix, with their
+  // trigrams for matching anywhere in a name. ProfileStore keeps the names
+  // up to date, and the triggers keep the trigrams in step with them.
+  if (sqlite3_exec(database,
+                   "CREATE TABLE IF NOT EXISTS profile_names("
+                   "author TEXT NOT NULL UNIQUE, "
+                   "name TEXT NOT NULL, "
+                   "folded TEXT NOT NULL); "
+                   "CREATE INDEX IF NOT EXISTS namefold "
+                   "ON profile_names(folded); "
+                   "CREATE VIRTUAL TABLE IF NOT EXISTS profile_trigrams "
+                   "USING fts5(folded, content = 'profile_names', "
+                   "tokenize = 'trigram'); "
+                   "CREATE TRIGGER IF NOT EXISTS profile_names_insert "
+                   "AFTER INSERT ON profile_names BEGIN "
+                   "INSERT INTO profile_trigrams(rowid, folded) "
+                   "VALUES(new.rowid, new.folded); END; "
+                   "CREATE TRIGGER IF NOT EXISTS profile_names_delete "
+                   "AFTER DELETE ON profile_names BEGIN "
+                   "INSERT INTO profile_trigrams(profile_trigrams, rowid, "
+                   "folded) VALUES('delete', old.rowid, old.folded); END; "
+                   "CREATE TRIGGER IF NOT EXISTS profile_names_update "
+                   "AFTER UPDATE OF folded ON profile_names BEGIN "
+                   "INSERT INTO profile_trigrams(profile_trigrams, rowid, "
+                   "folded) VALUES('delete', old.rowid, old.folded); "
+                   "INSERT INTO profile_trigrams(rowid, folded) "
+                   "VALUES(new.rowid, new.folded); END",
+                   NULL, NULL, &error) != SQLITE_OK) {
+    std::cerr << error << std::endl;
+    return B_ERROR;
+  }
+  if (sqlite3_exec(database,
+                   "CREATE TABLE IF NOT EXISTS dictionaries("
+                   "id INTEGER PRIMARY KEY, "
+                   "dictionary BLOB NOT NULL)",
+                   NULL, NULL, &error) != SQLITE_OK) {
+    std::cerr << error << std::endl;
+    return B_ERROR;
+  }
+  return B_OK;
+}
+
+static int32 userVersion(sqlite3 *database) {
+  sqlite3_stmt *version;
+  int32 result = 0;
+  if (sqlite3_prepare_v2(database, "PRAGMA user_version", -1, &version,
+                         NULL) == SQLITE_OK &&
+      sqlite3_step(version) == SQLITE_ROW) {
+    result = sqlite3_column_int(version, 0);
+  }
+  sqlite3_finalize(version);
+  return result;
+}
+
+bool upkeepDone(sqlite3 *database, int32 task) {
+  return (userVersion(database) & task) != 0;
+}
+
+void markUpkeepDone(sqlite3 *database, int32 task) {
+  sqlite3_exec(database, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL);
+  BString mark("PRAGMA user_version = ");
+  mark << (userVersion(database) | task);
+  sqlite3_exec(database, mark.String(), NULL, NULL, NULL);
+  sqlite3_exec(database, "COMMIT TRANSACTION", NULL, NULL, NULL);
+}
+
+// `feed_heads` is kept up to date as messages are saved, so it only needs
+// filling from `messages` when it is first created, or again once migrated
+// posts have been added behind its back.
+static inline void seedFeedHeads(sqlite3 *database, bool refresh) {
+  if (!refresh) {
+    sqlite3_stmt *empty;
+    sqlite3_prepare_v2(database, "SELECT 1 FROM feed_heads LIMIT 1", -1,
+                       &empty, NULL);
+    bool seeded = sqlite3_step(empty) == SQLITE_ROW;
+    sqlite3_finalize(empty);
+    if (seeded)
+      return;
+  }
+  char *error = NULL;
+  if (sqlite3_exec(database,
+                   "INSERT INTO feed_heads"
+                   "(author, sequence, cypherkey, count) "
+                   "SELECT feeds.author, ifnull(max(messages.sequence), 0), "
+                   "messages.cypherkey, count(messages.rowid) "
+                   "FROM feeds LEFT JOIN messages "
+                   "ON messages.author = feeds.author "
+                   "WHERE true GROUP BY feeds.author "
+                   "ON CONFLICT(author) DO UPDATE SET "
+                   "sequence = excluded.sequence, "
+                   "cypherkey = excluded.cypherkey, count = excluded.count",
+                   NULL, NULL, &error) != SQLITE_OK) {
+    std::cerr << error << std::endl;
+  }
+}
+
+// Names stored before `profile_names` existed are copied over once. Their
+// values are flattened BMessage strings, so end in a NUL.
+static inline void seedProfileNames(sqlite3 *database) {
+  sqlite3_stmt *empty;
+  sqlite3_prepare_v2(database, "SELECT 1 FROM profile_names LIMIT 1", -1,
+                     &empty, NULL);
+  bool seeded = sqlite3_step(empty) == SQLITE_ROW;
+  sqlite3_finalize(empty);
+  if (seeded)
+    return;
+  sqlite3_stmt *seed;
+  sqlite3_prepare_v2(database,
+                     "INSERT OR IGNORE INTO profile_names(author, name, "
+                     "folded) SELECT author, name, lower(name) FROM ("
+                     "SELECT author, "
+                     "CAST(substr(value, 1, length(value) - 1) AS TEXT) "
+                     "AS name FROM profiles "
+                     "WHERE property = 'name' AND type = ?) "
+                     "WHERE name != ''",
+                     -1, &seed, NULL);
+  sqlite3_bind_int64(seed, 1, B_STRING_TYPE);
+  if (sqlite3_step(seed) != SQLITE_DONE)
+    std::cerr << sqlite3_errmsg(database) << std::endl;
+  sqlite3_finalize(seed);
+}
+
+// Messages stored before `threads` existed are counted in one pass. After
+// that the triggers keep it up to date.
+static inline void seedThreads(sqlite3 *database) {
+  if (upkeepDone(database, kUpkeepThreads))
+    return;
+  char *error = NULL;
+  if (sqlite3_exec(database,
+                   "BEGIN TRANSACTION; "
+                   "INSERT OR IGNORE INTO thread_participants(root, author) "
+                   "SELECT DISTINCT context, author FROM messages "
+                   "WHERE context IS NOT NULL AND type = 'post'; "
+                   "INSERT OR IGNORE INTO threads"
+                   "(root, replies, participants, lastActivity) "
+                   "SELECT context, count(*), count(DISTINCT author), "
+                   "max(timestamp) FROM messages "
+                   "WHERE context IS NOT NULL AND type = 'post' "
+                   "GROUP BY context; "
+                   "COMMIT TRANSACTION",
+                   NULL, NULL, &error) != SQLITE_OK) {
+    std::cerr << error << std::endl;
+    sqlite3_exec(database, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+    return;
+  }
+  markUpkeepDone(database, kUpkeepThreads);
+}
+
+namespace {
+// A legacy post file, read and checksummed by one of the reader threads.
+struct LegacyPost {
+  entry_ref ref;
+  BString cypherkey;
+  BString author;
+  int64 sequence = 0;
+  int64 timestamp = 0;
+  BString type;
+  BString context;
+  bool hasType = false;
+  bool hasContext = false;
+  std::unique_ptr<char[]> body;
+  size_t size = 0;
+  uint64 checksum = 0;
+  bool ok = false;
+};
+
+// Readers take files from `refs` and pass them to the single writer through
+// a bounded queue.
+struct MigrationPipeline {
+  std::vector<entry_ref> refs;
+  std::atomic<size_t> next = 0;
+  std::atomic<bool> stop = false;
+  BLocker lock{"Migration queue"};
+  std::deque<std::unique_ptr<LegacyPost>> queue;
+  sem_id filled;
+  sem_id space;
+};
+
+uint64 bodyChecksum(const void *data, size_t size) {
+  static const unsigned char key[crypto_shorthash_KEYBYTES] = {};
+  unsigned char hash[crypto_shorthash_BYTES];
+  crypto_shorthash(hash, (const unsigned char *)data, size, key);
+  uint64 result;
+  memcpy(&result, hash, sizeof(result));
+  return result;
+}
+
+void sqlBodyChecksum(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  sqlite3_result_int64(context,
+                       (int64)bodyChecksum(sqlite3_value_blob(argv[0]),
+                                           sqlite3_value_bytes(argv[0])));
+}
+
+void readLegacyPost(LegacyPost *post) {
+  BFile file(&post->ref, B_READ_ONLY);
+  off_t size;
+  if (file.InitCheck() != B_OK || file.GetSize(&size) != B_OK || size <= 0)
+    return;
+  std::unique_ptr<char[]> raw(new char[size]);
+  if (file.ReadAt(0, raw.get(), size) != size ||
+      file.ReadAttrString("HABITAT:cypherkey", &post->cypherkey) != B_OK ||
+      file.ReadAttrString("HABITAT:author", &post->author) != B_OK) {
+    return;
+  }
+  // Files that don't hold a message are left where they are.
+  BMessage message;
+  if (message.Unflatten(raw.get()) != B_OK) {
+    std::cerr << "Skipping unreadable post " << post->ref.name << std::endl;
+    return;
+  }
+  ssize_t flatSize = message.FlattenedSize();
+  if (flatSize <= 0)
+    return;
+  post->body.reset(new char[flatSize]);
+  post->size = flatSize;
+  if (message.Flatten(post->body.get(), flatSize) != B_OK)
+    return;
+  file.ReadAttr("HABITAT:sequence", B_INT64_TYPE, 0, &post->sequence,
+                sizeof(int64));
+  file.ReadAttr("HABITAT:timestamp", B_INT64_TYPE, 0, &post->timestamp,
+                sizeof(int64));
+  post->hasType = file.ReadAttrString("HABITAT:type", &post->type) == B_OK;
+  post->hasContext =
+      file.ReadAttrString("HABITAT:context", &post->context) == B_OK;
+  post->checksum = bodyChecksum(post->body.get(), post->size);
+  post->ok = true;
+}
+
+int32 migrationReader(void *data) {
+  auto pipeline = (MigrationPipeline *)data;
+  for (size_t i = pipeline->next++;
+       i < pipeline->refs.size() && !pipeline->stop; i = pipeline->next++) {
+    auto post = std::make_unique<LegacyPost>();
+    post->ref = pipeline->refs[i];
+    readLegacyPost(post.get());
+    if (acquire_sem(pipeline->space) != B_OK)
+      break;
+    {
+      BAutolock lock(pipeline->lock);
+      pipeline->queue.push_back(std::move(post));
+    }
+    release_sem(pipeline->filled);
+  }
   return B_OK;
 }
 
-static void freeBuffer(void *arg) { delete[] (char *)arg; }
+std::unique_ptr<LegacyPost> nextLegacyPost(MigrationPipeline *pipeline) {
+  std::unique_ptr<LegacyPost> post;
+  if (acquire_sem(pipeline->filled) != B_OK)
+    return post;
+  {
+    BAutolock lock(pipeline->lock);
+    post = std::move(pipeline->queue.front());
+    pipeline->queue.pop_front();
+  }
+  release_sem(pipeline->space);
+  return post;
+}
+} // namespace
 
+// Moves posts from the old one-file-per-message store into `messages`. Files
+// are read in parallel and written in large transactions by this thread. A
+// file is only removed once its batch has been committed and the checksums of
+// the rows it added match, so an interrupted migration just carries on from
+// the files that are left the next time. `*added` counts the rows committed,
+// even if the migration then stops.
 static inline status_t migrateMessages(sqlite3 *database,
-                                       const BDirectory &settings) {
+                                       const BDirectory &settings,
+                                       size_t *added) {
   BDirectory postsDir;
   {
     BEntry postsEntry;
@@ -153,118 +575,169 @@ static inline status_t migrateMessages(sqlite3 *database,
   }
   query.SetPredicate("HABITAT:author=\"**\"");
   query.Fetch();
-  BEntry entry;
+  MigrationPipeline pipeline;
+  for (entry_ref ref; query.GetNextRef(&ref) == B_OK;)
+    pipeline.refs.push_back(ref);
+  const size_t total = pipeline.refs.size();
+  if (total == 0)
+    return B_OK;
+  std::cerr << "Migrating " << total << " posts to the database" << std::endl;
+  sqlite3_create_function(database, "migration_checksum", 1,
+                          SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                          sqlBodyChecksum, NULL, NULL);
+  pipeline.filled = create_sem(0, "Migrated posts read");
+  pipeline.space = create_sem(MIGRATE_QUEUE, "Migration queue space");
+  std::vector<thread_id> threads;
+  {
+    system_info info;
+    uint32 readers = 1;
+    if (get_system_info(&info) == B_OK && info.cpu_count > 1)
+      readers = info.cpu_count;
+    readers = std::min<size_t>(readers, total);
+    for (uint32 i = 0; i < readers; i++) {
+      thread_id thread = spawn_thread(migrationReader, "Post migration reader",
+                                      B_NORMAL_PRIORITY, &pipeline);
+      if (thread >= B_OK && resume_thread(thread) == B_OK)
+        threads.push_back(thread);
+    }
+  }
   sqlite3_stmt *insert;
   sqlite3_prepare_v2(
       database,
       "INSERT INTO messages"
       "(cypherkey, author, sequence, timestamp, type, context, body) "
       "VALUES(?, ?, ?, ?, ?, ?, ?)",
-      200, &insert, NULL);
+      -1, &insert, NULL);
   sqlite3_stmt *verify;
-  sqlite3_prepare_v2(
-      database,
-      "SELECT cypherkey, author, sequence, timestamp, type, context, body "
-      "FROM messages WHERE cypherkey = ?",
-      -1, &verify, NULL);
-  while (query.GetNextEntry(&entry) == B_OK) {
-    BMessage blob;
-    BString cypherkey;
-    BString author;
-    int64 sequence;
-    int64 timestamp;
-    BString type;
-    BString context;
-    bool hasType;
-    bool hasContext;
-    {
-      BFile file(&entry, B_READ_ONLY);
-      blob.Unflatten(&file);
-      file.ReadAttrString("HABITAT:cypherkey", &cypherkey);
-      file.ReadAttrString("HABITAT:author", &author);
-      file.ReadAttr("HABITAT:sequence", B_INT64_TYPE, 0, &sequence,
-                    sizeof(int64));
-      file.ReadAttr("HABITAT:timestamp", B_INT64_TYPE, 0, &timestamp,
-                    sizeof(int64));
-      hasType = file.ReadAttrString("HABITAT:type", &type) == B_OK;
-      hasContext = file.ReadAttrString("HABITAT:context", &context) == B_OK;
+  sqlite3_prepare_v2(database,
+                     "SELECT migration_checksum(body) FROM messages "
+                     "WHERE cypherkey = ?",
+                     -1, &verify, NULL);
+  status_t result = threads.empty() ? B_NO_MORE_THREADS : B_OK;
+  size_t done = 0;
+  while (result == B_OK && done < total) {
+    std::vector<std::pair<BString, uint64>> inserted;
+    std::vector<entry_ref> migrated;
+    sqlite3_exec(database, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    for (int32 n = 0; n < MIGRATE_BATCH && done < total; n++, done++) {
+      std::unique_ptr<LegacyPost> post = nextLegacyPost(&pipeline);
+      if (!post) {
+        result = B_ERROR;
+        break;
+      }
+      if (!post->ok)
+        continue;
+      sqlite3_bind_text(insert, 1, post->cypherkey.String(),
+                        post->cypherkey.Length(), SQLITE_STATIC);
+      sqlite3_bind_text(insert, 2, post->author.String(),
+                        post->author.Length(), SQLITE_STATIC);
+      sqlite3_bind_int64(insert, 3, post->sequence);
+      sqlite3_bind_int64(insert, 4, post->timestamp);
+      if (post->hasType) {
+        sqlite3_bind_text(insert, 5, post->type.String(), post->type.Length(),
+                          SQLITE_STATIC);
+      } else {
+        sqlite3_bind_null(insert, 5);
+      }
+      if (post->hasContext) {
+        sqlite3_bind_text(insert, 6, post->context.String(),
+                          post->context.Length(), SQLITE_STATIC);
+      } else {
+        sqlite3_bind_null(insert, 6);
+      }
+      sqlite3_bind_blob64(insert, 7, post->body.get(), post->size,
+                          SQLITE_STATIC);
+      if (sqlite3_step(insert) == SQLITE_DONE) {
+        // Rows that were already there are from an earlier, interrupted run.
+        if (sqlite3_changes(database) > 0)
+          inserted.push_back({post->cypherkey, post->checksum});
+        migrated.push_back(post->ref);
+      }
+      sqlite3_reset(insert);
     }
-    sqlite3_bind_text(insert, 1, cypherkey.String(), cypherkey.Length(),
-                      SQLITE_STATIC);
-    sqlite3_bind_text(insert, 2, author.String(), author.Length(),
-                      SQLITE_STATIC);
-    sqlite3_bind_int64(insert, 3, sequence);
-    sqlite3_bind_int64(insert, 4, timestamp);
-    if (hasType)
-      sqlite3_bind_text(insert, 5, type.String(), type.Length(), SQLITE_STATIC);
-    else
-      sqlite3_bind_null(insert, 5);
-    if (hasContext) {
-      sqlite3_bind_text(insert, 6, context.String(), context.Length(),
+    for (auto &[cypherkey, checksum] : inserted) {
+      if (result != B_OK)
+        break;
+      sqlite3_bind_text(verify, 1, cypherkey.String(), cypherkey.Length(),
                         SQLITE_STATIC);
-    } else {
-      sqlite3_bind_null(insert, 6);
-    }
-    ssize_t flatSize = blob.FlattenedSize();
-    char *buffer = new char[flatSize];
-    blob.Flatten(buffer, flatSize);
-    sqlite3_bind_blob64(insert, 7, buffer, flatSize, freeBuffer);
-    sqlite3_step(insert);
-    sqlite3_reset(insert);
-    // Verify that the new row equals what we expect it to.
-    sqlite3_bind_text(verify, 1, cypherkey.String(), cypherkey.Length(),
-                      SQLITE_STATIC);
-    if (sqlite3_step(verify) != SQLITE_ROW) {
-      std::cerr << "Could not find the row just inserted." << std::endl;
-      exit(-1);
-    }
-    if (cypherkey != (const char *)sqlite3_column_text(verify, 0)) {
-      std::cerr << "Inserted cypherkey mismatch!" << std::endl;
-      std::cerr << cypherkey.String()
-                << " != " << sqlite3_column_text(verify, 1) << std::endl;
-      exit(-1);
-    }
-    if (author != (const char *)sqlite3_column_text(verify, 1)) {
-      std::cerr << "Inserted author mismatch!" << std::endl;
-      exit(-1);
+      if (sqlite3_step(verify) != SQLITE_ROW ||
+          (uint64)sqlite3_column_int64(verify, 0) != checksum) {
+        std::cerr << "Inserted blob mismatch for " << cypherkey.String()
+                  << std::endl;
+        result = B_ERROR;
+      }
+      sqlite3_reset(verify);
     }
-    if (sequence != sqlite3_column_int64(verify, 2)) {
-      std::cerr << "Inserted sequence mismatch!" << std::endl;
-      exit(-1);
+    if (result != B_OK) {
+      sqlite3_exec(database, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+      break;
     }
-    if (timestamp != sqlite3_column_int64(verify, 3)) {
-      std::cerr << "Inserted timestamp mismatch!" << std::endl;
-      exit(-1);
-    }
-    if (type != (const char *)sqlite3_column_text(verify, 4)) {
-      std::cerr << "Inserted type mismatch!" << std::endl;
-      exit(-1);
-    }
-    if (context != "" &&
-        context != (const char *)sqlite3_column_text(verify, 5)) {
-      std::cerr << "Inserted context mismatch" << std::endl;
-      exit(-1);
-    }
-    if (sqlite3_column_bytes(verify, 6) != flatSize ||
-        std::memcmp(sqlite3_column_blob(verify, 6), buffer, flatSize) != 0) {
-      std::cerr << "Inserted blob mismatch" << std::endl;
-      exit(-1);
-    }
-    sqlite3_reset(verify);
-    if (BDirectory parent;
-        entry.GetParent(&parent) == B_OK && parent == postsDir) {
-      entry.Remove();
+    sqlite3_exec(database, "COMMIT TRANSACTION", NULL, NULL, NULL);
+    *added += inserted.size();
+    for (auto &ref : migrated) {
+      BEntry entry(&ref);
+      BDirectory parent;
+      if (entry.GetParent(&parent) == B_OK && parent == postsDir)
+        entry.Remove();
     }
+    std::cerr << "Migrated " << done << " of " << total << " posts"
+              << std::endl;
+  }
+  pipeline.stop = true;
+  delete_sem(pipeline.space);
+  delete_sem(pipeline.filled);
+  for (auto thread : threads) {
+    status_t exitValue;
+    wait_for_thread(thread, &exitValue);
   }
   sqlite3_finalize(verify);
   sqlite3_finalize(insert);
-  return B_OK;
+  return result;
+}
+
+// A desktop shares the machine with everything else; a pub mostly serves
+// reads of a large database; a bulk import is a one-off sync that wants a big
+// cache and few checkpoints. All of them write with synchronous = NORMAL,
+// which in WAL mode can lose the last few commits to a power cut but leaves
+// the database intact. OFF would save little more and risk corrupting it.
+const StorageProfile storageProfiles[] = {
+    {"desktop", 16 * 1024, 256LL << 20, 1, 4096, 0},
+    {"pub", 64 * 1024, 1LL << 30, 1, 8192, 2},
+    {"bulk-import", 256 * 1024, 1LL << 30, 1, 32768, 2},
+    {NULL}};
+
+// Unknown names get the first profile.
+const StorageProfile &storageProfile(const char *name) {
+  for (auto profile = storageProfiles; name != NULL && profile->name != NULL;
+       profile++) {
+    if (strcmp(profile->name, name) == 0)
+      return *profile;
+  }
+  return storageProfiles[0];
+}
+
+// Readers get a quarter of the writer's page cache each, since there are
+// several of them and the memory map is shared between them anyway.
+// Checkpointing is left to the caller on the writer.
+void applyStorageProfile(sqlite3 *database, const StorageProfile &profile,
+                         bool writer) {
+  BString sql;
+  sql << "PRAGMA cache_size = -"
+      << (writer ? profile.cacheKiB : profile.cacheKiB / 4) << ";"
+      << "PRAGMA mmap_size = " << profile.mmapSize << ";"
+      << "PRAGMA temp_store = " << profile.tempStore << ";";
+  if (writer)
+    sql << "PRAGMA synchronous = " << profile.synchronous << ";";
+  sqlite3_exec(database, sql.String(), NULL, NULL, NULL);
 }
 
 static inline void setWal(sqlite3 *database) {
   char *error = NULL;
   sqlite3_exec(database, "PRAGMA journal_mode = WAL", NULL, NULL, &error);
   sqlite3_exec(database, "pragma wal_checkpoint(truncate)", NULL, NULL, &error);
+  // The WAL is cut back to this size whenever a checkpoint lets it restart.
+  sqlite3_exec(database, "PRAGMA journal_size_limit = 67108864", NULL, NULL,
+               &error);
 }
 
 sqlite3 *migrateToSqlite(const BDirectory &settings) {
@@ -275,11 +748,54 @@ sqlite3 *migrateToSqlite(const BDirectory &settings) {
     dbEntry.GetPath(&dbPath);
     sqlite3_open(dbPath.Path(), &database);
   }
+  sqlite3_busy_timeout(database, DATABASE_BUSY_MS);
   if (prepareDatabase(database) != B_OK) {
     sqlite3_close(database);
     return NULL;
   }
   setWal(database);
-  migrateMessages(database, settings);
+  seedThreads(database);
+  seedProfileNames(database);
+  size_t added = 0;
+  if (migrateMessages(database, settings, &added) != B_OK) {
+    std::cerr << "Post migration stopped early; the rest will be tried again "
+                 "next time"
+              << std::endl;
+  }
+  seedFeedHeads(database, added > 0);
+  return database;
+}
+
+// Opens an extra connection for reading only. The database must already have
+// been prepared by `migrateToSqlite`, which leaves it in WAL mode so these
+// never block the writer.
+sqlite3 *openReader(const BDirectory &settings) {
+  sqlite3 *database;
+  BEntry dbEntry(&settings, "database.sqlite3");
+  BPath dbPath;
+  dbEntry.GetPath(&dbPath);
+  if (sqlite3_open_v2(dbPath.Path(), &database,
+                      SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,
+                      NULL) != SQLITE_OK) {
+    sqlite3_close(database);
+    return NULL;
+  }
+  return database;
+}
+
+// Opens an extra connection that may write, for stores that are kept apart
+// from the database looper. Like `openReader`, this expects `migrateToSqlite`
+// to have run already.
+sqlite3 *openWriter(const BDirectory &settings) {
+  sqlite3 *database;
+  BEntry dbEntry(&settings, "database.sqlite3");
+  BPath dbPath;
+  dbEntry.GetPath(&dbPath);
+  if (sqlite3_open_v2(dbPath.Path(), &database, SQLITE_OPEN_READWRITE,
+                      NULL) != SQLITE_OK) {
+    sqlite3_close(database);
+    return NULL;
+  }
+  sqlite3_busy_timeout(database, DATABASE_BUSY_MS);
   return database;
 }
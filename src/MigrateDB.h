@@ -5,7 +5,35 @@
 #include <SupportDefs.h>
 #include <sqlite3.h>
 
+// Connection tuning for the kind of node Habitat is running as.
+struct StorageProfile {
+  const char *name;
+  int64 cacheKiB;
+  int64 mmapSize;
+  int synchronous;
+  int checkpointPages;
+  int tempStore;
+};
+
+extern const StorageProfile storageProfiles[];
+
+// One-off upkeep is recorded as bits of the database's user_version once it
+// has been done, so that it isn't tried again on every start.
+enum {
+  kUpkeepThreads = 1 << 0,
+  kUpkeepSearch = 1 << 1,
+  kUpkeepContexts = 1 << 2,
+  kUpkeepBlobs = 1 << 3,
+};
+
+const StorageProfile &storageProfile(const char *name);
+void applyStorageProfile(sqlite3 *database, const StorageProfile &profile,
+                         bool writer);
 sqlite3 *migrateToSqlite(const BDirectory &settings);
+sqlite3 *openReader(const BDirectory &settings);
+sqlite3 *openWriter(const BDirectory &settings);
 status_t prepareDatabase(sqlite3 *database);
+bool upkeepDone(sqlite3 *database, int32 task);
+void markUpkeepDone(sqlite3 *database, int32 task);
 
 #endif // MIGRATE_DB_H
@@ -1,4 +1,5 @@
 #include "Plugin.h"
+#include "Logging.h"
 #include <Directory.h>
 #include <Entry.h>
 extern "C" {
@@ -9,7 +10,26 @@ extern "C" {
 
 Plugins habitat_plugins;
 
-Plugins::Plugins() {
+// Starts finding plugins on another thread, so that whoever first needs them
+// is less likely to wait.
+void Plugins::preload() {
+  thread_id thread =
+      spawn_thread(preloadThread, "Plugin loader", B_LOW_PRIORITY, this);
+  if (thread >= B_OK)
+    resume_thread(thread);
+}
+
+status_t Plugins::preloadThread(void *data) {
+  static_cast<Plugins *>(data)->loaded();
+  return B_OK;
+}
+
+const std::vector<Plugin> &Plugins::loaded() {
+  std::call_once(this->once, [this]() { this->load(); });
+  return this->plugins;
+}
+
+void Plugins::load() {
   BString libpath(std::getenv("LIBRARY_PATH"));
   std::set<BString> names;
   int32 pathOffset = 0;
@@ -36,6 +56,7 @@ Plugins::Plugins() {
         continue;
       filename.Prepend("/");
       filename.Prepend(segment);
+      bigtime_t start = system_time();
       void *handle = dlopen(filename.String(), RTLD_LAZY | RTLD_LOCAL);
       if (!handle)
         continue;
@@ -43,22 +64,45 @@ Plugins::Plugins() {
       nameCall_t nameCall = (nameCall_t)dlsym(handle, "pluginName");
       const char *pluginName = NULL;
       if (nameCall == NULL || (pluginName = nameCall()) == NULL ||
-          !names.insert(pluginName).second) {
+          names.count(pluginName) > 0) {
         dlclose(handle);
         continue;
       }
-      this->plugins.push_back({pluginName, handle});
+      Plugin plugin;
+      plugin.name = pluginName;
+      plugin.path = filename;
+      plugin.handle = handle;
+      typedef int32 (*abiCall_t)();
+      if (auto abiCall = (abiCall_t)dlsym(handle, "pluginABI"); abiCall)
+        plugin.abi = abiCall();
+      else
+        plugin.abi = 1;
+      if (plugin.abi > HABITAT_PLUGIN_ABI) {
+        BString logText("Skipping plugin ");
+        logText << plugin.name << " built for interface version "
+                << plugin.abi;
+        writeLog('PLUG', logText);
+        dlclose(handle);
+        continue;
+      }
+      plugin.selectContacts = (decltype(plugin.selectContacts))dlsym(
+          handle, "selectContacts");
+      plugin.selectContactsView = NULL;
+      if (plugin.abi >= 2) {
+        plugin.selectContactsView = (decltype(plugin.selectContactsView))dlsym(
+            handle, "selectContactsView");
+      }
+      plugin.defaultConfig =
+          (decltype(plugin.defaultConfig))dlsym(handle, "defaultConfig");
+      plugin.registerViewer =
+          (decltype(plugin.registerViewer))dlsym(handle, "registerViewer");
+      plugin.loadTime = system_time() - start;
+      BString logText("Loaded plugin ");
+      logText << plugin.name << " from " << plugin.path << " in "
+              << plugin.loadTime << " microseconds";
+      writeLog('PLUG', logText);
+      names.insert(plugin.name);
+      this->plugins.push_back(plugin);
     }
   }
 }
-
-std::vector<std::pair<const BString &, void *>>
-Plugins::lookup(const char *symbol) {
-  std::vector<std::pair<const BString &, void *>> result;
-  for (auto &plugin : this->plugins) {
-    void *pointer = dlsym(plugin.second, symbol);
-    if (pointer != NULL)
-      result.push_back({plugin.first, pointer});
-  }
-  return result;
-}
@@ -2,16 +2,59 @@
 #define PLUGIN_H
 
 #include <String.h>
-#include <utility>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
 #include <vector>
 
+class BView;
+struct ContactSelection;
+struct GraphView;
+
+// Plugins say which version of the plugin interface they were built for with
+// `extern "C" int32 pluginABI()`; those without it are version 1.
+//  1: selectContacts(ContactSelection *, std::set<BString> *, BMessage *
+//     config, BMessage *graph), with the whole graph flattened into a
+//     BMessage.
+//  2: selectContactsView(ContactSelection *, const std::set<BString> *,
+//     BMessage *config, const GraphView *), with the graph read in place.
+//     The selection holds what the plugin returned last time and is updated
+//     in place, with the feeds whose membership changed added to `changed`.
+#define HABITAT_PLUGIN_ABI 2
+
+typedef std::map<BString, std::function<BView *(BMessage *)>> ViewerRegistry;
+
+// A loaded plugin, with its entry points looked up once. Those it doesn't
+// export, or that are newer than the version it was built for, are NULL.
+struct Plugin {
+  BString name;
+  BString path;
+  int32 abi;
+  // How long opening the library and finding its entry points took.
+  bigtime_t loadTime;
+  status_t (*selectContacts)(ContactSelection *, std::set<BString> *,
+                             BMessage *config, BMessage *graph);
+  status_t (*selectContactsView)(ContactSelection *, const std::set<BString> *,
+                                 BMessage *config, const GraphView *);
+  status_t (*defaultConfig)(BMessage *);
+  status_t (*registerViewer)(ViewerRegistry *);
+  void *handle;
+};
+
+// Plugins are found in habitat_plugins under each LIBRARY_PATH entry the
+// first time they are asked for, or in the background after `preload`.
+// Plugins built for a newer version of the interface are left out.
 class Plugins {
 public:
-  Plugins();
-  std::vector<std::pair<const BString &, void *>> lookup(const char *symbol);
+  void preload();
+  const std::vector<Plugin> &loaded();
 
 private:
-  std::vector<std::pair<BString, void *>> plugins;
+  static status_t preloadThread(void *data);
+  void load();
+  std::once_flag once;
+  std::vector<Plugin> plugins;
 };
 
 extern Plugins habitat_plugins;
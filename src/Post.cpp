@@ -1,28 +1,39 @@
 #include "Post.h"
 #include "BJSON.h"
 #include "Base64.h"
+#include "BodyCodec.h"
 #include "Logging.h"
+#include "MigrateDB.h"
 #include "SignJSON.h"
 #include <Application.h>
+#include <Autolock.h>
 #include <File.h>
 #include <MessageQueue.h>
 #include <MessageRunner.h>
 #include <NodeMonitor.h>
+#include <OS.h>
 #include <Path.h>
 #include <StringList.h>
 #include <algorithm>
 #include <cstring>
 #include <ctime>
 #include <iostream>
+#include <set>
 #include <unicode/utf8.h>
 #include <variant>
 #include <vector>
 
-/*
-TODO: Add something to periodically recompute `context` column
-*/
-
 #define FEED_DB static_cast<SSBDatabase *>(this->Looper())->database
+#define QUERY_PAGE 128
+#define QUERY_READERS_MAX 8
+#define RECOMPRESS_BATCH 256
+#define MAINTENANCE_INTERVAL 5000000
+#define MAINTENANCE_IDLE 2000000
+#define OPTIMIZE_AFTER 50000
+#define VACUUM_PAGES 256
+#define CONTEXT_BATCH 256
+#define SEARCH_BATCH 256
+#define SEARCH_RESULTS 50
 
 static inline status_t eitherNumber(int64 *result, const BMessage *source,
                                     const char *name) {
@@ -75,6 +86,74 @@ timeBoundaries(const BMessage &specifier) {
   return result;
 }
 
+// A live query's specifier, parsed once so that new messages can be checked
+// without going back to the BMessage.
+struct QueryPredicate {
+  QueryPredicate(const BMessage &specifier);
+  bool matches(const BString &cypherkey, const BString &author,
+               const BString &context, const BString &type,
+               const int64 *timestamp) const;
+  std::set<BString> keys;
+  std::set<BString> authors;
+  std::set<BString> contexts;
+  std::set<BString> types;
+  std::vector<std::pair<TimeThreshold, int64>> boundaries;
+  bool selfReferent = false;
+};
+
+static void stringSet(std::set<BString> *values, const BMessage &specifier,
+                      const char *name) {
+  BString value;
+  for (int32 i = 0; specifier.FindString(name, i, &value) == B_OK; i++)
+    values->insert(value);
+}
+
+QueryPredicate::QueryPredicate(const BMessage &specifier)
+    : boundaries(timeBoundaries(specifier)) {
+  stringSet(&this->keys, specifier,
+            specifier.what == 'CPLX' ? "cypherkey" : "name");
+  stringSet(&this->authors, specifier, "author");
+  stringSet(&this->contexts, specifier, "context");
+  stringSet(&this->types, specifier, "type");
+  BString specialCase;
+  for (int32 i = 0;
+       specifier.FindString("specialCase", i, &specialCase) == B_OK; i++) {
+    if (specialCase == "selfReferent")
+      this->selfReferent = true;
+  }
+}
+
+bool QueryPredicate::matches(const BString &cypherkey, const BString &author,
+                             const BString &context, const BString &type,
+                             const int64 *timestamp) const {
+  if (!this->keys.empty() && this->keys.count(cypherkey) == 0)
+    return false;
+  if (!this->authors.empty() && this->authors.count(author) == 0)
+    return false;
+  if (!this->contexts.empty() && this->contexts.count(context) == 0)
+    return false;
+  if (this->selfReferent && context != author)
+    return false;
+  if (!this->types.empty() && this->types.count(type) == 0)
+    return false;
+  if (!this->boundaries.empty() && timestamp != NULL) {
+    bool provisio = true;
+    for (auto &[btype, boundary] : this->boundaries) {
+      if (btype == TimeThreshold::EARLIEST) {
+        if (*timestamp < boundary)
+          return false;
+        provisio = true;
+      } else {
+        if (*timestamp <= boundary)
+          return true;
+        provisio = false;
+      }
+    }
+    return provisio;
+  }
+  return true;
+}
+
 status_t timestamps_clause(BString &clause,
                            std::vector<std::variant<BString, int64>> &terms,
                            const BMessage &specifier) {
@@ -138,16 +217,25 @@ status_t timestamps_clause(BString &clause,
 
 class QueryHandler : public QueryBacked {
 public:
-  QueryHandler(sqlite3 *db, BMessenger target, const BMessage &specifier);
+  QueryHandler(sqlite3 *db, BMessenger target, const BMessage &specifier,
+               BLooper *decoder = NULL);
   void MessageReceived(BMessage *message) override;
   bool queryMatch(const BString &cypherkey, const BString &context,
                   const BMessage &msg) override;
   status_t runBulk(BMessage *reply);
+  void capRows(sqlite3 *db);
   int32 limit = -1;
+  int32 batch = 0;
+  const QueryPredicate predicate;
 
 private:
+  void closeQuery();
   BMessenger target;
+  BMessenger decoder;
   BMessage specifier;
+  int64 afterTimestamp = INT64_MIN;
+  int64 afterRow = INT64_MIN;
+  int64 lastRow = 0;
   bool started = false;
   bool ongoing = false;
   bool drips = false;
@@ -188,10 +276,44 @@ static int string_term(BString &clause,
   return values.size();
 }
 
-static inline sqlite3_stmt *spec2query(sqlite3 *db, const BMessage &specifier) {
+// Each word becomes a quoted FTS5 string, so that whatever was typed into a
+// search box matches posts containing all of it instead of being parsed as
+// query syntax.
+static BString searchTerms(const BString &text) {
+  BString result;
+  BStringList words;
+  text.Split(" ", true, words);
+  for (int32 i = 0; i < words.CountStrings(); i++) {
+    BString word = words.StringAt(i);
+    word.Trim();
+    if (word.IsEmpty())
+      continue;
+    word.ReplaceAll("\"", "\"\"");
+    if (!result.IsEmpty())
+      result << ' ';
+    result << '"' << word << '"';
+  }
+  return result;
+}
+
+// Paged queries take three more parameters, the newest rowid to include and
+// the (timestamp, rowid) of the last row already seen, and return a page at a
+// time in that order. Searches are joined against `post_text` and, unless
+// paged, come back best match first.
+static inline sqlite3_stmt *spec2query(sqlite3 *db, const BMessage &specifier,
+                                       bool paged = false) {
   std::vector<std::variant<BString, int64>> terms;
-  BString query = "SELECT cypherkey, context, body FROM messages";
+  BString query = "SELECT cypherkey, context, body, timestamp, rowid "
+                  "FROM messages";
   const char *separator = " WHERE ";
+  BString search;
+  if (specifier.FindString("search", &search) == B_OK) {
+    query = "SELECT cypherkey, context, body, timestamp, messages.rowid "
+            "FROM post_text JOIN messages "
+            "ON messages.rowid = post_text.rowid WHERE post_text MATCH ?";
+    terms.push_back(searchTerms(search));
+    separator = " AND ";
+  }
 #define QRY_STR(attr, column)                                                  \
   {                                                                            \
     BString clause;                                                            \
@@ -204,7 +326,17 @@ static inline sqlite3_stmt *spec2query(sqlite3 *db, const BMessage &specifier) {
   QRY_STR(specifier.what == 'CPLX' ? "cypherkey" : "name", "cypherkey")
   QRY_STR("author", "author")
   QRY_STR("context", "context")
-  QRY_STR("type", "type") {
+  // A page should come straight off an index in timestamp order. Filtering on
+  // several types, or on a type within a thread, is cheaper row by row than
+  // merging the type index and sorting, so it is hidden from the planner with
+  // a unary `+`. Dregs are the exception, as their index leads with type.
+  const char *typeColumn = "type";
+  if (int32 types; paged && !specifier.GetBool("dregs", false) &&
+      specifier.GetInfo("type", NULL, &types) == B_OK &&
+      (types > 1 || specifier.HasString("context"))) {
+    typeColumn = "+type";
+  }
+  QRY_STR("type", typeColumn) {
     BString clause;
     if (timestamps_clause(clause, terms, specifier) == B_OK) {
       query.Append(separator);
@@ -229,6 +361,14 @@ static inline sqlite3_stmt *spec2query(sqlite3 *db, const BMessage &specifier) {
       }
     }
   }
+  if (paged) {
+    query.Append(separator);
+    separator = " AND ";
+    query << "messages.rowid <= ? AND (timestamp, messages.rowid) > (?, ?) "
+          << "ORDER BY timestamp, messages.rowid LIMIT " << QUERY_PAGE;
+  } else if (!search.IsEmpty()) {
+    query.Append(" ORDER BY rank");
+  }
   sqlite3_stmt *result;
   sqlite3_prepare_v2(db, query.String(), query.Length(), &result, NULL);
   int i = 1;
@@ -245,12 +385,36 @@ static inline sqlite3_stmt *spec2query(sqlite3 *db, const BMessage &specifier) {
 }
 
 QueryHandler::QueryHandler(sqlite3 *db, BMessenger target,
-                           const BMessage &specifier)
-    : QueryBacked(spec2query(db, specifier)),
+                           const BMessage &specifier, BLooper *decoder)
+    : QueryBacked(spec2query(db, specifier, decoder != NULL)),
+      predicate(specifier),
       target(target),
+      decoder(decoder),
       specifier(specifier),
       dregs(specifier.GetBool("dregs", false)) {}
 
+void QueryHandler::closeQuery() {
+  if (this->query) {
+    sqlite3_finalize(this->query);
+    this->query = NULL;
+  }
+}
+
+// Pages stop at the newest message stored by now; anything newer reaches us
+// through 'CHCK' instead, so it mustn't be read twice. This is called once the
+// query is live, so that nothing falls between the two.
+void QueryHandler::capRows(sqlite3 *db) {
+  sqlite3_stmt *newest;
+  if (sqlite3_prepare_v2(db, "SELECT max(rowid) FROM messages", -1, &newest,
+                         NULL) == SQLITE_OK &&
+      sqlite3_step(newest) == SQLITE_ROW) {
+    this->lastRow = sqlite3_column_int64(newest, 0);
+  }
+  sqlite3_finalize(newest);
+  int params = sqlite3_bind_parameter_count(this->query);
+  sqlite3_bind_int64(this->query, params - 2, this->lastRow);
+}
+
 void QueryHandler::MessageReceived(BMessage *message) {
   if (!this->target.IsValid())
     goto canceled;
@@ -258,43 +422,51 @@ void QueryHandler::MessageReceived(BMessage *message) {
   case B_PULSE: {
     if (this->mainDone)
       break;
-    bool unfinished;
-    for (int i = 0;
-         i < 128 && (unfinished = sqlite3_step(this->query) == SQLITE_ROW);
-         i++) {
-      BMessage post;
-      if (post.Unflatten((const char *)sqlite3_column_blob(this->query, 2)) ==
-          B_OK) {
-        if (this->target.IsValid()) {
-          if (this->includeKey) {
-            post.AddString("cypherkey",
-                           (const char *)sqlite3_column_text(this->query, 0));
-          }
-          this->target.SendMessage(&post);
-        } else {
-          goto canceled;
-        }
-        if (this->limit > 0 && --this->limit == 0)
-          goto canceled;
+    // Each page is a fresh read from where the last one stopped; resetting the
+    // statement in between means we never hold an old snapshot open. Rows
+    // are passed on still flattened and unpacked by the decoder.
+    int params = sqlite3_bind_parameter_count(this->query);
+    sqlite3_bind_int64(this->query, params - 1, this->afterTimestamp);
+    sqlite3_bind_int64(this->query, params, this->afterRow);
+    BMessage rows('QROW');
+    int32 count = 0;
+    bool finished = false;
+    while (sqlite3_step(this->query) == SQLITE_ROW) {
+      count++;
+      this->afterTimestamp = sqlite3_column_int64(this->query, 3);
+      this->afterRow = sqlite3_column_int64(this->query, 4);
+      rows.AddData("body", B_RAW_TYPE, sqlite3_column_blob(this->query, 2),
+                   sqlite3_column_bytes(this->query, 2), false);
+      if (this->includeKey) {
+        rows.AddString("cypherkey",
+                       (const char *)sqlite3_column_text(this->query, 0));
       }
-    }
-    if (!unfinished) {
-      if (this->target.IsValid()) {
-        auto handle = sqlite3_db_handle(this->query);
-        sqlite3_finalize(this->query);
-        if (handle != FEED_DB)
-          sqlite3_close(handle);
-        this->query = NULL;
-        this->target.SendMessage('DONE');
-        this->mainDone = true;
-      } else {
-        goto canceled;
+      if (this->limit > 0 && --this->limit == 0) {
+        finished = true;
+        break;
       }
-    } else if (auto db = dynamic_cast<SSBDatabase *>(this->Looper())) {
-      db->ensurePulseRunning();
     }
+    sqlite3_reset(this->query);
+    finished = finished || count < QUERY_PAGE;
+    if (finished) {
+      this->closeQuery();
+      this->mainDone = true;
+      rows.AddBool("done", true);
+    }
+    rows.AddMessenger("target", this->target);
+    rows.AddInt32("batch", this->batch);
+    if (count > 0 || finished)
+      this->decoder.SendMessage(&rows);
+    if (this->limit == 0)
+      goto canceled;
+    // Queue the next page behind whatever else this reader has waiting, so
+    // queries sharing a connection take turns.
+    if (!finished)
+      BMessenger(this).SendMessage(B_PULSE);
   } break;
   case 'CHCK':
+    if (message->GetInt64("rowid", 0) <= this->lastRow)
+      break;
     if (BMessage post; message->FindMessage("post", &post) == B_OK) {
       if (this->includeKey) {
         BString key;
@@ -318,13 +490,8 @@ void QueryHandler::MessageReceived(BMessage *message) {
   case B_QUIT_REQUESTED:
   case 'STOP':
   canceled: {
-    if (this->query) {
-      auto handle = sqlite3_db_handle(this->query);
-      sqlite3_finalize(this->query);
-      if (handle != FEED_DB)
-        sqlite3_close(handle);
-      this->query = NULL;
-    }
+    this->detach();
+    this->closeQuery();
     BLooper *looper = this->Looper();
     looper->Lock();
     looper->RemoveHandler(this);
@@ -339,8 +506,9 @@ status_t QueryHandler::runBulk(BMessage *reply) {
   while (this->limit != 0 && sqlite3_step(this->query) == SQLITE_ROW) {
     BMessage post;
     status_t ierr;
-    if ((ierr = post.Unflatten(
-             (const char *)sqlite3_column_blob(this->query, 2))) == B_OK) {
+    if ((ierr = body::unflatten(&post, sqlite3_column_blob(this->query, 2),
+                                sqlite3_column_bytes(this->query, 2))) ==
+        B_OK) {
       reply->AddMessage("result", &post);
       if (err == B_ENTRY_NOT_FOUND || err == B_OK)
         err = ierr;
@@ -353,83 +521,237 @@ status_t QueryHandler::runBulk(BMessage *reply) {
   return err;
 }
 
-bool QueryHandler::queryMatch(const BString &cypherkey, const BString &context,
-                              const BMessage &msg) {
-  // TODO: Handle multiple values in specifier here too.
-  if (BString specKey;
-      this->specifier.FindString(this->specifier.what == 'CPLX' ? "cypherkey"
-                                                                : "name",
-                                 &specKey) == B_OK &&
-      specKey != cypherkey) {
-    return false;
-  }
-  const char *msgValue;
-  const char *specValue;
-  bool match = true;
-  msg.FindString("author", &msgValue);
-  for (int i = 0; this->specifier.FindString("author", i, &specValue) == B_OK;
-       i++) {
-    match = false;
-    if (strcmp(msgValue, specValue) == 0) {
-      match = true;
-      break;
+// Unflattens the rows a QueryHandler reads and sends them on to its target,
+// so that the reader only ever copies bytes.
+class QueryDecoder : public BLooper {
+public:
+  QueryDecoder();
+  void MessageReceived(BMessage *message) override;
+};
+
+QueryDecoder::QueryDecoder()
+    : BLooper("Query decoder") {}
+
+void QueryDecoder::MessageReceived(BMessage *message) {
+  if (message->what != 'QROW')
+    return BLooper::MessageReceived(message);
+  BMessenger target;
+  if (message->FindMessenger("target", &target) != B_OK)
+    return;
+  int32 batch = message->GetInt32("batch", 0);
+  BMessage posts('PSTS');
+  int32 pending = 0;
+  const void *data;
+  ssize_t size;
+  for (int32 i = 0;
+       message->FindData("body", B_RAW_TYPE, i, &data, &size) == B_OK; i++) {
+    BMessage post;
+    if (body::unflatten(&post, data, size) != B_OK)
+      continue;
+    if (BString cypherkey; message->FindString("cypherkey", i, &cypherkey) ==
+        B_OK) {
+      post.AddString("cypherkey", cypherkey);
     }
-  }
-  if (!match)
-    return false;
-  for (int i = 0; this->specifier.FindString("context", i, &specValue) == B_OK;
-       i++) {
-    match = false;
-    if (context == specValue) {
-      match = true;
-      break;
+    if (batch <= 0) {
+      target.SendMessage(&post);
+      continue;
     }
-  }
-  {
-    BString specialCase;
-    for (int i = 0;
-         this->specifier.FindString("specialCase", i, &specialCase) == B_OK;
-         i++) {
-      // Change if we introduce checks that put anything else into msgValue
-      if (specialCase == "selfReferent" && context != msgValue)
-        return false;
+    posts.AddMessage("post", &post);
+    if (++pending >= batch) {
+      target.SendMessage(&posts);
+      posts.MakeEmpty();
+      pending = 0;
     }
   }
-  if (!match)
-    return false;
-  BMessage content;
+  if (pending > 0)
+    target.SendMessage(&posts);
+  if (message->GetBool("done", false))
+    target.SendMessage('DONE');
+}
+
+bool QueryHandler::queryMatch(const BString &cypherkey, const BString &context,
+                              const BMessage &msg) {
+  BString author;
+  BString type;
+  msg.FindString("author", &author);
   // TODO: Extend this to encrypted messages that we have the key for.
-  bool hasContent = msg.FindMessage("content", &content) == B_OK;
-  if (hasContent)
-    content.FindString("type", &msgValue);
-  for (int i = 0; this->specifier.FindString("type", i, &specValue) == B_OK;
-       i++) {
-    match = false;
-    if (strcmp(msgValue, specValue) == 0) {
-      match = true;
-      break;
+  if (BMessage content; msg.FindMessage("content", &content) == B_OK)
+    content.FindString("type", &type);
+  int64 timestamp;
+  bool hasTimestamp = eitherNumber(&timestamp, &msg, "timestamp") == B_OK;
+  return this->predicate.matches(cypherkey, author, context, type,
+                                 hasTimestamp ? &timestamp : NULL);
+}
+} // namespace
+
+// Live queries are filed under the most selective field they constrain, so a
+// new message is only checked against queries that could possibly match it.
+// Queries live on the reader loopers while new messages arrive on the database
+// looper, so the index has its own lock.
+class LiveQueryIndex {
+public:
+  void add(QueryHandler *query);
+  void remove(QueryBacked *query);
+  void matching(const BString &cypherkey, const BString &author,
+                const BString &context, const BString &type,
+                const int64 *timestamp, std::vector<BMessenger> *result);
+
+private:
+  typedef std::map<BString, std::set<QueryHandler *>> Index;
+  template <typename F> void visit(QueryHandler *query, F f);
+  BLocker lock;
+  Index byKey;
+  Index byContext;
+  Index byAuthor;
+  Index byType;
+  std::set<QueryHandler *> unindexed;
+};
+
+template <typename F> void LiveQueryIndex::visit(QueryHandler *query, F f) {
+  const QueryPredicate &predicate = query->predicate;
+  auto each = [&](Index &index, const std::set<BString> &values) {
+    for (auto &value : values)
+      f(index, value);
+  };
+  if (!predicate.keys.empty())
+    each(this->byKey, predicate.keys);
+  else if (!predicate.contexts.empty())
+    each(this->byContext, predicate.contexts);
+  else if (!predicate.authors.empty())
+    each(this->byAuthor, predicate.authors);
+  else if (!predicate.types.empty())
+    each(this->byType, predicate.types);
+}
+
+void LiveQueryIndex::add(QueryHandler *query) {
+  BAutolock lock(this->lock);
+  query->liveIndex = this;
+  bool indexed = false;
+  this->visit(query, [&](Index &index, const BString &value) {
+    index[value].insert(query);
+    indexed = true;
+  });
+  if (!indexed)
+    this->unindexed.insert(query);
+}
+
+void LiveQueryIndex::remove(QueryBacked *backed) {
+  auto query = dynamic_cast<QueryHandler *>(backed);
+  if (query == NULL)
+    return;
+  BAutolock lock(this->lock);
+  query->liveIndex = NULL;
+  this->visit(query, [&](Index &index, const BString &value) {
+    if (auto entry = index.find(value); entry != index.end()) {
+      entry->second.erase(query);
+      if (entry->second.empty())
+        index.erase(entry);
     }
-  }
-  if (!match)
-    return false;
-  auto boundaries = timeBoundaries(this->specifier);
-  if (int64 timestamp; !boundaries.empty() &&
-      eitherNumber(&timestamp, &msg, "timestamp") == B_OK) {
-    bool provisio = true;
-    for (auto &[btype, boundary] : boundaries) {
-      if (btype == TimeThreshold::EARLIEST) {
-        if (timestamp < boundary)
-          return false;
-        provisio = true;
-      } else {
-        if (timestamp <= boundary)
-          return true;
-        provisio = false;
-      }
+  });
+  this->unindexed.erase(query);
+}
+
+// Messengers are taken while the lock is held, since a query may be deleted
+// by its reader as soon as it is released.
+void LiveQueryIndex::matching(const BString &cypherkey, const BString &author,
+                              const BString &context, const BString &type,
+                              const int64 *timestamp,
+                              std::vector<BMessenger> *result) {
+  BAutolock lock(this->lock);
+  auto check = [&](QueryHandler *query) {
+    if (query->predicate.matches(cypherkey, author, context, type, timestamp))
+      result->push_back(BMessenger(query));
+  };
+  auto collect = [&](Index &index, const BString &value) {
+    if (auto entry = index.find(value); entry != index.end()) {
+      for (auto query : entry->second)
+        check(query);
     }
-    return provisio;
+  };
+  collect(this->byKey, cypherkey);
+  collect(this->byContext, context);
+  collect(this->byAuthor, author);
+  collect(this->byType, type);
+  for (auto query : this->unindexed)
+    check(query);
+}
+
+void QueryBacked::detach() {
+  if (this->liveIndex != NULL)
+    this->liveIndex->remove(this);
+}
+
+namespace {
+// Answers a Post query that the database looper has handed off. Bulk queries
+// are run and replied to at once; live queries are added to `looper` and
+// start paging through their results.
+void serveQuery(BLooper *looper, sqlite3 *database, BMessage *request,
+                const BMessage &specifier, LiveQueryIndex *index,
+                BLooper *decoder) {
+  BMessage reply(B_REPLY);
+  status_t error;
+  if (BMessenger target; request->FindMessenger("target", &target) == B_OK) {
+    auto qh = new QueryHandler(database, target, specifier, decoder);
+    qh->includeKey = request->GetBool("includeKey", false);
+    qh->batch = request->GetInt32("batch", 0);
+    qh->limit = request->GetInt32("limit", -1);
+    looper->Lock();
+    looper->AddHandler(qh);
+    looper->Unlock();
+    index->add(qh);
+    qh->capRows(database);
+    reply.AddMessenger("result", BMessenger(qh));
+    BMessenger(qh).SendMessage(B_PULSE);
+    error = B_OK;
+  } else {
+    QueryHandler qh(database, BMessenger(), specifier);
+    qh.limit = request->GetInt32("limit", -1);
+    error = qh.runBulk(&reply);
   }
-  return true;
+  reply.AddInt32("error", error);
+  reply.AddString("message", strerror(error));
+  if (request->ReturnAddress().IsValid())
+    request->SendReply(&reply);
+  delete request;
+}
+
+// Serves Post queries on its own read-only connection, so that reads never
+// wait behind ingest on the database looper.
+class QueryReader : public BLooper {
+public:
+  QueryReader(sqlite3 *database);
+  ~QueryReader() override;
+  void MessageReceived(BMessage *message) override;
+
+private:
+  sqlite3 *database;
+};
+
+QueryReader::QueryReader(sqlite3 *database)
+    : BLooper("Query reader"),
+      database(database) {}
+
+QueryReader::~QueryReader() { sqlite3_close_v2(this->database); }
+
+void QueryReader::MessageReceived(BMessage *message) {
+  if (message->what == 'DBSP') {
+    applyStorageProfile(this->database,
+                        storageProfile(message->GetString("profile", NULL)),
+                        false);
+    return;
+  }
+  if (message->what != 'QRUN')
+    return BLooper::MessageReceived(message);
+  BMessage *request;
+  BMessage specifier;
+  LiveQueryIndex *index;
+  BLooper *decoder;
+  if (message->FindPointer("request", (void **)&request) != B_OK)
+    return;
+  message->FindMessage("specifier", &specifier);
+  message->FindPointer("index", (void **)&index);
+  message->FindPointer("decoder", (void **)&decoder);
+  serveQuery(this, this->database, request, specifier, index, decoder);
 }
 } // namespace
 
@@ -443,6 +765,8 @@ BString messageCypherkey(unsigned char hash[crypto_hash_sha256_BYTES]) {
 }
 
 void SSBDatabase::DispatchMessage(BMessage *message, BHandler *handler) {
+  if (message->what != 'DBMT')
+    this->lastForeground = system_time();
   {
     auto count = this->MessageQueue()->CountMessages();
     if (count > 0) {
@@ -461,12 +785,59 @@ void SSBDatabase::DispatchMessage(BMessage *message, BHandler *handler) {
   BLooper::DispatchMessage(message, handler);
 }
 
-SSBDatabase::SSBDatabase(std::function<sqlite3 *()> dbOpen)
+SSBDatabase::SSBDatabase(std::function<sqlite3 *()> dbOpen,
+                         std::function<sqlite3 *()> readerOpen)
     : BLooper("SSB message database", 8192, 512),
       database(dbOpen()),
-      dbOpen(std::move(dbOpen)) {
+      liveQueries(std::make_unique<LiveQueryIndex>()),
+      decoder(new QueryDecoder()) {
   if (runningDB == NULL)
     runningDB = this;
+  body::load(this->database);
+  {
+    auto &profile = storageProfile(NULL);
+    applyStorageProfile(this->database, profile, true);
+    this->checkpointPages = profile.checkpointPages;
+  }
+  // This replaces SQLite's own checkpointing after every commit; `maintain`
+  // checkpoints instead, off the back of the page counts recorded here.
+  sqlite3_wal_hook(
+      this->database,
+      [](void *arg, sqlite3 *, const char *, int pages) {
+        *(int *)arg = pages;
+        return SQLITE_OK;
+      },
+      &this->walPages);
+  {
+    sqlite3_stmt *mode;
+    sqlite3_prepare_v2(this->database, "PRAGMA auto_vacuum", -1, &mode,
+                       NULL);
+    if (sqlite3_step(mode) == SQLITE_ROW)
+      this->incrementalVacuum = sqlite3_column_int(mode, 0) == 2;
+    sqlite3_finalize(mode);
+  }
+  if (upkeepDone(this->database, kUpkeepSearch))
+    this->searchCursor = -1;
+  if (upkeepDone(this->database, kUpkeepContexts))
+    this->contextCursor = -1;
+  this->maintenance = std::make_unique<BMessageRunner>(
+      BMessenger(this), BMessage('DBMT'), MAINTENANCE_INTERVAL);
+  this->decoder->Run();
+  // Readers are opened after the writer, which is what prepares the schema.
+  {
+    system_info info;
+    int32 count = 2;
+    if (get_system_info(&info) == B_OK && info.cpu_count > 2)
+      count = std::min<int32>(info.cpu_count, QUERY_READERS_MAX);
+    for (int32 i = 0; i < count; i++) {
+      if (sqlite3 *connection = readerOpen(); connection != NULL) {
+        applyStorageProfile(connection, storageProfile(NULL), false);
+        auto reader = new QueryReader(connection);
+        reader->Run();
+        this->readers.push_back(reader);
+      }
+    }
+  }
   sqlite3_prepare_v2(database,
                      "SELECT rowid, body FROM unprocessed "
                      "ORDER BY rowid LIMIT 1",
@@ -484,17 +855,31 @@ SSBDatabase::SSBDatabase(std::function<sqlite3 *()> dbOpen)
 }
 
 SSBDatabase::~SSBDatabase() {
+  this->maintenance.reset();
+  for (auto reader : this->readers) {
+    if (reader->Lock())
+      reader->Quit();
+  }
+  if (this->decoder->Lock())
+    this->decoder->Quit();
   sqlite3_finalize(this->backlog);
   sqlite3_close_v2(this->database);
   if (runningDB == this)
     runningDB = NULL;
 }
 
-enum { kReplicatedFeed, kAReplicatedFeed, kOwnID, kPostByID };
+enum {
+  kReplicatedFeed,
+  kAReplicatedFeed,
+  kOwnID,
+  kPostByID,
+  kThread,
+  kSearch
+};
 
 property_info databaseProperties[] = {
     {"ReplicatedFeed",
-     {B_GET_PROPERTY, B_CREATE_PROPERTY, 'USUB', 0},
+     {B_GET_PROPERTY, B_CREATE_PROPERTY, B_SET_PROPERTY, 'USUB', 0},
      {B_DIRECT_SPECIFIER, 0},
      "A known SSB log",
      kReplicatedFeed,
@@ -517,6 +902,18 @@ property_info databaseProperties[] = {
      "An SSB message",
      kPostByID,
      {}},
+    {"Thread",
+     {B_GET_PROPERTY, 0},
+     {B_DIRECT_SPECIFIER, B_NAME_SPECIFIER, 0},
+     "Reply count, participants and last activity of a thread",
+     kThread,
+     {}},
+    {"Search",
+     {B_GET_PROPERTY, 0},
+     {B_NAME_SPECIFIER, 'CPLX', 0},
+     "Posts whose text matches, best match first",
+     kSearch,
+     {}},
     {0}};
 
 status_t SSBDatabase::GetSupportedSuites(BMessage *data) {
@@ -591,6 +988,30 @@ BHandler *SSBDatabase::ResolveSpecifier(BMessage *msg, int32 index,
 
 static void freeBuffer(void *arg) { delete[] (char *)arg; }
 
+static void addThread(BMessage *reply, sqlite3 *database, sqlite3_stmt *row,
+                      bool withParticipants) {
+  BMessage result;
+  BString root((const char *)sqlite3_column_text(row, 0));
+  result.AddString("root", root);
+  result.AddInt64("replies", sqlite3_column_int64(row, 1));
+  result.AddInt64("participants", sqlite3_column_int64(row, 2));
+  result.AddInt64("lastActivity", sqlite3_column_int64(row, 3));
+  if (withParticipants) {
+    sqlite3_stmt *participants;
+    sqlite3_prepare_v2(database,
+                       "SELECT author FROM thread_participants WHERE root = ?",
+                       -1, &participants, NULL);
+    sqlite3_bind_text(participants, 1, root.String(), root.Length(),
+                      SQLITE_STATIC);
+    while (sqlite3_step(participants) == SQLITE_ROW) {
+      result.AddString("participant",
+                       (const char *)sqlite3_column_text(participants, 0));
+    }
+    sqlite3_finalize(participants);
+  }
+  reply->AddMessage("result", &result);
+}
+
 void SSBDatabase::MessageReceived(BMessage *msg) {
   if (msg->HasSpecifiers()) {
     BMessage reply(B_REPLY);
@@ -612,20 +1033,37 @@ void SSBDatabase::MessageReceived(BMessage *msg) {
         error = B_UNSUPPORTED;
         break;
       case B_CREATE_PROPERTY: {
-        unsigned char key[crypto_sign_PUBLICKEYBYTES];
         BString formatted;
-        error = msg->FindString("cypherkey", &formatted);
-        if (error == B_OK &&
-            (error = SSBFeed::parseAuthor(key, formatted)) == B_OK) {
+        SSBFeed *feed;
+        if ((error = msg->FindString("cypherkey", &formatted)) == B_OK &&
+            (error = this->replicate(formatted, &feed)) == B_OK) {
+          reply.AddMessenger("result", BMessenger(feed));
+        }
+      } break;
+      case B_SET_PROPERTY: {
+        // Changes to the replicated set, made in one transaction.
+        const char *cypherkey;
+        int32 added = 0;
+        int32 removed = 0;
+        error = B_OK;
+        sqlite3_exec(this->database, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+        for (int32 i = 0; msg->FindString("remove", i, &cypherkey) == B_OK;
+             i++) {
           SSBFeed *feed;
-          if (this->findFeed(feed, formatted) != B_OK) {
-            feed = new SSBFeed(key);
-            this->AddHandler(feed);
-            this->feeds.insert({formatted, feed});
-            feed->load();
+          if (this->findFeed(feed, cypherkey) == B_OK && feed != NULL) {
+            feed->drop();
+            removed++;
           }
-          reply.AddMessenger("result", BMessenger(feed));
         }
+        for (int32 i = 0; msg->FindString("add", i, &cypherkey) == B_OK;
+             i++) {
+          SSBFeed *feed;
+          if (this->replicate(cypherkey, &feed) == B_OK)
+            added++;
+        }
+        sqlite3_exec(this->database, "END TRANSACTION;", NULL, NULL, NULL);
+        reply.AddInt32("added", added);
+        reply.AddInt32("removed", removed);
       } break;
       case B_GET_PROPERTY: {
         for (int32 i = this->CountHandlers() - 1; i > 0; i--) {
@@ -651,11 +1089,15 @@ void SSBDatabase::MessageReceived(BMessage *msg) {
           obs.AddInt32(B_OBSERVE_WHAT_CHANGE, 'NMSG');
           BHandler::MessageReceived(&obs);
         }
+        // New subscribers get every feed's head in a single notice.
+        BMessage heads(B_OBSERVER_NOTICE_CHANGE);
         for (int32 i = this->CountHandlers() - 1; i >= 0; i--) {
           SSBFeed *feed = dynamic_cast<SSBFeed *>(this->HandlerAt(i));
           if (feed != NULL)
-            feed->notifyChanges(target);
+            feed->addHead(&heads);
         }
+        if (heads.HasString("feed"))
+          target.SendMessage(&heads);
       } break;
       default:
         error = B_DONT_DO_THAT;
@@ -673,30 +1115,9 @@ void SSBDatabase::MessageReceived(BMessage *msg) {
       break;
     case kPostByID:
       switch (msg->what) {
-      case B_GET_PROPERTY: {
-        QueryHandler *qh;
-        bool live;
-        if (BMessenger target; msg->FindMessenger("target", &target) == B_OK) {
-          qh = new QueryHandler(this->dbOpen(), target, specifier);
-          live = true;
-          qh->includeKey = msg->GetBool("includeKey", false);
-        } else {
-          qh = new QueryHandler(this->database, BMessenger(), specifier);
-          live = false;
-        }
-        qh->limit = msg->GetInt32("limit", -1);
-        if (live) {
-          this->Lock();
-          this->AddHandler(qh);
-          this->Unlock();
-          reply.AddMessenger("result", BMessenger(qh));
-          this->ensurePulseRunning();
-          error = B_OK;
-        } else {
-          error = qh->runBulk(&reply);
-          delete qh;
-        }
-      } break;
+      case B_GET_PROPERTY:
+        this->runQuery(this->DetachCurrentMessage(), specifier);
+        return;
       case B_SET_PROPERTY: {
         BString cypherkey;
         BMessage data;
@@ -720,6 +1141,72 @@ void SSBDatabase::MessageReceived(BMessage *msg) {
       } break;
       }
       break;
+    case kSearch: {
+      // A search is a Post query with the text to look for added. It is
+      // always answered in one reply, as results are ranked rather than
+      // paged through.
+      BMessage search('CPLX');
+      BString text;
+      if (specifier.what == 'CPLX') {
+        search = specifier;
+        search.FindString("text", &text);
+      } else {
+        specifier.FindString("name", &text);
+      }
+      if (searchTerms(text).IsEmpty()) {
+        error = B_BAD_VALUE;
+        break;
+      }
+      search.AddString("search", text);
+      BMessage *request = this->DetachCurrentMessage();
+      request->RemoveName("target");
+      if (!request->HasInt32("limit"))
+        request->AddInt32("limit", SEARCH_RESULTS);
+      this->runQuery(request, search);
+      return;
+    }
+    case kThread: {
+      // A named thread comes back with its participants. Otherwise the
+      // threads named in "root", or else the most recently active ones, come
+      // back without them.
+      sqlite3_stmt *query;
+      if (BString root; specifier.FindString("name", &root) == B_OK) {
+        sqlite3_prepare_v2(this->database,
+                           "SELECT root, replies, participants, lastActivity "
+                           "FROM threads WHERE root = ?",
+                           -1, &query, NULL);
+        sqlite3_bind_text(query, 1, root.String(), root.Length(),
+                          SQLITE_STATIC);
+        error = B_NAME_NOT_FOUND;
+        if (sqlite3_step(query) == SQLITE_ROW) {
+          addThread(&reply, this->database, query, true);
+          error = B_OK;
+        }
+      } else if (msg->HasString("root")) {
+        sqlite3_prepare_v2(this->database,
+                           "SELECT root, replies, participants, lastActivity "
+                           "FROM threads WHERE root = ?",
+                           -1, &query, NULL);
+        for (int32 i = 0; msg->FindString("root", i, &root) == B_OK; i++) {
+          sqlite3_bind_text(query, 1, root.String(), root.Length(),
+                            SQLITE_STATIC);
+          if (sqlite3_step(query) == SQLITE_ROW)
+            addThread(&reply, this->database, query, false);
+          sqlite3_reset(query);
+        }
+        error = B_OK;
+      } else {
+        sqlite3_prepare_v2(this->database,
+                           "SELECT root, replies, participants, lastActivity "
+                           "FROM threads ORDER BY lastActivity DESC LIMIT ?",
+                           -1, &query, NULL);
+        sqlite3_bind_int(query, 1, msg->GetInt32("limit", 50));
+        while (sqlite3_step(query) == SQLITE_ROW)
+          addThread(&reply, this->database, query, false);
+        error = B_OK;
+      }
+      sqlite3_finalize(query);
+    } break;
     default:
       return BLooper::MessageReceived(msg);
     }
@@ -755,22 +1242,70 @@ void SSBDatabase::MessageReceived(BMessage *msg) {
     BMessage post;
     BString msgID;
     BString context;
+    BString author;
+    BString type;
     if (msg->FindMessage("post", &post) == B_OK) {
       msg->FindString("key", &msgID);
       if (msg->FindString("context", &context) != B_OK)
         context = "";
-      for (int i = 0; i < this->CountHandlers(); i++) {
-        if (auto qh = dynamic_cast<QueryHandler *>(this->HandlerAt(i));
-            qh && qh->queryMatch(msgID, context, post)) {
-          BMessenger(qh).SendMessage(msg);
-        }
+      post.FindString("author", &author);
+      if (BMessage content; msg->FindString("type", &type) != B_OK &&
+          post.FindMessage("content", &content) == B_OK) {
+        content.FindString("type", &type);
+      }
+      int64 timestamp;
+      bool hasTimestamp = msg->FindInt64("timestamp", &timestamp) == B_OK ||
+          eitherNumber(&timestamp, &post, "timestamp") == B_OK;
+      std::vector<BMessenger> targets;
+      this->liveQueries->matching(msgID, author, context, type,
+                                  hasTimestamp ? &timestamp : NULL, &targets);
+      for (auto &target : targets)
+        target.SendMessage(msg);
+    }
+  } else if (msg->what == 'BZIP') {
+    // Turns body compression on or off. Turning it on trains a dictionary if
+    // there isn't one yet, then recompresses what is already stored a batch
+    // at a time, between other work.
+    bool enable = msg->GetBool("enable", true);
+    if (enable && body::load(this->database) != B_OK) {
+      if (status_t error = body::train(this->database); error != B_OK) {
+        BString logText("Could not train a body dictionary: ");
+        logText << strerror(error);
+        writeLog('BZIP', logText);
+        enable = false;
       }
     }
+    body::setCompressing(enable);
+    if (enable && !this->recompressing) {
+      this->recompressing = true;
+      this->recompressCursor = 0;
+      BMessenger(this).SendMessage('BZRN');
+    } else if (!enable) {
+      this->recompressing = false;
+    }
+  } else if (msg->what == 'BZRN') {
+    if (!this->recompressing)
+      return;
+    sqlite3_exec(this->database, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+    status_t status = body::recompress(this->database, &this->recompressCursor,
+                                       RECOMPRESS_BATCH);
+    sqlite3_exec(this->database, "END TRANSACTION;", NULL, NULL, NULL);
+    if (status == B_OK) {
+      BMessenger(this).SendMessage('BZRN');
+    } else {
+      this->recompressing = false;
+      writeLog('BZIP', "Finished recompressing message bodies");
+    }
+  } else if (msg->what == 'DBSP') {
+    auto &profile = storageProfile(msg->GetString("profile", NULL));
+    applyStorageProfile(this->database, profile, true);
+    this->checkpointPages = profile.checkpointPages;
+    for (auto reader : this->readers)
+      BMessenger(reader).SendMessage(msg);
+  } else if (msg->what == 'DBMT') {
+    this->maintain();
   } else if (msg->what == B_PULSE && this->pulseRunning) {
     this->pulseRunning = false;
-    for (int i = 0; i < this->CountHandlers(); i++)
-      if (auto qh = dynamic_cast<QueryHandler *>(this->HandlerAt(i)))
-        BMessenger(qh).SendMessage(msg);
     sqlite3_exec(this->database, "BEGIN TRANSACTION;", NULL, NULL, NULL);
     if (sqlite3_step(this->backlog) == SQLITE_ROW) {
       BMessage post;
@@ -824,6 +1359,20 @@ bool SSBDatabase::runCheck(BMessage *msg) {
   return false;
 }
 
+// Starts replicating `cypherkey`, if we aren't already.
+status_t SSBDatabase::replicate(const BString &cypherkey, SSBFeed **result) {
+  unsigned char key[crypto_sign_PUBLICKEYBYTES];
+  if (status_t error = SSBFeed::parseAuthor(key, cypherkey); error != B_OK)
+    return error;
+  if (this->findFeed(*result, cypherkey) != B_OK) {
+    *result = new SSBFeed(key);
+    this->AddHandler(*result);
+    this->feeds.insert({cypherkey, *result});
+    (*result)->load();
+  }
+  return B_OK;
+}
+
 status_t SSBDatabase::findFeed(SSBFeed *&result, const BString &cypherkey) {
   if (auto lookup = this->feeds.find(cypherkey); lookup != this->feeds.end()) {
     result = lookup->second;
@@ -842,6 +1391,87 @@ status_t SSBDatabase::findFeed(SSBFeed *&result, const BString &cypherkey) {
   return B_NAME_NOT_FOUND;
 }
 
+// Nothing has come in for a while and there is no backlog or recompression
+// in progress.
+bool SSBDatabase::idle() {
+  return !this->pulseRunning && !this->recompressing &&
+      this->MessageQueue()->IsEmpty() &&
+      system_time() - this->lastForeground >= MAINTENANCE_IDLE;
+}
+
+// Runs on a timer and does at most one small piece of upkeep each time, so
+// that queries and incoming messages never wait long behind it. While the
+// database stays idle it keeps sending itself the next step.
+void SSBDatabase::maintain() {
+  bool idle = this->idle();
+  // Passive checkpoints don't wait for readers or block the writer, so a
+  // large WAL is folded back in even when we're busy.
+  if (this->walPages >= this->checkpointPages ||
+      (idle && this->walPages > 0)) {
+    int logPages;
+    int checkpointed;
+    if (sqlite3_wal_checkpoint_v2(this->database, NULL,
+                                  SQLITE_CHECKPOINT_PASSIVE, &logPages,
+                                  &checkpointed) == SQLITE_OK &&
+        checkpointed >= logPages) {
+      this->walPages = 0;
+    }
+    return;
+  }
+  if (!idle)
+    return;
+  bool more = false;
+  if (this->ingested >= OPTIMIZE_AFTER) {
+    this->ingested = 0;
+    sqlite3_exec(this->database,
+                 "PRAGMA analysis_limit = 1000; PRAGMA optimize;", NULL, NULL,
+                 NULL);
+    more = true;
+  } else if (this->incrementalVacuum) {
+    int64 freePages = 0;
+    sqlite3_stmt *query;
+    sqlite3_prepare_v2(this->database, "PRAGMA freelist_count", -1, &query,
+                       NULL);
+    if (sqlite3_step(query) == SQLITE_ROW)
+      freePages = sqlite3_column_int64(query, 0);
+    sqlite3_finalize(query);
+    if (freePages > 0) {
+      BString sql("PRAGMA incremental_vacuum(");
+      sql << VACUUM_PAGES << ")";
+      sqlite3_exec(this->database, sql.String(), NULL, NULL, NULL);
+      more = true;
+    }
+  }
+  if (!more)
+    more = this->indexPostText();
+  if (!more && this->contextCursor >= 0)
+    more = this->recomputeContexts();
+  if (more)
+    BMessenger(this).SendMessage('DBMT');
+}
+
+// Queries only read, so they are handed to a reader and answered from there.
+void SSBDatabase::runQuery(BMessage *request, const BMessage &specifier) {
+  if (BLooper *reader = this->reader(); reader != NULL) {
+    BMessage run('QRUN');
+    run.AddPointer("request", request);
+    run.AddMessage("specifier", &specifier);
+    run.AddPointer("index", this->liveQueries.get());
+    run.AddPointer("decoder", this->decoder);
+    if (BMessenger(reader).SendMessage(&run) == B_OK)
+      return;
+  }
+  serveQuery(this, this->database, request, specifier,
+             this->liveQueries.get(), this->decoder);
+}
+
+BLooper *SSBDatabase::reader() {
+  if (this->readers.empty())
+    return NULL;
+  this->nextReader = (this->nextReader + 1) % this->readers.size();
+  return this->readers[this->nextReader];
+}
+
 status_t SSBDatabase::findPost(BMessage *post, BString &cypherkey) {
   status_t error = B_ERROR;
   sqlite3_stmt *query;
@@ -850,8 +1480,10 @@ status_t SSBDatabase::findPost(BMessage *post, BString &cypherkey) {
                      &query, NULL);
   sqlite3_bind_text(query, 1, cypherkey.String(), cypherkey.Length(),
                     SQLITE_TRANSIENT);
-  if (sqlite3_step(query) == SQLITE_ROW)
-    error = post->Unflatten((const char *)sqlite3_column_blob(query, 0));
+  if (sqlite3_step(query) == SQLITE_ROW) {
+    error = body::unflatten(post, sqlite3_column_blob(query, 0),
+                            sqlite3_column_bytes(query, 0));
+  }
   else
     error = B_ENTRY_NOT_FOUND;
   sqlite3_finalize(query);
@@ -881,19 +1513,30 @@ void SSBDatabase::notifyBacklog() {
 }
 
 void SSBDatabase::loadFeeds() {
+  // Feeds that are already loaded, such as our own, go in the map first so
+  // that each row below is a single lookup.
+  for (int32 i = 0; i < this->CountHandlers(); i++) {
+    if (auto feed = dynamic_cast<SSBFeed *>(this->HandlerAt(i)))
+      this->feeds.insert({feed->cypherkey(), feed});
+  }
   sqlite3_stmt *query;
-  sqlite3_prepare_v2(this->database, "SELECT DISTINCT author FROM feeds", -1,
-                     &query, NULL);
+  sqlite3_prepare_v2(this->database,
+                     "SELECT author, sequence, cypherkey, broken, forked "
+                     "FROM feed_heads",
+                     -1, &query, NULL);
   while (sqlite3_step(query) == SQLITE_ROW) {
     BString cypherkey((const char *)sqlite3_column_text(query, 0));
     unsigned char key[crypto_sign_PUBLICKEYBYTES];
-    SSBFeed *feed;
-    if (this->findFeed(feed, cypherkey) != B_OK &&
+    if (this->feeds.count(cypherkey) == 0 &&
         SSBFeed::parseAuthor(key, cypherkey) == B_OK) {
-      feed = new SSBFeed(key);
+      auto feed = new SSBFeed(key);
       this->AddHandler(feed);
       this->feeds.insert({cypherkey, feed});
-      feed->load();
+      feed->restore(sqlite3_column_int64(query, 1),
+                    (const char *)sqlite3_column_text(query, 2),
+                    sqlite3_column_int(query, 3) != 0,
+                    sqlite3_column_int(query, 4) != 0);
+      feed->notifyChanges();
     }
   }
   sqlite3_finalize(query);
@@ -913,58 +1556,85 @@ status_t SSBFeed::load() {
     sqlite3_bind_text(reg, 1, key.String(), key.Length(), SQLITE_STATIC);
     sqlite3_step(reg);
     sqlite3_finalize(reg);
+    sqlite3_prepare_v2(FEED_DB,
+                       "INSERT OR IGNORE INTO feed_heads(author) VALUES(?)", -1,
+                       &reg, NULL);
+    sqlite3_bind_text(reg, 1, key.String(), key.Length(), SQLITE_STATIC);
+    sqlite3_step(reg);
+    sqlite3_finalize(reg);
   }
   sqlite3_stmt *query;
-  sqlite3_prepare_v2(
-      FEED_DB,
-      "SELECT sequence, cypherkey FROM messages WHERE author = ?"
-      " AND sequence = (SELECT max(m.sequence) FROM messages AS m"
-      " WHERE m.author = messages.author)",
-      -1, &query, NULL);
-
+  sqlite3_prepare_v2(FEED_DB,
+                     "SELECT sequence, cypherkey, broken, forked "
+                     "FROM feed_heads WHERE author = ?",
+                     -1, &query, NULL);
   sqlite3_bind_text(query, 1, key.String(), key.Length(), SQLITE_STATIC);
   if (sqlite3_step(query) == SQLITE_ROW) {
-    int64 sequence = sqlite3_column_int64(query, 0);
-    BString id((const char *)sqlite3_column_text(query, 1));
-    BString b64;
-    for (int i = 1; i < id.Length() && id[i] != '.'; i++)
-      b64.Append(id[i], 1);
-    std::vector<unsigned char> hash =
-        base64::decode(b64.String(), b64.Length());
-    if (hash.size() == crypto_hash_sha256_BYTES) {
-      memcpy(this->lastHash, &hash[0], crypto_hash_sha256_BYTES);
-      this->lastSequence = sequence;
-    } else {
-      error = B_ERROR;
-    }
+    error = this->restore(sqlite3_column_int64(query, 0),
+                          (const char *)sqlite3_column_text(query, 1),
+                          sqlite3_column_int(query, 2) != 0,
+                          sqlite3_column_int(query, 3) != 0);
   }
   sqlite3_finalize(query);
   this->notifyChanges();
   return error;
 }
 
+status_t SSBFeed::restore(int64 sequence, const char *last, bool broken,
+                          bool forked) {
+  this->broken = broken;
+  this->forked = forked;
+  if (sequence == 0 || last == NULL)
+    return B_OK;
+  BString id(last);
+  BString b64;
+  for (int i = 1; i < id.Length() && id[i] != '.'; i++)
+    b64.Append(id[i], 1);
+  std::vector<unsigned char> hash = base64::decode(b64.String(), b64.Length());
+  if (hash.size() != crypto_hash_sha256_BYTES)
+    return B_ERROR;
+  memcpy(this->lastHash, &hash[0], crypto_hash_sha256_BYTES);
+  this->lastSequence = sequence;
+  return B_OK;
+}
+
+void SSBFeed::storeFlags() {
+  sqlite3_stmt *update;
+  sqlite3_prepare_v2(FEED_DB,
+                     "UPDATE feed_heads SET broken = ?, forked = ? "
+                     "WHERE author = ?",
+                     -1, &update, NULL);
+  BString key = this->cypherkey();
+  sqlite3_bind_int(update, 1, this->broken);
+  sqlite3_bind_int(update, 2, this->forked);
+  sqlite3_bind_text(update, 3, key.String(), key.Length(), SQLITE_STATIC);
+  sqlite3_step(update);
+  sqlite3_finalize(update);
+}
+
 SSBFeed::~SSBFeed() {}
 
 bool SSBFeed::matchKey(unsigned char other[crypto_sign_PUBLICKEYBYTES]) {
   return std::memcmp(this->pubkey, other, crypto_sign_PUBLICKEYBYTES) == 0;
 }
 
+void SSBFeed::addHead(BMessage *notice) {
+  notice->AddString("feed", this->cypherkey());
+  notice->AddInt64("sequence", this->sequence());
+  notice->AddBool("broken", this->reorder);
+  notice->AddBool("forked", this->forked);
+}
+
 void SSBFeed::notifyChanges(BMessenger target) {
   BMessage notif(B_OBSERVER_NOTICE_CHANGE);
-  notif.AddString("feed", this->cypherkey());
-  notif.AddInt64("sequence", this->sequence());
-  notif.AddBool("broken", this->reorder);
-  notif.AddBool("forked", this->forked);
+  this->addHead(&notif);
   target.SendMessage(&notif);
 }
 
 void SSBFeed::notifyChanges() {
   if (!this->broken) {
     BMessage notif(B_OBSERVER_NOTICE_CHANGE);
-    notif.AddString("feed", this->cypherkey());
-    notif.AddInt64("sequence", this->sequence());
-    notif.AddBool("broken", this->reorder);
-    notif.AddBool("forked", this->forked);
+    this->addHead(&notif);
     this->reorder = false;
     this->Looper()->SendNotices('NMSG', &notif);
   }
@@ -1013,6 +1683,43 @@ status_t SSBFeed::GetSupportedSuites(BMessage *data) {
   return BHandler::GetSupportedSuites(data);
 }
 
+// Deletes everything stored for this feed, and then the feed itself.
+void SSBFeed::drop() {
+  sqlite3_stmt *deleter;
+  sqlite3_prepare_v2(FEED_DB, "DELETE FROM messages WHERE author = ?", -1,
+                     &deleter, NULL);
+  BString key = this->cypherkey();
+  sqlite3_bind_text(deleter, 1, key.String(), key.Length(), SQLITE_TRANSIENT);
+  sqlite3_step(deleter);
+  sqlite3_finalize(deleter);
+  sqlite3_prepare_v2(FEED_DB, "DELETE FROM feeds WHERE author = ?", -1,
+                     &deleter, NULL);
+  sqlite3_bind_text(deleter, 1, key.String(), key.Length(), SQLITE_TRANSIENT);
+  sqlite3_step(deleter);
+  sqlite3_finalize(deleter);
+  sqlite3_prepare_v2(FEED_DB, "DELETE FROM feed_heads WHERE author = ?", -1,
+                     &deleter, NULL);
+  sqlite3_bind_text(deleter, 1, key.String(), key.Length(), SQLITE_TRANSIENT);
+  sqlite3_step(deleter);
+  sqlite3_finalize(deleter);
+  sqlite3_prepare_v2(FEED_DB, "DELETE FROM profiles WHERE author = ?", -1,
+                     &deleter, NULL);
+  sqlite3_bind_text(deleter, 1, key.String(), key.Length(), SQLITE_TRANSIENT);
+  sqlite3_step(deleter);
+  sqlite3_finalize(deleter);
+  auto looper = this->Looper();
+  BMessage notif(B_OBSERVER_NOTICE_CHANGE);
+  notif.AddString("feed", this->cypherkey());
+  notif.AddBool("deleted", true);
+  looper->SendNotices('NMSG', &notif);
+  looper->Lock();
+  looper->RemoveHandler(this);
+  if (auto db = dynamic_cast<SSBDatabase *>(looper))
+    db->feeds.erase(this->cypherkey());
+  looper->Unlock();
+  delete this;
+}
+
 void SSBFeed::MessageReceived(BMessage *msg) {
   if (msg->HasSpecifiers()) {
     BMessage reply(B_REPLY);
@@ -1025,38 +1732,8 @@ void SSBFeed::MessageReceived(BMessage *msg) {
     if (msg->GetCurrentSpecifier(&index, &specifier, &what, &property) !=
         B_OK) {
       if (msg->what == B_DELETE_PROPERTY) {
-        sqlite3_stmt *deleter;
-        sqlite3_prepare_v2(FEED_DB, "DELETE FROM messages WHERE author = ?", -1,
-                           &deleter, NULL);
-        BString key = this->cypherkey();
-        sqlite3_bind_text(deleter, 1, key.String(), key.Length(),
-                          SQLITE_TRANSIENT);
-        sqlite3_step(deleter);
-        sqlite3_finalize(deleter);
-        sqlite3_prepare_v2(FEED_DB, "DELETE FROM feeds WHERE author = ?", -1,
-                           &deleter, NULL);
-        sqlite3_bind_text(deleter, 1, key.String(), key.Length(),
-                          SQLITE_TRANSIENT);
-        sqlite3_step(deleter);
-        sqlite3_finalize(deleter);
-        sqlite3_prepare_v2(FEED_DB, "DELETE FROM profiles WHERE author = ?", -1,
-                           &deleter, NULL);
-        sqlite3_bind_text(deleter, 1, key.String(), key.Length(),
-                          SQLITE_TRANSIENT);
-        sqlite3_step(deleter);
-        sqlite3_finalize(deleter);
         reply = B_OK;
-        auto looper = this->Looper();
-        BMessage notif(B_OBSERVER_NOTICE_CHANGE);
-        notif.AddString("feed", this->cypherkey());
-        notif.AddBool("deleted", true);
-        looper->SendNotices('NMSG', &notif);
-        looper->Lock();
-        looper->RemoveHandler(this);
-        if (auto db = dynamic_cast<SSBDatabase *>(looper))
-          db->feeds.erase(this->cypherkey());
-        looper->Unlock();
-        delete this;
+        this->drop();
         goto sendreply;
       } else {
         return BHandler::MessageReceived(msg);
@@ -1145,22 +1822,38 @@ void SSBFeed::MessageReceived(BMessage *msg) {
       sqlite3_bind_text(rollback, 1, key.String(), key.Length(), SQLITE_STATIC);
       sqlite3_step(rollback);
       sqlite3_finalize(rollback);
+      sqlite3_prepare_v2(FEED_DB,
+                         "UPDATE feed_heads "
+                         "SET sequence = 0, cypherkey = NULL, count = 0 "
+                         "WHERE author = ?",
+                         -1, &rollback, NULL);
+      sqlite3_bind_text(rollback, 1, key.String(), key.Length(), SQLITE_STATIC);
+      sqlite3_step(rollback);
+      sqlite3_finalize(rollback);
       this->lastSequence = 0;
       this->reorder = true;
       this->broken = false;
       this->notifyChanges();
       this->broken = true;
+      this->storeFlags();
     } else if (saveStatus == B_MISMATCHED_VALUES) {
       this->reorder = true;
       this->notifyChanges();
-      this->broken = true;
+      if (!this->broken) {
+        this->broken = true;
+        this->storeFlags();
+      }
     } else {
+      bool wasBroken = this->broken;
       this->broken = true;
       // TODO: rename 'forked' because it no longer represents forking
       // but any other type of validation failure
       if (!this->forked) {
         this->forked = true;
         this->notifyChanges();
+        this->storeFlags();
+      } else if (!wasBroken) {
+        this->storeFlags();
       }
       BString message("Validation failed: message on ");
       message << this->cypherkey();
@@ -1191,7 +1884,8 @@ status_t SSBFeed::findPost(BString *id, BMessage *post, uint64 sequence) {
     return B_ERROR;
   if (auto *text = (const char *)sqlite3_column_text(fetch, 0))
     *id = text;
-  status_t err = post->Unflatten((const char *)sqlite3_column_blob(fetch, 1));
+  status_t err = body::unflatten(post, sqlite3_column_blob(fetch, 1),
+                                 sqlite3_column_bytes(fetch, 1));
   sqlite3_finalize(fetch);
   return err;
 }
@@ -1211,7 +1905,8 @@ status_t SSBFeed::getSegment(BMessage *reply, uint64 sequence, uint16 count) {
   status_t err = B_OK;
   while (sqlite3_step(fetch) == SQLITE_ROW) {
     BMessage post;
-    err = post.Unflatten((const char *)sqlite3_column_blob(fetch, 0));
+    err = body::unflatten(&post, sqlite3_column_blob(fetch, 0),
+                          sqlite3_column_bytes(fetch, 0));
     if (err != B_OK)
       break;
     reply->AddMessage("result", &post);
@@ -1306,6 +2001,136 @@ static inline status_t checkAttr(BNode *sink, const char *attr, int64 value) {
 }
 } // namespace
 
+// Works through the stored messages a batch at a time and brings their
+// `context` up to date with `contextLink`, once per database. Returns whether
+// there are more to do.
+bool SSBDatabase::recomputeContexts() {
+  std::vector<std::pair<int64, BString>> changed;
+  int32 seen = 0;
+  {
+    sqlite3_stmt *query;
+    sqlite3_prepare_v2(this->database,
+                       "SELECT rowid, context, body FROM messages "
+                       "WHERE rowid > ? ORDER BY rowid LIMIT ?",
+                       -1, &query, NULL);
+    sqlite3_bind_int64(query, 1, this->contextCursor);
+    sqlite3_bind_int(query, 2, CONTEXT_BATCH);
+    while (sqlite3_step(query) == SQLITE_ROW) {
+      seen++;
+      this->contextCursor = sqlite3_column_int64(query, 0);
+      BMessage message;
+      BMessage content;
+      BString type;
+      if (body::unflatten(&message, sqlite3_column_blob(query, 2),
+                          sqlite3_column_bytes(query, 2)) != B_OK ||
+          message.FindMessage("content", &content) != B_OK ||
+          content.FindString("type", &type) != B_OK) {
+        continue;
+      }
+      BString context;
+      contextLink(&context, type, &content);
+      auto stored = (const char *)sqlite3_column_text(query, 1);
+      if (context != (stored == NULL ? "" : stored))
+        changed.push_back({this->contextCursor, context});
+    }
+    sqlite3_finalize(query);
+  }
+  if (!changed.empty()) {
+    sqlite3_stmt *update;
+    sqlite3_prepare_v2(this->database,
+                       "UPDATE messages SET context = ? WHERE rowid = ?", -1,
+                       &update, NULL);
+    sqlite3_exec(this->database, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+    for (auto &[rowid, context] : changed) {
+      if (context.IsEmpty()) {
+        sqlite3_bind_null(update, 1);
+      } else {
+        sqlite3_bind_text(update, 1, context.String(), context.Length(),
+                          SQLITE_STATIC);
+      }
+      sqlite3_bind_int64(update, 2, rowid);
+      sqlite3_step(update);
+      sqlite3_reset(update);
+    }
+    sqlite3_exec(this->database, "END TRANSACTION;", NULL, NULL, NULL);
+    sqlite3_finalize(update);
+  }
+  if (seen < CONTEXT_BATCH) {
+    this->contextCursor = -1;
+    markUpkeepDone(this->database, kUpkeepContexts);
+    writeLog('DBMT', "Finished recomputing message contexts");
+    return false;
+  }
+  return true;
+}
+
+// Adds the text of the next batch of posts stored before they were indexed as
+// they came in. Returns whether there may be more to add.
+bool SSBDatabase::indexPostText() {
+  this->flushPostText();
+  if (this->searchCursor < 0)
+    return false;
+  int32 seen = 0;
+  {
+    sqlite3_stmt *query;
+    sqlite3_prepare_v2(this->database,
+                       "SELECT rowid, body FROM messages WHERE rowid > ? "
+                       "AND type = 'post' AND NOT EXISTS("
+                       "SELECT 1 FROM post_text "
+                       "WHERE post_text.rowid = messages.rowid) "
+                       "ORDER BY rowid LIMIT ?",
+                       -1, &query, NULL);
+    sqlite3_bind_int64(query, 1, this->searchCursor);
+    sqlite3_bind_int(query, 2, SEARCH_BATCH);
+    while (sqlite3_step(query) == SQLITE_ROW) {
+      seen++;
+      this->searchCursor = sqlite3_column_int64(query, 0);
+      BMessage message;
+      BMessage content;
+      BString text;
+      if (body::unflatten(&message, sqlite3_column_blob(query, 1),
+                          sqlite3_column_bytes(query, 1)) == B_OK &&
+          message.FindMessage("content", &content) == B_OK &&
+          content.FindString("text", &text) == B_OK && !text.IsEmpty()) {
+        this->unindexed[this->searchCursor] = text;
+      }
+    }
+    sqlite3_finalize(query);
+  }
+  this->flushPostText();
+  if (seen < SEARCH_BATCH) {
+    this->searchCursor = -1;
+    markUpkeepDone(this->database, kUpkeepSearch);
+    writeLog('DBMT', "Finished indexing post text");
+    return false;
+  }
+  return true;
+}
+
+// Writes the queued post text to the search index together. A post deleted
+// since it was queued is left out, as its rowid may have gone to another
+// message.
+void SSBDatabase::flushPostText() {
+  if (this->unindexed.empty())
+    return;
+  sqlite3_stmt *insert;
+  sqlite3_prepare_v2(this->database,
+                     "INSERT INTO post_text(rowid, text) SELECT ?1, ?2 "
+                     "WHERE EXISTS(SELECT 1 FROM messages "
+                     "WHERE rowid = ?1 AND type = 'post')",
+                     -1, &insert, NULL);
+  sqlite3_exec(this->database, "SAVEPOINT index_text", NULL, NULL, NULL);
+  for (auto &[rowid, text] : this->unindexed) {
+    sqlite3_bind_int64(insert, 1, rowid);
+    sqlite3_bind_text(insert, 2, text.String(), text.Length(), SQLITE_STATIC);
+    sqlite3_step(insert);
+    sqlite3_reset(insert);
+  }
+  sqlite3_exec(this->database, "RELEASE index_text", NULL, NULL, NULL);
+  sqlite3_finalize(insert);
+  this->unindexed.clear();
+}
+
 status_t SSBFeed::save(BMessage *message, BMessage *reply) {
   status_t status;
   unsigned char msgHash[crypto_hash_sha256_BYTES];
@@ -1345,13 +2170,16 @@ status_t SSBFeed::save(BMessage *message, BMessage *reply) {
   }
   sqlite3_bind_int64(insert, 4, timestamp);
   BString context;
+  BString type;
+  BString text;
   if (BMessage content;
       (status = message->FindMessage("content", &content)) == B_OK) {
-    BString type;
     if ((status = content.FindString("type", &type)) != B_OK) {
       sqlite3_finalize(insert);
       return status;
     }
+    if (type == "post")
+      content.FindString("text", &text);
     sqlite3_bind_text(insert, 5, type.String(), type.Length(),
                       SQLITE_TRANSIENT);
     if (contextLink(&context, type, &content) == B_OK) {
@@ -1364,17 +2192,55 @@ status_t SSBFeed::save(BMessage *message, BMessage *reply) {
     sqlite3_bind_null(insert, 5);
     sqlite3_bind_null(insert, 6);
   }
-  ssize_t flatSize = message->FlattenedSize();
-  char *buffer = new char[flatSize];
-  message->Flatten(buffer, flatSize);
+  char *buffer;
+  size_t flatSize;
+  if ((status = body::flatten(*message, &buffer, &flatSize)) != B_OK) {
+    sqlite3_finalize(insert);
+    return status;
+  }
   sqlite3_bind_blob64(insert, 7, buffer, flatSize, freeBuffer);
+  // The message and its feed's head are written together.
+  sqlite3_exec(FEED_DB, "SAVEPOINT save_post", NULL, NULL, NULL);
   sqlite3_step(insert);
+  bool inserted = sqlite3_changes(FEED_DB) > 0;
+  int64 rowid = sqlite3_last_insert_rowid(FEED_DB);
   sqlite3_finalize(insert);
+  if (inserted) {
+    static_cast<SSBDatabase *>(this->Looper())->ingested++;
+    sqlite3_stmt *head;
+    sqlite3_prepare_v2(FEED_DB,
+                       "INSERT INTO feed_heads"
+                       "(author, sequence, cypherkey, count) "
+                       "VALUES(?, ?, ?, 1) ON CONFLICT(author) DO UPDATE SET "
+                       "sequence = excluded.sequence, "
+                       "cypherkey = excluded.cypherkey, "
+                       "broken = 0, forked = 0, count = count + 1",
+                       -1, &head, NULL);
+    sqlite3_bind_text(head, 1, author.String(), author.Length(),
+                      SQLITE_STATIC);
+    sqlite3_bind_int64(head, 2, this->lastSequence);
+    sqlite3_bind_text(head, 3, cypherkey.String(), cypherkey.Length(),
+                      SQLITE_STATIC);
+    sqlite3_step(head);
+    sqlite3_finalize(head);
+  }
+  sqlite3_exec(FEED_DB, "RELEASE save_post", NULL, NULL, NULL);
+  // Post text is indexed for search a batch at a time, not with each save.
+  if (auto db = static_cast<SSBDatabase *>(this->Looper());
+      inserted && !text.IsEmpty()) {
+    db->unindexed[rowid] = text;
+    if (db->unindexed.size() >= SEARCH_BATCH)
+      db->flushPostText();
+  }
   {
     BMessage notif('CHCK');
     notif.AddMessage("post", message);
     notif.AddString("key", cypherkey);
     notif.AddString("context", context);
+    notif.AddString("type", type);
+    notif.AddInt64("timestamp", timestamp);
+    if (inserted)
+      notif.AddInt64("rowid", rowid);
     BMessenger(this->Looper()).SendMessage(&notif);
   }
   this->notifyChanges();
@@ -1707,4 +2573,9 @@ status_t validate(BMessage *message, int lastSequence, BString &lastID,
 #undef CHECK
   return B_OK;
 }
+
+sqlite3_stmt *prepareQuery(sqlite3 *db, const BMessage &specifier,
+                           bool paged) {
+  return spec2query(db, specifier, paged);
+}
 } // namespace post
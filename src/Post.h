@@ -8,11 +8,15 @@
 #include <Volume.h>
 #include <functional>
 #include <map>
+#include <memory>
 #include <sqlite3.h>
 #include <vector>
 
 BString messageCypherkey(unsigned char hash[crypto_hash_sha256_BYTES]);
 
+class BMessageRunner;
+class LiveQueryIndex;
+
 class QueryBacked : public BHandler {
 public:
   QueryBacked(sqlite3_stmt *query);
@@ -21,7 +25,10 @@ public:
                           const BMessage &msg) = 0;
 
 protected:
+  friend class LiveQueryIndex;
+  void detach();
   sqlite3_stmt *query;
+  LiveQueryIndex *liveIndex = NULL;
   bool mainDone = false;
 };
 
@@ -31,7 +38,8 @@ extern property_info databaseProperties[];
 
 class SSBDatabase : public BLooper {
 public:
-  SSBDatabase(std::function<sqlite3 *()> dbOpen);
+  SSBDatabase(std::function<sqlite3 *()> dbOpen,
+              std::function<sqlite3 *()> readerOpen);
   ~SSBDatabase() override;
   status_t GetSupportedSuites(BMessage *data) override;
   BHandler *ResolveSpecifier(BMessage *msg, int32 index, BMessage *specifier,
@@ -50,19 +58,41 @@ private:
   friend class SSBFeed;
   friend class QueryBacked;
   bool runCheck(BMessage *msg);
+  BLooper *reader();
+  status_t replicate(const BString &cypherkey, SSBFeed **result);
+  void runQuery(BMessage *request, const BMessage &specifier);
+  bool idle();
+  void maintain();
+  bool recomputeContexts();
+  bool indexPostText();
+  void flushPostText();
 
 public:
   sqlite3 *database;
 
 private:
-  std::function<sqlite3 *()> dbOpen;
   std::map<BString, SSBFeed *> feeds;
+  std::vector<BLooper *> readers;
+  size_t nextReader = 0;
+  std::unique_ptr<LiveQueryIndex> liveQueries;
+  BLooper *decoder;
   sqlite3_stmt *backlog;
   uint64 backlogCount;
-  int checkpointCount = 0;
+  int64 recompressCursor = 0;
+  std::unique_ptr<BMessageRunner> maintenance;
+  bigtime_t lastForeground = 0;
+  int walPages = 0;
+  int checkpointPages;
+  int64 ingested = 0;
+  int64 contextCursor = 0;
+  int64 searchCursor = 0;
+  // Text of posts saved since the search index was last written, by rowid.
+  std::map<int64, BString> unindexed;
+  bool incrementalVacuum = false;
   bool pulseRunning = false;
   bool clogged = false;
   bool initialBacklog = true;
+  bool recompressing = false;
 };
 
 class SSBFeed : public BHandler {
@@ -76,6 +106,10 @@ public:
   BHandler *ResolveSpecifier(BMessage *msg, int32 index, BMessage *specifier,
                              int32 what, const char *property) override;
   status_t load();
+  status_t restore(int64 sequence, const char *last, bool broken,
+                   bool forked);
+  void addHead(BMessage *notice);
+  void drop();
 
   static status_t parseAuthor(unsigned char out[crypto_sign_PUBLICKEYBYTES],
                               const BString &in);
@@ -88,6 +122,7 @@ public:
 
 protected:
   status_t save(BMessage *message, BMessage *result = NULL);
+  void storeFlags();
   unsigned char pubkey[crypto_sign_PUBLICKEYBYTES];
   int64 lastSequence = 0;
   unsigned char lastHash[crypto_hash_sha256_BYTES];
@@ -112,6 +147,8 @@ private:
 namespace post {
 status_t validate(BMessage *message, int lastSequence, BString &lastID,
                   bool useHmac, BString &hmacKey);
+sqlite3_stmt *prepareQuery(sqlite3 *db, const BMessage &specifier,
+                           bool paged = false);
 }
 
 #endif // POST_H
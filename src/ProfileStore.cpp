@@ -5,10 +5,39 @@
 #include <cstring>
 #include <set>
 
+#define PROFILE_BATCH 64
+#define DISPLAY_NAMES_KEPT 1024
+
 ProfileStore::ProfileStore(sqlite3 *database)
-    : database(database) {}
+    : database(database),
+      pending('PSTS') {
+  sqlite3_prepare_v2(database,
+                     "INSERT INTO profiles(author, property, sequence, "
+                     "type, value, fixedsize) "
+                     "VALUES(?, ?, ?, ?, ?, ?) "
+                     "ON CONFLICT(author, property) DO UPDATE "
+                     "SET sequence = excluded.sequence, type = excluded.type, "
+                     "value = excluded.value, fixedsize = excluded.fixedsize "
+                     "WHERE excluded.sequence > profiles.sequence",
+                     -1, &this->upsert, NULL);
+  sqlite3_prepare_v2(database,
+                     "UPDATE messages SET processed = 1 WHERE cypherkey = ?",
+                     -1, &this->processed, NULL);
+  sqlite3_prepare_v2(database,
+                     "INSERT INTO profile_names(author, name, folded) "
+                     "VALUES(?, ?, ?) "
+                     "ON CONFLICT(author) DO UPDATE "
+                     "SET name = excluded.name, folded = excluded.folded",
+                     -1, &this->nameUpsert, NULL);
+}
+
+ProfileStore::~ProfileStore() {
+  sqlite3_finalize(this->upsert);
+  sqlite3_finalize(this->processed);
+  sqlite3_finalize(this->nameUpsert);
+}
 
-enum { kProfile };
+enum { kProfile, kDisplayNames, kProfileChanges };
 
 property_info profileProperties[] = {{"Profile",
                                       {B_GET_PROPERTY, 0},
@@ -16,8 +45,108 @@ property_info profileProperties[] = {{"Profile",
                                       "Profile details",
                                       kProfile,
                                       {}},
+                                     {"Profile",
+                                      {B_GET_PROPERTY, 0},
+                                      {B_DIRECT_SPECIFIER, 0},
+                                      "Names and pictures for the feeds in "
+                                      "\"author\"",
+                                      kDisplayNames,
+                                      {}},
+                                     {"Profile",
+                                      {'USUB', 0},
+                                      {B_DIRECT_SPECIFIER, 0},
+                                      "Be told which feeds' profiles change",
+                                      kProfileChanges,
+                                      {}},
                                      {0}};
 
+namespace {
+BString profileString(sqlite3_stmt *row, int column, type_code type) {
+  auto data = (const char *)sqlite3_column_blob(row, column);
+  int size = sqlite3_column_bytes(row, column);
+  if (data == NULL)
+    return BString();
+  if (type == B_STRING_TYPE)
+    return BString(data, size);
+  // Pictures are sometimes given as a link with details about the image.
+  BString result;
+  if (BMessage message;
+      type == B_MESSAGE_TYPE && message.Unflatten(data) == B_OK) {
+    message.FindString("link", &result);
+  }
+  return result;
+}
+} // namespace
+
+// Adds a result for each of `authors`, with their name and the key of their
+// picture where we know them. Recently asked for feeds are answered from
+// memory, and the rest with one query.
+void ProfileStore::displayNames(const std::vector<BString> &authors,
+                                BMessage *reply) {
+  std::map<BString, DisplayName> found;
+  std::vector<BString> missing;
+  for (const BString &author : authors) {
+    if (auto cached = this->recentIndex.find(author);
+        cached != this->recentIndex.end()) {
+      this->recent.splice(this->recent.begin(), this->recent, cached->second);
+      found[author] = cached->second->second;
+    } else if (found.try_emplace(author).second) {
+      missing.push_back(author);
+    }
+  }
+  if (!missing.empty()) {
+    BString sql("SELECT author, property, type, value FROM profiles "
+                "WHERE property IN ('name', 'image') AND author IN (?");
+    for (size_t i = 1; i < missing.size(); i++)
+      sql << ", ?";
+    sql << ")";
+    sqlite3_stmt *query;
+    sqlite3_prepare_v2(this->database, sql.String(), sql.Length(), &query,
+                       NULL);
+    for (size_t i = 0; i < missing.size(); i++) {
+      sqlite3_bind_text(query, i + 1, missing[i].String(),
+                        missing[i].Length(), SQLITE_STATIC);
+    }
+    while (sqlite3_step(query) == SQLITE_ROW) {
+      BString author((const char *)sqlite3_column_text(query, 0));
+      BString property((const char *)sqlite3_column_text(query, 1));
+      BString value =
+          profileString(query, 3, sqlite3_column_int64(query, 2));
+      if (property == "name")
+        found[author].name = value;
+      else
+        found[author].image = value;
+    }
+    sqlite3_finalize(query);
+    for (const BString &author : missing) {
+      this->recent.emplace_front(author, found[author]);
+      this->recentIndex[author] = this->recent.begin();
+      if (this->recent.size() > DISPLAY_NAMES_KEPT) {
+        this->recentIndex.erase(this->recent.back().first);
+        this->recent.pop_back();
+      }
+    }
+  }
+  for (const BString &author : authors) {
+    const DisplayName &display = found[author];
+    BMessage result('JSOB');
+    result.AddString("about", author);
+    if (display.name.Length() > 0)
+      result.AddString("name", display.name);
+    if (display.image.Length() > 0)
+      result.AddString("image", display.image);
+    reply->AddMessage("result", &result);
+  }
+}
+
+void ProfileStore::forget(const BString &author) {
+  if (auto cached = this->recentIndex.find(author);
+      cached != this->recentIndex.end()) {
+    this->recent.erase(cached->second);
+    this->recentIndex.erase(cached);
+  }
+}
+
 status_t ProfileStore::GetSupportedSuites(BMessage *data) {
   data->AddString("suites", "suite/x-vnd.habitat+profilestore");
   BPropertyInfo propertyInfo(profileProperties);
@@ -55,19 +184,33 @@ void ProfileStore::MessageReceived(BMessage *message) {
       if (direct) {
         authors.emplace(name);
       } else {
+        // Names of three or more characters are matched anywhere through
+        // their trigrams, and shorter ones by prefix.
         sqlite3_exec(this->database, "BEGIN TRANSACTION;", NULL, NULL, NULL);
-        sqlite3_prepare_v2(this->database,
-                           "SELECT author FROM profiles "
-                           "WHERE type = ? "
-                           "AND property = 'name' "
-                           "AND value LIKE ?",
-                           -1, &qry, NULL);
-        sqlite3_bind_int64(qry, 1, B_STRING_TYPE);
-        BString segment("%");
-        segment.Append(name);
-        segment.Append("%");
-        sqlite3_bind_text(qry, 2, segment.String(), segment.Length(),
-                          SQLITE_STATIC);
+        BString folded(name);
+        folded.ToLower();
+        if (folded.CountChars() >= 3) {
+          sqlite3_prepare_v2(this->database,
+                             "SELECT profile_names.author "
+                             "FROM profile_trigrams JOIN profile_names "
+                             "ON profile_names.rowid = profile_trigrams.rowid "
+                             "WHERE profile_trigrams MATCH ?",
+                             -1, &qry, NULL);
+          folded.ReplaceAll("\"", "\"\"");
+          folded.Prepend("\"");
+          folded.Append("\"");
+          sqlite3_bind_text(qry, 1, folded.String(), folded.Length(),
+                            SQLITE_STATIC);
+        } else {
+          sqlite3_prepare_v2(this->database,
+                             "SELECT author FROM profile_names "
+                             "WHERE folded >= ?1 AND folded < ?1 || ?2",
+                             -1, &qry, NULL);
+          sqlite3_bind_text(qry, 1, folded.String(), folded.Length(),
+                            SQLITE_STATIC);
+          // U+10FFFF, after anything else that could follow the prefix.
+          sqlite3_bind_text(qry, 2, "\xf4\x8f\xbf\xbf", -1, SQLITE_STATIC);
+        }
         while (sqlite3_step(qry) == SQLITE_ROW) {
           authors.emplace(
               reinterpret_cast<const char *>(sqlite3_column_text(qry, 0)));
@@ -99,6 +242,24 @@ void ProfileStore::MessageReceived(BMessage *message) {
       if (!direct)
         sqlite3_exec(this->database, "END TRANSACTION;", NULL, NULL, NULL);
     } break;
+    case kDisplayNames: {
+      std::vector<BString> authors;
+      BString author;
+      for (int32 i = 0; message->FindString("author", i, &author) == B_OK; i++)
+        authors.push_back(author);
+      this->displayNames(authors, &reply);
+      error = B_OK;
+    } break;
+    case kProfileChanges: {
+      BMessenger target;
+      if ((error = message->FindMessenger("subscriber", &target)) != B_OK)
+        break;
+      // As with feed subscriptions, the observer is added from this side.
+      BMessage obs('_OBS');
+      obs.AddMessenger("be:observe_target", target);
+      obs.AddInt32(B_OBSERVE_WHAT_CHANGE, 'PROF');
+      BHandler::MessageReceived(&obs);
+    } break;
     default:
       return BHandler::MessageReceived(message);
     }
@@ -108,6 +269,7 @@ void ProfileStore::MessageReceived(BMessage *message) {
       message->SendReply(&reply);
     return;
   } else if (message->what == 'INIT') {
+    // Only what hasn't been stored yet is read back, a page at a time.
     BMessage rq(B_GET_PROPERTY);
     BMessage specifier('CPLX');
     specifier.AddString("property", "Post");
@@ -116,136 +278,115 @@ void ProfileStore::MessageReceived(BMessage *message) {
     specifier.AddString("specialCase", "selfReferent");
     rq.AddSpecifier(&specifier);
     rq.AddMessenger("target", BMessenger(this));
+    rq.AddBool("includeKey", true);
+    rq.AddInt32("batch", PROFILE_BATCH);
     BMessenger("application/x-vnd.habitat").SendMessage(&rq);
-  } else if (BString author; message->FindString("author", &author) == B_OK) {
-    if (BMessage content; message->FindMessage("content", &content) == B_OK ||
-        message->FindMessage("cleartext", &content) == B_OK) {
-      int64 sequence;
-      if (double sq; message->FindDouble("sequence", &sq) == B_OK)
-        sequence = (int64)sq;
-      else
-        goto super;
-      if (BString about;
-          content.FindString("about", &about) != B_OK || about != author) {
-        goto super;
-      }
-      std::set<BString> toInsert;
-      std::set<BString> toUpdate;
-      bool successful = true;
-      sqlite3_exec(this->database, "BEGIN TRANSACTION;", NULL, NULL, NULL);
-      {
-        int32 index = 0;
-        char *attrname;
-        type_code attrtype;
-        sqlite3_stmt *qry;
-        sqlite3_prepare_v2(this->database,
-                           "SELECT sequence FROM profiles WHERE author = ? "
-                           "AND property = ?",
-                           -1, &qry, NULL);
-        sqlite3_bind_text(qry, 1, author.String(), author.Length(),
-                          SQLITE_STATIC);
-        while (content.GetInfo(B_ANY_TYPE, index, &attrname, &attrtype) ==
-               B_OK) {
-          if (std::strcmp(attrname, "about") == 0 ||
-              std::strcmp(attrname, "type") == 0) {
-            index++;
-            continue;
-          }
-          sqlite3_bind_text(qry, 2, attrname, -1, SQLITE_TRANSIENT);
-          switch (sqlite3_step(qry)) {
-          case SQLITE_DONE:
-            toInsert.emplace(attrname);
-            break;
-          case SQLITE_ROW:
-            if (sqlite3_column_int64(qry, 0) < sequence)
-              toUpdate.emplace(attrname);
-            break;
-          default:
-            successful = false;
-          }
-          sqlite3_reset(qry);
-          index++;
-        }
-        sqlite3_finalize(qry);
-      }
-      if (!toInsert.empty()) {
-        sqlite3_stmt *qry;
-        sqlite3_prepare_v2(this->database,
-                           "INSERT INTO profiles(author, property, sequence, "
-                           "type, value, fixedsize) "
-                           "VALUES(?, ?, ?, ?, ?, ?)",
-                           -1, &qry, NULL);
-        sqlite3_bind_text(qry, 1, author.String(), author.Length(),
-                          SQLITE_STATIC);
-        sqlite3_bind_int64(qry, 3, sequence);
-        for (const BString &attr : toInsert) {
-          bool fixedSize;
-          type_code typeFound;
-          if (content.GetInfo(attr.String(), &typeFound, &fixedSize) == B_OK) {
-            sqlite3_bind_text(qry, 2, attr.String(), attr.Length(),
-                              SQLITE_STATIC);
-            sqlite3_bind_int64(qry, 4, typeFound);
-            const void *data;
-            ssize_t numBytes;
-            content.FindData(attr.String(), typeFound, &data, &numBytes);
-            sqlite3_bind_blob(qry, 5, data, numBytes, SQLITE_STATIC);
-            sqlite3_bind_int(qry, 6, fixedSize);
-            if (sqlite3_step(qry) != SQLITE_DONE)
-              successful = false;
-            sqlite3_reset(qry);
-          }
-        }
-        sqlite3_finalize(qry);
-      }
-      if (!toUpdate.empty()) {
-        sqlite3_stmt *qry;
-        sqlite3_prepare_v2(
-            this->database,
-            "UPDATE profiles SET sequence = ?, type = ?, value = ? "
-            "WHERE author = ? "
-            "AND property = ?",
-            -1, &qry, NULL);
-        sqlite3_bind_int64(qry, 1, sequence);
-        sqlite3_bind_text(qry, 4, author.String(), author.Length(),
-                          SQLITE_STATIC);
-        for (const BString &attr : toUpdate) {
-          bool fixedSize;
-          type_code typeFound;
-          if (content.GetInfo(attr.String(), &typeFound, &fixedSize) == B_OK) {
-            sqlite3_bind_text(qry, 5, attr.String(), attr.Length(),
-                              SQLITE_STATIC);
-            sqlite3_bind_int64(qry, 2, typeFound);
-            const void *data;
-            ssize_t numBytes;
-            content.FindData(attr.String(), typeFound, &data, &numBytes);
-            sqlite3_bind_blob(qry, 3, data, numBytes, SQLITE_STATIC);
-            if (sqlite3_step(qry) != SQLITE_DONE)
-              successful = false;
-            sqlite3_reset(qry);
-          }
-        }
-        sqlite3_finalize(qry);
-      }
-      if (successful) {
-        if (BString cypherkey;
-            message->FindString("cypherkey", &cypherkey) == B_OK) {
-          sqlite3_stmt *qry;
-          sqlite3_prepare_v2(
-              this->database,
-              "UPDATE messages SET processed = 1 WHERE cypherkey = ?", -1, &qry,
-              NULL);
-          sqlite3_bind_text(qry, 1, cypherkey.String(), cypherkey.Length(),
-                            SQLITE_STATIC);
-          sqlite3_step(qry);
-          sqlite3_finalize(qry);
-        }
-      }
-      sqlite3_exec(this->database, "END TRANSACTION;", NULL, NULL, NULL);
-    } else {
-      goto super;
-    }
+  } else if (message->what == 'PSTS') {
+    this->storeBatch(message);
+  } else if (message->what == 'PFLS') {
+    this->storeBatch(&this->pending);
+    this->pending.MakeEmpty();
+  } else if (message->HasString("author")) {
+    // New messages are stored together with whatever else is already queued.
+    if (!this->pending.HasMessage("post"))
+      BMessenger(this).SendMessage('PFLS');
+    this->pending.AddMessage("post", message);
   } else {
-  super:
     BHandler::MessageReceived(message);
   }
 }
+
+// Stores each post in `batch` in one transaction, then tells subscribers
+// whose profiles changed.
+void ProfileStore::storeBatch(BMessage *batch) {
+  BMessage notice(B_OBSERVER_NOTICE_CHANGE);
+  sqlite3_exec(this->database, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+  BMessage post;
+  for (int32 i = 0; batch->FindMessage("post", i, &post) == B_OK; i++)
+    this->store(&post, &notice);
+  sqlite3_exec(this->database, "END TRANSACTION;", NULL, NULL, NULL);
+  if (notice.HasString("author"))
+    this->SendNotices('PROF', &notice);
+}
+
+// Stores the properties an about message sets on its own author, keeping
+// whichever is newest, and marks the message processed if that worked. The
+// author is added to `notice` if anything changed.
+status_t ProfileStore::store(BMessage *message, BMessage *notice) {
+  BString author;
+  if (message->FindString("author", &author) != B_OK)
+    return B_BAD_VALUE;
+  BMessage content;
+  if (message->FindMessage("content", &content) != B_OK &&
+      message->FindMessage("cleartext", &content) != B_OK) {
+    return B_BAD_VALUE;
+  }
+  int64 sequence;
+  if (double sq; message->FindDouble("sequence", &sq) == B_OK)
+    sequence = (int64)sq;
+  else
+    return B_BAD_VALUE;
+  if (BString about;
+      content.FindString("about", &about) != B_OK || about != author) {
+    return B_BAD_VALUE;
+  }
+  status_t error = B_OK;
+  bool changed = false;
+  sqlite3_bind_text(this->upsert, 1, author.String(), author.Length(),
+                    SQLITE_STATIC);
+  sqlite3_bind_int64(this->upsert, 3, sequence);
+  char *attrname;
+  type_code attrtype;
+  for (int32 index = 0;
+       content.GetInfo(B_ANY_TYPE, index, &attrname, &attrtype) == B_OK;
+       index++) {
+    if (std::strcmp(attrname, "about") == 0 ||
+        std::strcmp(attrname, "type") == 0) {
+      continue;
+    }
+    bool fixedSize;
+    const void *data;
+    ssize_t numBytes;
+    if (content.GetInfo(attrname, &attrtype, &fixedSize) != B_OK ||
+        content.FindData(attrname, attrtype, &data, &numBytes) != B_OK) {
+      continue;
+    }
+    sqlite3_bind_text(this->upsert, 2, attrname, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(this->upsert, 4, attrtype);
+    sqlite3_bind_blob(this->upsert, 5, data, numBytes, SQLITE_STATIC);
+    sqlite3_bind_int(this->upsert, 6, fixedSize);
+    if (sqlite3_step(this->upsert) != SQLITE_DONE)
+      error = B_IO_ERROR;
+    sqlite3_reset(this->upsert);
+    if (sqlite3_changes(this->database) == 0)
+      continue;
+    changed = true;
+    if (std::strcmp(attrname, "name") == 0 && attrtype == B_STRING_TYPE) {
+      BString name((const char *)data, numBytes);
+      BString folded(name);
+      folded.ToLower();
+      sqlite3_bind_text(this->nameUpsert, 1, author.String(), author.Length(),
+                        SQLITE_STATIC);
+      sqlite3_bind_text(this->nameUpsert, 2, name.String(), name.Length(),
+                        SQLITE_STATIC);
+      sqlite3_bind_text(this->nameUpsert, 3, folded.String(), folded.Length(),
+                        SQLITE_STATIC);
+      if (sqlite3_step(this->nameUpsert) != SQLITE_DONE)
+        error = B_IO_ERROR;
+      sqlite3_reset(this->nameUpsert);
+    }
+  }
+  sqlite3_clear_bindings(this->upsert);
+  if (changed) {
+    this->forget(author);
+    notice->AddString("author", author);
+  }
+  if (BString cypherkey; error == B_OK &&
+      message->FindString("cypherkey", &cypherkey) == B_OK) {
+    sqlite3_bind_text(this->processed, 1, cypherkey.String(),
+                      cypherkey.Length(), SQLITE_STATIC);
+    sqlite3_step(this->processed);
+    sqlite3_reset(this->processed);
+  }
+  return error;
+}
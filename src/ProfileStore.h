@@ -2,19 +2,41 @@
 #define PROFILE_STORE_H
 
 #include <Handler.h>
+#include <Message.h>
+#include <String.h>
 #include <PropertyInfo.h>
+#include <list>
+#include <map>
 #include <sqlite3.h>
+#include <vector>
 
 class ProfileStore : public BHandler {
 public:
   ProfileStore(sqlite3 *database);
+  ~ProfileStore();
   status_t GetSupportedSuites(BMessage *data) override;
   BHandler *ResolveSpecifier(BMessage *msg, int32 index, BMessage *specifier,
                              int32 what, const char *property) override;
   void MessageReceived(BMessage *message) override;
 
 private:
+  struct DisplayName {
+    BString name;
+    BString image;
+  };
+  void storeBatch(BMessage *batch);
+  status_t store(BMessage *message, BMessage *notice);
+  void displayNames(const std::vector<BString> &authors, BMessage *reply);
+  void forget(const BString &author);
   sqlite3 *database;
+  sqlite3_stmt *upsert;
+  sqlite3_stmt *processed;
+  sqlite3_stmt *nameUpsert;
+  BMessage pending;
+  // Recently looked up names, most recent first.
+  std::list<std::pair<BString, DisplayName>> recent;
+  std::map<BString, std::list<std::pair<BString, DisplayName>>::iterator>
+      recentIndex;
 };
 
 extern property_info profileProperties[];
@@ -2,7 +2,7 @@
 #include "ContactGraph.h"
 #include "Plugin.h"
 #include <Application.h>
-#include <map>
+#include <Looper.h>
 
 SelectContacts::SelectContacts(const BMessenger &db, const BMessenger &graph)
     : db(db),
@@ -43,7 +43,9 @@ void SelectContacts::MessageReceived(BMessage *message) {
     BMessenger(be_app).SendMessage(&get, BMessenger(this));
   } break;
   case B_OBSERVER_NOTICE_CHANGE:
-    if (!this->fetching) {
+    if (!this->needsFlattened()) {
+      this->makeSelection(NULL);
+    } else if (!this->fetching) {
       this->fetching = true;
       BMessage rq(B_GET_PROPERTY);
       this->graph.SendMessage(&rq, BMessenger(this));
@@ -55,6 +57,39 @@ void SelectContacts::MessageReceived(BMessage *message) {
   }
 }
 
+// The graph handler shares our looper, so it can be read directly while we
+// are handling a message.
+ContactGraph *SelectContacts::localGraph() {
+  BLooper *looper;
+  auto graph = dynamic_cast<ContactGraph *>(this->graph.Target(&looper));
+  return looper == this->Looper() ? graph : NULL;
+}
+
+// Whether any plugin still wants the graph as a BMessage.
+bool SelectContacts::needsFlattened() {
+  if (this->localGraph() == NULL)
+    return true;
+  for (const Plugin &plugin : habitat_plugins.loaded()) {
+    if (plugin.selectContacts != NULL && plugin.selectContactsView == NULL)
+      return true;
+  }
+  return false;
+}
+
+// Whether the selections kept for version 2 plugins, taken together, want
+// `feed` replicated.
+bool SelectContacts::wanted(const BString &feed) {
+  bool selected = false;
+  bool blocked = false;
+  for (auto &[plugname, selection] : this->selections) {
+    if (selection.own.count(feed) > 0)
+      return true;
+    selected = selected || selection.selected.count(feed) > 0;
+    blocked = blocked || selection.blocked.count(feed) > 0;
+  }
+  return selected && !blocked;
+}
+
 void SelectContacts::makeSelection(BMessage *graph) {
   std::set<BString> ownFeeds;
   {
@@ -67,45 +102,66 @@ void SelectContacts::makeSelection(BMessage *graph) {
     for (int i = 0; response.FindString("result", i, &result) == B_OK; i++)
       ownFeeds.insert(result);
   }
-  typedef status_t (*mkConfig_t)(BMessage *);
-  std::map<BString, mkConfig_t> configurators;
-  for (auto &[plugname, plugPtr] : habitat_plugins.lookup("defaultConfig")) {
-    auto configurator = (mkConfig_t)plugPtr;
-    if (configurator != NULL)
-      configurators.insert({plugname, configurator});
+  // Plugins built for version 2 read the graph in place, with what changed
+  // since they last saw it, and keep their selection up to date; older ones
+  // get the flattened BMessage, if there is one, and start from nothing.
+  ContactGraph *local = this->localGraph();
+  std::set<BString> viewed;
+  bool incremental = true;
+  for (const Plugin &plugin : habitat_plugins.loaded()) {
+    if (local == NULL || plugin.selectContactsView == NULL)
+      continue;
+    BMessage config;
+    if (plugin.defaultConfig != NULL)
+      plugin.defaultConfig(&config);
+    auto [stored, added] = this->selections.try_emplace(plugin.name);
+    GraphView view = local->view(this->seenGeneration[plugin.name]);
+    if (plugin.selectContactsView(&stored->second, &ownFeeds, &config,
+                                  &view) == B_OK) {
+      this->seenGeneration[plugin.name] = view.generation;
+    }
+    incremental = incremental && !added;
+    viewed.insert(plugin.name);
   }
   ContactSelection full;
-  for (auto &[plugname, plugPtr] : habitat_plugins.lookup("selectContacts")) {
-    typedef status_t (*algorithm_t)(ContactSelection *, std::set<BString> *,
-                                    BMessage *, BMessage *);
-    auto algorithm = (algorithm_t)plugPtr;
-    if (plugPtr == NULL)
+  for (const Plugin &plugin : habitat_plugins.loaded()) {
+    if (plugin.selectContacts == NULL || graph == NULL ||
+        viewed.count(plugin.name) > 0) {
       continue;
+    }
     ContactSelection single;
     BMessage config;
-    if (auto configurator = configurators.find(plugname);
-        configurator != configurators.end()) {
-      (configurator->second)(&config);
-    }
-    if (algorithm(&single, &ownFeeds, &config, graph) == B_OK)
+    if (plugin.defaultConfig != NULL)
+      plugin.defaultConfig(&config);
+    if (plugin.selectContacts(&single, &ownFeeds, &config, graph) == B_OK)
       full += single;
+    incremental = false;
   }
-  auto leftover = this->current;
-  this->current = full.combine();
-  for (auto item : this->current) {
-    if (leftover.find(item) == leftover.end()) {
-      BMessage create(B_CREATE_PROPERTY);
-      create.AddSpecifier("ReplicatedFeed");
-      create.AddString("cypherkey", item);
-      this->db.SendMessage(&create);
-    } else {
-      leftover.erase(item);
-    }
+  // Only the feeds some plugin changed need looking at again, unless a
+  // plugin started from nothing.
+  std::set<BString> touched;
+  for (auto &[plugname, selection] : this->selections) {
+    if (incremental)
+      touched.merge(selection.changed);
+    else
+      full += selection;
+    selection.changed.clear();
+  }
+  if (!incremental) {
+    touched = this->current;
+    std::set<BString> wanted = full.combine();
+    touched.insert(wanted.begin(), wanted.end());
   }
-  for (auto item : leftover) {
-    BMessage request(B_DELETE_PROPERTY);
-    request.AddSpecifier("ReplicatedFeed", item);
-    this->db.SendMessage(&request);
+  BMessage update(B_SET_PROPERTY);
+  update.AddSpecifier("ReplicatedFeed");
+  for (const BString &feed : touched) {
+    bool wanted = incremental ? this->wanted(feed) : full.contains(feed);
+    if (wanted && this->current.insert(feed).second)
+      update.AddString("add", feed);
+    else if (!wanted && this->current.erase(feed) > 0)
+      update.AddString("remove", feed);
   }
+  if (update.HasString("add") || update.HasString("remove"))
+    this->db.SendMessage(&update);
   this->db.SendMessage('GCOK');
 }
@@ -1,9 +1,11 @@
 #ifndef SELECT_CONTACTS_H
 #define SELECT_CONTACTS_H
 
+#include "ContactGraph.h"
 #include <Handler.h>
 #include <Message.h>
 #include <Messenger.h>
+#include <map>
 #include <set>
 
 class SelectContacts : public BHandler {
@@ -13,10 +15,15 @@ public:
   void MessageReceived(BMessage *message) override;
 
 private:
+  ContactGraph *localGraph();
+  bool needsFlattened();
+  bool wanted(const BString &feed);
   void makeSelection(BMessage *graph);
   BMessenger db;
   BMessenger graph;
   std::set<BString> current;
+  std::map<BString, uint64> seenGeneration;
+  std::map<BString, ContactSelection> selections;
   bool fetching = false;
 };
 
@@ -5,11 +5,15 @@
 #include <Application.h>
 #include <Button.h>
 #include <Catalog.h>
+#include <CheckBox.h>
 #include <Clipboard.h>
 #include <ControlLook.h>
 #include <GroupLayout.h>
 #include <ListView.h>
 #include <LocaleRoster.h>
+#include <MenuField.h>
+#include <MenuItem.h>
+#include <PopUpMenu.h>
 #include <Screen.h>
 #include <ScrollView.h>
 #include <SeparatorView.h>
@@ -40,6 +44,17 @@ private:
   BButton *saveButton;
 };
 
+class StorageTab : public BView {
+public:
+  StorageTab(BRect contentFrame);
+  void AttachedToWindow();
+  void MessageReceived(BMessage *msg) override;
+
+private:
+  BPopUpMenu *profileMenu;
+  BCheckBox *compressBox;
+};
+
 class ServerEntry : public BListItem {
 public:
   ServerEntry(const BString &netAddress = "", const BString cypherkey = "");
@@ -201,6 +216,66 @@ void NetworkTab::MessageReceived(BMessage *message) {
   }
 }
 
+StorageTab::StorageTab(BRect contentFrame)
+    : BView(contentFrame, B_TRANSLATE("Storage"), B_FOLLOW_ALL_SIDES,
+            B_WILL_DRAW) {
+  this->AdoptSystemColors();
+}
+
+void StorageTab::AttachedToWindow() {
+  auto layout = new BGroupLayout(B_VERTICAL);
+  this->SetLayout(layout);
+  this->profileMenu = new BPopUpMenu(B_TRANSLATE("Profile"));
+  layout->AddView(new BMenuField(B_TRANSLATE("Database tuning"),
+                                 this->profileMenu));
+  this->compressBox = new BCheckBox(B_TRANSLATE("Compress message bodies"),
+                                    new BMessage('SCMP'));
+  this->compressBox->SetTarget(this);
+  layout->AddView(this->compressBox);
+  layout->AddItem(BSpaceLayoutItem::CreateGlue());
+  BMessage rq(B_GET_PROPERTY);
+  rq.AddSpecifier("StorageProfile");
+  BMessenger(be_app).SendMessage(&rq, BMessenger(this));
+  BMessage compress(B_GET_PROPERTY);
+  compress.AddSpecifier("CompressBodies");
+  BMessenger(be_app).SendMessage(&compress, BMessenger(this));
+}
+
+void StorageTab::MessageReceived(BMessage *message) {
+  switch (message->what) {
+  case 'SPRF': {
+    BMessage set(B_SET_PROPERTY);
+    set.AddString("data", message->GetString("profile", ""));
+    set.AddSpecifier("StorageProfile");
+    BMessenger(be_app).SendMessage(&set);
+  } break;
+  case 'SCMP': {
+    BMessage set(B_SET_PROPERTY);
+    set.AddBool("data", this->compressBox->Value() == B_CONTROL_ON);
+    set.AddSpecifier("CompressBodies");
+    BMessenger(be_app).SendMessage(&set);
+  } break;
+  case B_REPLY: {
+    if (bool compress; message->FindBool("result", &compress) == B_OK) {
+      this->compressBox->SetValue(compress ? B_CONTROL_ON : B_CONTROL_OFF);
+      break;
+    }
+    BString current = message->GetString("result", "");
+    BString name;
+    for (int32 i = 0; message->FindString("profiles", i, &name) == B_OK; i++) {
+      auto select = new BMessage('SPRF');
+      select->AddString("profile", name);
+      auto item = new BMenuItem(name, select);
+      item->SetTarget(this);
+      item->SetMarked(name == current);
+      this->profileMenu->AddItem(item);
+    }
+  } break;
+  default:
+    BView::MessageReceived(message);
+  }
+}
+
 void NetworkTab::clearDetails() {
   this->addrControl->SetText("");
   this->keyControl->SetText("");
@@ -297,6 +372,7 @@ SettingsWindow::SettingsWindow()
   BRect contentFrame = this->tabView->ContainerView()->Bounds();
   BView *networkTab = new NetworkTab(contentFrame);
   this->tabView->AddTab(networkTab);
+  this->tabView->AddTab(new StorageTab(contentFrame));
 }
 
 SettingsWindow::~SettingsWindow() {}
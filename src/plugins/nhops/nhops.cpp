@@ -1,8 +1,11 @@
 #include "ContactGraph.h"
+#include "Plugin.h"
 #include <set>
 
 extern "C" const char *pluginName() { return "n-hops"; }
 
+extern "C" int32 pluginABI() { return HABITAT_PLUGIN_ABI; }
+
 extern "C" status_t selectContacts(ContactSelection *target,
                                    std::set<BString> *roots, BMessage *config,
                                    BMessage *graph) {
@@ -62,6 +65,55 @@ extern "C" status_t selectContacts(ContactSelection *target,
   return B_OK;
 }
 
+namespace {
+// What the last selection was worked out from.
+HopDistances distances;
+std::set<BString> lastRoots;
+int32 lastHops = -1;
+} // namespace
+
+extern "C" status_t selectContactsView(ContactSelection *target,
+                                       const std::set<BString> *roots,
+                                       BMessage *config,
+                                       const GraphView *view) {
+  int32 hops;
+  if (status_t status = config->FindInt32("hops", &hops); status != B_OK)
+    return status;
+  const CompactGraph &graph = *view->graph;
+  std::vector<CompactGraph::node_id> changed;
+  if (view->changes == NULL || *roots != lastRoots || hops != lastHops ||
+      target->own != *roots) {
+    std::vector<CompactGraph::node_id> rootIDs;
+    for (const BString &root : *roots) {
+      if (CompactGraph::node_id id; graph.find(root, &id))
+        rootIDs.push_back(id);
+    }
+    distances.reset(graph, rootIDs, hops, &changed);
+    lastRoots = *roots;
+    lastHops = hops;
+    target->changed.insert(target->selected.begin(), target->selected.end());
+    target->changed.insert(target->blocked.begin(), target->blocked.end());
+    target->changed.insert(target->own.begin(), target->own.end());
+    target->changed.insert(roots->begin(), roots->end());
+    target->selected.clear();
+    target->blocked.clear();
+    target->own = *roots;
+  } else {
+    distances.update(graph, view->changes, view->changeCount, &changed);
+  }
+  for (CompactGraph::node_id node : changed) {
+    const BString &name = graph.name(node);
+    bool moved = distances.selected(node)
+                     ? target->selected.insert(name).second
+                     : target->selected.erase(name) > 0;
+    moved |= distances.blocked(node) ? target->blocked.insert(name).second
+                                     : target->blocked.erase(name) > 0;
+    if (moved)
+      target->changed.insert(name);
+  }
+  return B_OK;
+}
+
 extern "C" status_t defaultConfig(BMessage *target) {
   return target->AddInt32("hops", 2);
 }
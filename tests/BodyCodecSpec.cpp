@@ -0,0 +1,166 @@
+#include "Base64.h"
+#include "BodyCodec.h"
+#include "MigrateDB.h"
+#include <catch2/catch_all.hpp>
+#include <random>
+
+namespace {
+BString randomLink(std::minstd_rand &rng, const char *sigil,
+                   const char *suffix) {
+  unsigned char raw[32];
+  for (auto &byte : raw)
+    byte = rng();
+  BString result(sigil);
+  result << base64::encode(raw, sizeof(raw), base64::STANDARD) << suffix;
+  return result;
+}
+
+// Something shaped like a replicated SSB message, with a few hundred
+// authors linking to each other.
+BMessage syntheticMessage(std::minstd_rand &rng, int64 i) {
+  std::minstd_rand authorRng(i % 300 + 1);
+  BMessage message;
+  message.AddString("previous", randomLink(rng, "%", ".sha256"));
+  message.AddString("author", randomLink(authorRng, "@", ".ed25519"));
+  message.AddDouble("sequence", i / 300 + 1);
+  message.AddDouble("timestamp", 1600000000000.0 + i * 60000);
+  message.AddString("hash", "sha256");
+  BMessage content;
+  switch (i % 3) {
+  case 0: {
+    content.AddString("type", "post");
+    BString text("Message number ");
+    text << i << " on the synthetic feed, replying to an earlier one.";
+    content.AddString("text", text);
+    content.AddString("root", randomLink(rng, "%", ".sha256"));
+  } break;
+  case 1: {
+    content.AddString("type", "vote");
+    BMessage vote;
+    vote.AddString("link", randomLink(rng, "%", ".sha256"));
+    vote.AddDouble("value", 1);
+    vote.AddString("expression", "Like");
+    content.AddMessage("vote", &vote);
+  } break;
+  default:
+    content.AddString("type", "contact");
+    content.AddString("contact", randomLink(rng, "@", ".ed25519"));
+    content.AddBool("following", true);
+  }
+  message.AddMessage("content", &content);
+  message.AddString("signature", randomLink(rng, "", ".sig.ed25519"));
+  return message;
+}
+
+sqlite3 *filledDatabase(int64 count, bool compress) {
+  sqlite3 *database;
+  sqlite3_open(":memory:", &database);
+  prepareDatabase(database);
+  body::setCompressing(compress);
+  std::minstd_rand rng(1);
+  sqlite3_exec(database, "BEGIN TRANSACTION", NULL, NULL, NULL);
+  sqlite3_stmt *insert;
+  sqlite3_prepare_v2(database,
+                     "INSERT INTO messages(cypherkey, author, sequence, "
+                     "timestamp, body) VALUES (?, '', 0, 0, ?)",
+                     -1, &insert, NULL);
+  for (int64 i = 0; i < count; i++) {
+    BString key("%");
+    key << i << ".sha256";
+    char *buffer;
+    size_t size;
+    body::flatten(syntheticMessage(rng, i), &buffer, &size);
+    sqlite3_bind_text(insert, 1, key.String(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_blob64(insert, 2, buffer, size,
+                        [](void *arg) { delete[] (char *)arg; });
+    sqlite3_step(insert);
+    sqlite3_reset(insert);
+  }
+  sqlite3_finalize(insert);
+  sqlite3_exec(database, "END TRANSACTION", NULL, NULL, NULL);
+  body::setCompressing(false);
+  return database;
+}
+
+int64 databaseSize(sqlite3 *database) {
+  int64 pages = 0;
+  int64 pageSize = 0;
+  sqlite3_stmt *query;
+  sqlite3_prepare_v2(database, "PRAGMA page_count", -1, &query, NULL);
+  if (sqlite3_step(query) == SQLITE_ROW)
+    pages = sqlite3_column_int64(query, 0);
+  sqlite3_finalize(query);
+  sqlite3_prepare_v2(database, "PRAGMA page_size", -1, &query, NULL);
+  if (sqlite3_step(query) == SQLITE_ROW)
+    pageSize = sqlite3_column_int64(query, 0);
+  sqlite3_finalize(query);
+  return pages * pageSize;
+}
+
+int64 readAll(sqlite3 *database) {
+  int64 count = 0;
+  sqlite3_stmt *query;
+  sqlite3_prepare_v2(database, "SELECT body FROM messages", -1, &query, NULL);
+  while (sqlite3_step(query) == SQLITE_ROW) {
+    BMessage message;
+    if (body::unflatten(&message, sqlite3_column_blob(query, 0),
+                        sqlite3_column_bytes(query, 0)) == B_OK) {
+      count++;
+    }
+  }
+  sqlite3_finalize(query);
+  return count;
+}
+} // namespace
+
+TEST_CASE("Compressed bodies read back unchanged", "[BodyCodec]") {
+  sqlite3 *database = filledDatabase(2000, false);
+  REQUIRE(body::train(database) == B_OK);
+  std::minstd_rand rng(2);
+  BMessage original = syntheticMessage(rng, 12345);
+  body::setCompressing(true);
+  char *packed;
+  size_t packedSize;
+  REQUIRE(body::flatten(original, &packed, &packedSize) == B_OK);
+  body::setCompressing(false);
+  REQUIRE(packedSize < (size_t)original.FlattenedSize());
+  BMessage restored;
+  REQUIRE(body::unflatten(&restored, packed, packedSize) == B_OK);
+  delete[] packed;
+  BString text;
+  BMessage content;
+  REQUIRE(restored.FindMessage("content", &content) == B_OK);
+  REQUIRE(content.FindString("text", &text) == B_OK);
+  REQUIRE(text == "Message number 12345 on the synthetic feed, replying to an "
+                  "earlier one.");
+
+  int64 before = databaseSize(database);
+  int64 cursor = 0;
+  while (body::recompress(database, &cursor, 256) == B_OK)
+    ;
+  sqlite3_exec(database, "VACUUM", NULL, NULL, NULL);
+  CHECK(databaseSize(database) < before);
+  CHECK(readAll(database) == 2000);
+  sqlite3_close(database);
+}
+
+TEST_CASE("Body storage size and throughput", "[.][benchmark][BodyCodec]") {
+  const int64 count = 100000;
+  sqlite3 *raw = filledDatabase(count, false);
+  REQUIRE(body::train(raw) == B_OK);
+  sqlite3 *compressed = filledDatabase(count, true);
+  WARN("Uncompressed: " << databaseSize(raw) << " bytes; compressed: "
+                        << databaseSize(compressed) << " bytes");
+  BENCHMARK("Write 10000 uncompressed") {
+    sqlite3 *database = filledDatabase(10000, false);
+    sqlite3_close(database);
+  };
+  BENCHMARK("Write 10000 compressed") {
+    sqlite3 *database = filledDatabase(10000, true);
+    sqlite3_close(database);
+  };
+  BENCHMARK("Read uncompressed") { return readAll(raw); };
+  BENCHMARK("Read compressed") { return readAll(compressed); };
+  sqlite3_close(raw);
+  sqlite3_close(compressed);
+}
@@ -0,0 +1,158 @@
+#include "ContactGraph.h"
+#include <catch2/catch_all.hpp>
+#include <random>
+
+namespace {
+std::set<BString> following(const CompactGraph &graph,
+                            CompactGraph::node_id from) {
+  std::set<BString> result;
+  graph.forEachOut(from, [&](CompactGraph::node_id to, uint8 flags) {
+    if (flags & CompactGraph::kFollowing)
+      result.insert(graph.name(to));
+  });
+  return result;
+}
+
+std::set<BString> followers(const CompactGraph &graph,
+                            CompactGraph::node_id to) {
+  std::set<BString> result;
+  graph.forEachIn(to, [&](CompactGraph::node_id from, uint8 flags) {
+    if (flags & CompactGraph::kFollowing)
+      result.insert(graph.name(from));
+  });
+  return result;
+}
+
+// Flips one flag on a random edge, recording it if that changed anything.
+void churn(CompactGraph &graph, std::minstd_rand &rng, int64 &sequence,
+           CompactGraph::node_id fromRange, std::vector<GraphChange> *changes) {
+  CompactGraph::node_id from = rng() % fromRange;
+  CompactGraph::node_id to = rng() % graph.size();
+  uint8 flag = rng() % 4 == 0 ? CompactGraph::kBlocking
+                              : CompactGraph::kFollowing;
+  uint8 before = graph.flags(from, to);
+  graph.update(from, to, flag, rng() % 2 == 0, sequence++);
+  if (uint8 after = graph.flags(from, to); after != before)
+    changes->push_back({from, to, before, after});
+}
+
+CompactGraph randomGraph(std::minstd_rand &rng, int32 feeds, int32 follows,
+                         int64 &sequence) {
+  CompactGraph graph;
+  for (int32 i = 0; i < feeds; i++) {
+    BString feed("@");
+    feed << i;
+    graph.intern(feed);
+  }
+  for (int32 i = 0; i < follows; i++) {
+    graph.update(rng() % feeds, rng() % feeds, CompactGraph::kFollowing, true,
+                 sequence++);
+  }
+  return graph;
+}
+} // namespace
+
+TEST_CASE("Compact graph edges take the newest update", "[ContactGraph]") {
+  CompactGraph graph;
+  auto a = graph.intern("@a");
+  auto b = graph.intern("@b");
+  auto c = graph.intern("@c");
+  CHECK(graph.intern("@a") == a);
+  CHECK(graph.update(a, b, CompactGraph::kFollowing, true, 5));
+  CHECK(graph.update(a, c, CompactGraph::kFollowing, true, 6));
+  CHECK(graph.update(c, b, CompactGraph::kFollowing, true, 1));
+  CHECK_FALSE(graph.update(a, b, CompactGraph::kFollowing, false, 4));
+  CHECK(graph.update(a, b, CompactGraph::kBlocking, true, 3));
+  CHECK(graph.flags(a, b) ==
+        (CompactGraph::kFollowing | CompactGraph::kBlocking));
+  CHECK(following(graph, a) == std::set<BString>{"@b", "@c"});
+  CHECK(followers(graph, b) == std::set<BString>{"@a", "@c"});
+
+  graph.compact();
+  auto d = graph.intern("@d");
+  CHECK(graph.update(a, c, CompactGraph::kFollowing, false, 7));
+  CHECK(graph.update(d, b, CompactGraph::kFollowing, true, 1));
+  CHECK(following(graph, a) == std::set<BString>{"@b"});
+  CHECK(followers(graph, b) == std::set<BString>{"@a", "@c", "@d"});
+  CHECK(graph.flags(b, a) == 0);
+  CompactGraph::node_id found;
+  REQUIRE(graph.find("@d", &found));
+  CHECK(found == d);
+  CHECK_FALSE(graph.find("@e", &found));
+}
+
+TEST_CASE("Compact graph survives rebuilding its index", "[ContactGraph]") {
+  CompactGraph graph;
+  for (int32 i = 0; i < 20000; i++) {
+    BString from("@");
+    from << i % 100;
+    BString to("@");
+    to << (i * 7919) % 5000;
+    graph.update(graph.intern(from), graph.intern(to),
+                 CompactGraph::kFollowing, true, i);
+  }
+  size_t outgoing = 0;
+  size_t incoming = 0;
+  for (CompactGraph::node_id node = 0; node < graph.size(); node++) {
+    graph.forEachOut(node, [&](CompactGraph::node_id, uint8) { outgoing++; });
+    graph.forEachIn(node, [&](CompactGraph::node_id, uint8) { incoming++; });
+  }
+  CHECK(outgoing == graph.edgeCount());
+  CHECK(incoming == graph.edgeCount());
+}
+
+TEST_CASE("Hop distances stay right as edges change", "[ContactGraph]") {
+  std::minstd_rand rng(7);
+  int64 sequence = 1;
+  CompactGraph graph = randomGraph(rng, 300, 900, sequence);
+  std::vector<CompactGraph::node_id> roots{0, 1};
+  HopDistances incremental;
+  std::vector<CompactGraph::node_id> changed;
+  incremental.reset(graph, roots, 3, &changed);
+  CHECK(changed.size() == graph.size());
+  for (int32 step = 0; step < 2000; step++) {
+    std::vector<GraphChange> changes;
+    // Some of the changes come from the roots, so blocks matter.
+    for (int32 i = rng() % 4; i >= 0; i--)
+      churn(graph, rng, sequence, i == 0 ? 2 : graph.size(), &changes);
+    std::vector<std::pair<bool, bool>> before;
+    for (CompactGraph::node_id node = 0; node < graph.size(); node++)
+      before.push_back({incremental.selected(node), incremental.blocked(node)});
+    changed.clear();
+    incremental.update(graph, changes.data(), changes.size(), &changed);
+
+    HopDistances full;
+    std::vector<CompactGraph::node_id> all;
+    full.reset(graph, roots, 3, &all);
+    std::set<CompactGraph::node_id> reported(changed.begin(), changed.end());
+    for (CompactGraph::node_id node = 0; node < graph.size(); node++) {
+      REQUIRE(incremental.distance(node) == full.distance(node));
+      REQUIRE(incremental.blocked(node) == full.blocked(node));
+      bool moved = before[node] != std::make_pair(incremental.selected(node),
+                                                  incremental.blocked(node));
+      REQUIRE(moved == (reported.count(node) > 0));
+    }
+  }
+}
+
+TEST_CASE("Hop distances under follow churn",
+          "[.][benchmark][ContactGraph]") {
+  std::minstd_rand rng(7);
+  int64 sequence = 1;
+  CompactGraph graph = randomGraph(rng, 50000, 1500000, sequence);
+  graph.compact();
+  std::vector<CompactGraph::node_id> roots{0};
+  HopDistances distances;
+  std::vector<CompactGraph::node_id> changed;
+  BENCHMARK("Search from scratch") {
+    distances.reset(graph, roots, 2, &changed);
+    return changed.size();
+  };
+  BENCHMARK("One follow or block changes") {
+    std::vector<GraphChange> changes;
+    churn(graph, rng, sequence, graph.size(), &changes);
+    changed.clear();
+    distances.update(graph, changes.data(), changes.size(), &changed);
+    return changed.size();
+  };
+}
@@ -18,3 +18,50 @@ TEST_CASE("Correctly decodes EBT note values", "[EBT]") {
   EX(3, true, false, 1);
 #undef EX
 }
+
+TEST_CASE("Outbound queue stays bounded for a stalled peer", "[EBT]") {
+  OutQueue queue;
+  BString author("@stalled.ed25519");
+  for (uint64 available = 1; available <= 100000; available++)
+    queue.offer(author, 1, available);
+  REQUIRE(queue.cursorCount() == 1);
+  REQUIRE(queue.stagedCount() == 0);
+  for (uint64 sequence = 1; sequence <= EBT_OUT_BATCH * 2; sequence++) {
+    BMessage message;
+    message.AddString("author", author);
+    message.AddDouble("sequence", sequence);
+    status_t result = queue.stage(message);
+    if (sequence <= EBT_OUT_BATCH)
+      REQUIRE(result == B_OK);
+    else
+      REQUIRE(result == B_BUSY);
+  }
+  REQUIRE(queue.stagedCount() == EBT_OUT_BATCH);
+  BString picked;
+  uint64 next;
+  REQUIRE(queue.pick(0, &picked, &next));
+  REQUIRE(picked == author);
+  REQUIRE(next == EBT_OUT_BATCH + 1);
+  queue.offer(author, 1, 200000);
+  REQUIRE(queue.cursorCount() == 1);
+  REQUIRE(queue.stagedCount() == EBT_OUT_BATCH);
+  queue.drop(author);
+  REQUIRE(queue.empty());
+}
+
+TEST_CASE("Outbound cursors offered again keep their new place", "[EBT]") {
+  OutQueue queue;
+  BString author("@rewound.ed25519");
+  queue.offer(author, 40, 100);
+  // The peer rewinds while sequence 40 onwards is being fetched.
+  queue.offer(author, 3, 100);
+  BMessage message;
+  message.AddString("author", author);
+  message.AddDouble("sequence", 40);
+  REQUIRE(queue.stage(message) == B_MISMATCHED_VALUES);
+  uint64 next;
+  REQUIRE(queue.find(author, &next));
+  REQUIRE(next == 3);
+  queue.drop(author);
+  REQUIRE_FALSE(queue.find(author, &next));
+}
@@ -0,0 +1,271 @@
+#include "MigrateDB.h"
+#include "Post.h"
+#include <catch2/catch_all.hpp>
+#include <functional>
+#include <random>
+#include <vector>
+
+namespace {
+// Every shape of Post specifier that the application and its plugins send,
+// with the index it must be answered from, both as a bulk query and paged.
+struct QueryShape {
+  const char *name;
+  std::function<void(BMessage *)> fill;
+  const char *bulkIndex;
+  const char *pagedIndex;
+};
+
+void threeTypes(BMessage *specifier) {
+  specifier->AddString("type", "post");
+  specifier->AddString("type", "vote");
+  specifier->AddString("type", "contact");
+}
+
+const QueryShape queryShapes[] = {
+    {"Post by key", [](BMessage *s) { s->AddString("cypherkey", "%a.sha256"); },
+     "sqlite_autoindex_messages_1", "sqlite_autoindex_messages_1"},
+    {"Day in the main window",
+     [](BMessage *s) {
+       threeTypes(s);
+       s->AddInt64("earliest", 0);
+       s->AddInt64("latest", 86400000);
+     },
+     "typetime", "msgtime"},
+    {"Several types", threeTypes, "typetime", "msgtime"},
+    {"One type", [](BMessage *s) { s->AddString("type", "post"); },
+     "typetime", "typetime"},
+    {"Unprocessed profiles",
+     [](BMessage *s) {
+       s->AddString("type", "about");
+       s->AddBool("dregs", true);
+       s->AddString("specialCase", "selfReferent");
+     },
+     "protime", "protime"},
+    {"Unprocessed contacts",
+     [](BMessage *s) {
+       s->AddString("type", "contact");
+       s->AddBool("dregs", true);
+     },
+     "protime", "protime"},
+    {"Author", [](BMessage *s) { s->AddString("author", "@a.ed25519"); },
+     "authortypetime", "authortime"},
+    {"Author and type",
+     [](BMessage *s) {
+       s->AddString("author", "@a.ed25519");
+       s->AddString("type", "post");
+     },
+     "authortypetime", "authortypetime"},
+    {"Author and several types",
+     [](BMessage *s) {
+       s->AddString("author", "@a.ed25519");
+       threeTypes(s);
+     },
+     "authortypetime", "authortime"},
+    {"Author over a day",
+     [](BMessage *s) {
+       s->AddString("author", "@a.ed25519");
+       s->AddInt64("earliest", 0);
+       s->AddInt64("latest", 86400000);
+     },
+     "authortime", "authortime"},
+    {"Thread", [](BMessage *s) { s->AddString("context", "%a.sha256"); },
+     "ctxtime", "ctxtime"},
+    {"Thread and type",
+     [](BMessage *s) {
+       s->AddString("context", "%a.sha256");
+       s->AddString("type", "post");
+     },
+     "ctxtype", "ctxtime"},
+    {"Thread and several types",
+     [](BMessage *s) {
+       s->AddString("context", "%a.sha256");
+       threeTypes(s);
+     },
+     "ctxtype", "ctxtime"},
+};
+
+BString queryPlan(sqlite3 *database, sqlite3_stmt *query) {
+  BString sql("EXPLAIN QUERY PLAN ");
+  sql << sqlite3_sql(query);
+  sqlite3_stmt *explain;
+  BString plan;
+  if (sqlite3_prepare_v2(database, sql.String(), -1, &explain, NULL) !=
+      SQLITE_OK) {
+    return plan;
+  }
+  while (sqlite3_step(explain) == SQLITE_ROW)
+    plan << (const char *)sqlite3_column_text(explain, 3) << '\n';
+  sqlite3_finalize(explain);
+  return plan;
+}
+
+sqlite3 *emptyDatabase() {
+  sqlite3 *database;
+  sqlite3_open(":memory:", &database);
+  prepareDatabase(database);
+  return database;
+}
+} // namespace
+
+TEST_CASE("Every query shape is answered from an index", "[Post]") {
+  sqlite3 *database = emptyDatabase();
+  for (auto &shape : queryShapes) {
+    BMessage specifier('CPLX');
+    shape.fill(&specifier);
+    for (bool paged : {false, true}) {
+      INFO(shape.name << (paged ? " (paged)" : " (bulk)"));
+      sqlite3_stmt *query = post::prepareQuery(database, specifier, paged);
+      REQUIRE(query != NULL);
+      BString plan = queryPlan(database, query);
+      INFO(plan.String());
+      BString index("USING INDEX ");
+      index << (paged ? shape.pagedIndex : shape.bulkIndex) << ' ';
+      CHECK(plan.FindFirst(index) >= 0);
+      CHECK(plan.FindFirst("SCAN messages") < 0);
+      if (paged)
+        CHECK(plan.FindFirst("TEMP B-TREE") < 0);
+      sqlite3_finalize(query);
+    }
+  }
+  sqlite3_close(database);
+}
+
+TEST_CASE("Query shapes over a million messages", "[.][benchmark][Post]") {
+  sqlite3 *database = emptyDatabase();
+  {
+    const char *types[] = {"post", "vote", "contact", "about"};
+    sqlite3_exec(database, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    sqlite3_stmt *insert;
+    sqlite3_prepare_v2(database,
+                       "INSERT INTO messages(cypherkey, author, sequence, "
+                       "timestamp, type, context, body, processed) "
+                       "VALUES (?, ?, ?, ?, ?, ?, zeroblob(512), ?)",
+                       -1, &insert, NULL);
+    for (int64 i = 0; i < 1000000; i++) {
+      BString key("%");
+      key << i << ".sha256";
+      BString author("@");
+      author << i % 5000 << ".ed25519";
+      BString context("%");
+      context << i % 20000 << ".sha256";
+      sqlite3_bind_text(insert, 1, key.String(), -1, SQLITE_TRANSIENT);
+      sqlite3_bind_text(insert, 2, author.String(), -1, SQLITE_TRANSIENT);
+      sqlite3_bind_int64(insert, 3, i / 5000 + 1);
+      sqlite3_bind_int64(insert, 4, i * 60000);
+      sqlite3_bind_text(insert, 5, types[i % 4], -1, SQLITE_STATIC);
+      sqlite3_bind_text(insert, 6, context.String(), -1, SQLITE_TRANSIENT);
+      sqlite3_bind_int(insert, 7, i % 100 != 0);
+      sqlite3_step(insert);
+      sqlite3_reset(insert);
+    }
+    sqlite3_finalize(insert);
+    sqlite3_exec(database, "END TRANSACTION", NULL, NULL, NULL);
+    sqlite3_exec(database, "ANALYZE", NULL, NULL, NULL);
+  }
+  for (auto &shape : queryShapes) {
+    BMessage specifier('CPLX');
+    shape.fill(&specifier);
+    sqlite3_stmt *query = post::prepareQuery(database, specifier, true);
+    int params = sqlite3_bind_parameter_count(query);
+    sqlite3_bind_int64(query, params - 2, INT64_MAX);
+    BENCHMARK(shape.name) {
+      sqlite3_bind_int64(query, params - 1, INT64_MIN);
+      sqlite3_bind_int64(query, params, INT64_MIN);
+      int rows = 0;
+      while (sqlite3_step(query) == SQLITE_ROW)
+        rows++;
+      sqlite3_reset(query);
+      return rows;
+    };
+    sqlite3_finalize(query);
+  }
+  sqlite3_close(database);
+}
+
+namespace {
+void addPost(sqlite3 *database, int64 rowid, const char *type,
+             const BString &text) {
+  sqlite3_stmt *insert;
+  sqlite3_prepare_v2(database,
+                     "INSERT INTO messages(rowid, cypherkey, author, "
+                     "sequence, timestamp, type) VALUES (?, ?, '@a', ?, ?, ?)",
+                     -1, &insert, NULL);
+  BString key("%");
+  key << rowid << ".sha256";
+  sqlite3_bind_int64(insert, 1, rowid);
+  sqlite3_bind_text(insert, 2, key.String(), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_int64(insert, 3, rowid);
+  sqlite3_bind_int64(insert, 4, rowid * 60000);
+  sqlite3_bind_text(insert, 5, type, -1, SQLITE_STATIC);
+  sqlite3_step(insert);
+  sqlite3_finalize(insert);
+  sqlite3_prepare_v2(database,
+                     "INSERT INTO post_text(rowid, text) VALUES (?, ?)", -1,
+                     &insert, NULL);
+  sqlite3_bind_int64(insert, 1, rowid);
+  sqlite3_bind_text(insert, 2, text.String(), -1, SQLITE_TRANSIENT);
+  sqlite3_step(insert);
+  sqlite3_finalize(insert);
+}
+
+std::vector<int64> searchRows(sqlite3 *database, const BMessage &specifier) {
+  std::vector<int64> rows;
+  sqlite3_stmt *query = post::prepareQuery(database, specifier);
+  while (sqlite3_step(query) == SQLITE_ROW)
+    rows.push_back(sqlite3_column_int64(query, 4));
+  sqlite3_finalize(query);
+  return rows;
+}
+} // namespace
+
+TEST_CASE("Searches come back best match first", "[Post]") {
+  sqlite3 *database = emptyDatabase();
+  addPost(database, 1, "post", "Hello world, this is a long post about a café");
+  addPost(database, 2, "post", "Cafe");
+  addPost(database, 3, "post", "Nothing to see here");
+  addPost(database, 4, "vote", "cafe \"quoted\"");
+  BMessage specifier('CPLX');
+  specifier.AddString("search", "cafe");
+  CHECK(searchRows(database, specifier) == std::vector<int64>{2, 4, 1});
+  specifier.AddString("type", "post");
+  CHECK(searchRows(database, specifier) == std::vector<int64>{2, 1});
+  BMessage quoted('CPLX');
+  quoted.AddString("search", "\"quoted");
+  CHECK(searchRows(database, quoted) == std::vector<int64>{4});
+  sqlite3_exec(database, "DELETE FROM messages WHERE rowid = 2", NULL, NULL,
+               NULL);
+  CHECK(searchRows(database, specifier) == std::vector<int64>{1});
+  sqlite3_close(database);
+}
+
+TEST_CASE("Search over a million posts", "[.][benchmark][Post]") {
+  sqlite3 *database = emptyDatabase();
+  {
+    const char *words[] = {"habitat", "scuttlebutt", "gossip", "feed",
+                           "haiku",   "pub",         "room",   "blob",
+                           "thread",  "reply",       "follow", "block"};
+    std::minstd_rand rng(1);
+    sqlite3_exec(database, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    for (int64 i = 1; i <= 1000000; i++) {
+      BString text;
+      for (int j = 0; j < 20; j++)
+        text << words[rng() % 12] << (rng() % 50) << ' ';
+      addPost(database, i, "post", text);
+    }
+    sqlite3_exec(database, "END TRANSACTION", NULL, NULL, NULL);
+  }
+  for (const char *terms :
+       {"haiku7", "habitat3 gossip12", "blob49 room0 pub1"}) {
+    BMessage specifier('CPLX');
+    specifier.AddString("search", terms);
+    BENCHMARK(terms) {
+      sqlite3_stmt *query = post::prepareQuery(database, specifier);
+      int rows = 0;
+      while (rows < 50 && sqlite3_step(query) == SQLITE_ROW)
+        rows++;
+      sqlite3_finalize(query);
+      return rows;
+    };
+  }
+  sqlite3_close(database);
+}
@@ -0,0 +1,59 @@
+#include "MigrateDB.h"
+#include <catch2/catch_all.hpp>
+#include <set>
+
+namespace {
+void setName(sqlite3 *database, const char *author, const char *name) {
+  BString folded(name);
+  folded.ToLower();
+  sqlite3_stmt *upsert;
+  sqlite3_prepare_v2(database,
+                     "INSERT INTO profile_names(author, name, folded) "
+                     "VALUES(?, ?, ?) ON CONFLICT(author) DO UPDATE "
+                     "SET name = excluded.name, folded = excluded.folded",
+                     -1, &upsert, NULL);
+  sqlite3_bind_text(upsert, 1, author, -1, SQLITE_STATIC);
+  sqlite3_bind_text(upsert, 2, name, -1, SQLITE_STATIC);
+  sqlite3_bind_text(upsert, 3, folded.String(), -1, SQLITE_TRANSIENT);
+  sqlite3_step(upsert);
+  sqlite3_finalize(upsert);
+}
+
+std::set<BString> matching(sqlite3 *database, const char *text) {
+  std::set<BString> result;
+  sqlite3_stmt *query;
+  sqlite3_prepare_v2(database,
+                     "SELECT profile_names.author "
+                     "FROM profile_trigrams JOIN profile_names "
+                     "ON profile_names.rowid = profile_trigrams.rowid "
+                     "WHERE profile_trigrams MATCH ?",
+                     -1, &query, NULL);
+  BString phrase("\"");
+  phrase << text << "\"";
+  sqlite3_bind_text(query, 1, phrase.String(), -1, SQLITE_TRANSIENT);
+  while (sqlite3_step(query) == SQLITE_ROW)
+    result.insert((const char *)sqlite3_column_text(query, 0));
+  sqlite3_finalize(query);
+  return result;
+}
+} // namespace
+
+TEST_CASE("Profile names are found by any part of them", "[MigrateDB]") {
+  sqlite3 *database;
+  sqlite3_open(":memory:", &database);
+  REQUIRE(prepareDatabase(database) == B_OK);
+  setName(database, "@a", "Alice Smith");
+  setName(database, "@b", "Bob");
+  setName(database, "@c", "Carol Smithers");
+  CHECK(matching(database, "smith") == std::set<BString>{"@a", "@c"});
+  CHECK(matching(database, "SMI") == std::set<BString>{"@a", "@c"});
+  CHECK(matching(database, "bob") == std::set<BString>{"@b"});
+
+  setName(database, "@b", "Roberta");
+  CHECK(matching(database, "bob").empty());
+  CHECK(matching(database, "bert") == std::set<BString>{"@b"});
+  sqlite3_exec(database, "DELETE FROM profile_names WHERE author = '@a'",
+               NULL, NULL, NULL);
+  CHECK(matching(database, "smith") == std::set<BString>{"@c"});
+  sqlite3_close(database);
+}
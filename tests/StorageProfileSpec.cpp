@@ -0,0 +1,96 @@
+#include "MigrateDB.h"
+#include <catch2/catch_all.hpp>
+#include <chrono>
+#include <filesystem>
+
+namespace {
+int64 pragmaValue(sqlite3 *database, const char *pragma) {
+  BString sql("PRAGMA ");
+  sql << pragma;
+  sqlite3_stmt *query;
+  int64 result = 0;
+  sqlite3_prepare_v2(database, sql.String(), -1, &query, NULL);
+  if (sqlite3_step(query) == SQLITE_ROW)
+    result = sqlite3_column_int64(query, 0);
+  sqlite3_finalize(query);
+  return result;
+}
+
+// Commits one message at a time, as the database looper does while working
+// through its backlog, checkpointing whenever the profile says to.
+double ingestRate(const StorageProfile &profile, int64 count) {
+  auto path = std::filesystem::temp_directory_path() / "habitat-ingest.db";
+  std::filesystem::remove(path);
+  sqlite3 *database;
+  sqlite3_open(path.c_str(), &database);
+  prepareDatabase(database);
+  sqlite3_exec(database, "PRAGMA journal_mode = WAL", NULL, NULL, NULL);
+  applyStorageProfile(database, profile, true);
+  int walPages = 0;
+  sqlite3_wal_hook(
+      database,
+      [](void *arg, sqlite3 *, const char *, int pages) {
+        *(int *)arg = pages;
+        return SQLITE_OK;
+      },
+      &walPages);
+  sqlite3_stmt *insert;
+  sqlite3_prepare_v2(database,
+                     "INSERT INTO messages(cypherkey, author, sequence, "
+                     "timestamp, type, body) "
+                     "VALUES (?, ?, ?, ?, 'post', zeroblob(600))",
+                     -1, &insert, NULL);
+  auto start = std::chrono::steady_clock::now();
+  for (int64 i = 0; i < count; i++) {
+    BString key("%");
+    key << i << ".sha256";
+    BString author("@");
+    author << i % 300 << ".ed25519";
+    sqlite3_exec(database, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    sqlite3_bind_text(insert, 1, key.String(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(insert, 2, author.String(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(insert, 3, i / 300 + 1);
+    sqlite3_bind_int64(insert, 4, i * 1000);
+    sqlite3_step(insert);
+    sqlite3_reset(insert);
+    sqlite3_exec(database, "END TRANSACTION", NULL, NULL, NULL);
+    if (walPages >= profile.checkpointPages) {
+      sqlite3_wal_checkpoint_v2(database, NULL, SQLITE_CHECKPOINT_PASSIVE,
+                                NULL, NULL);
+      walPages = 0;
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  sqlite3_finalize(insert);
+  sqlite3_close(database);
+  std::filesystem::remove(path);
+  std::filesystem::remove(path.string() + "-wal");
+  std::filesystem::remove(path.string() + "-shm");
+  return count / elapsed.count();
+}
+} // namespace
+
+TEST_CASE("Storage profiles are applied to connections", "[MigrateDB]") {
+  CHECK(BString(storageProfile("pub").name) == "pub");
+  CHECK(BString(storageProfile("nonsense").name) == storageProfiles[0].name);
+  CHECK(BString(storageProfile(NULL).name) == storageProfiles[0].name);
+  sqlite3 *database;
+  sqlite3_open(":memory:", &database);
+  auto &profile = storageProfile("bulk-import");
+  applyStorageProfile(database, profile, true);
+  CHECK(pragmaValue(database, "cache_size") == -profile.cacheKiB);
+  CHECK(pragmaValue(database, "synchronous") == profile.synchronous);
+  CHECK(pragmaValue(database, "temp_store") == profile.tempStore);
+  applyStorageProfile(database, profile, false);
+  CHECK(pragmaValue(database, "cache_size") == -profile.cacheKiB / 4);
+  sqlite3_close(database);
+}
+
+TEST_CASE("Ingest rate under each storage profile",
+          "[.][benchmark][MigrateDB]") {
+  for (auto profile = storageProfiles; profile->name != NULL; profile++) {
+    WARN(profile->name << ": " << (int64)ingestRate(*profile, 20000)
+                       << " messages per second");
+  }
+}
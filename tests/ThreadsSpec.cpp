@@ -0,0 +1,88 @@
+#include "MigrateDB.h"
+#include <catch2/catch_all.hpp>
+
+namespace {
+struct Thread {
+  int64 replies = 0;
+  int64 participants = 0;
+  int64 lastActivity = 0;
+};
+
+Thread thread(sqlite3 *database, const char *root) {
+  Thread result;
+  sqlite3_stmt *query;
+  sqlite3_prepare_v2(database,
+                     "SELECT replies, participants, lastActivity FROM threads "
+                     "WHERE root = ?",
+                     -1, &query, NULL);
+  sqlite3_bind_text(query, 1, root, -1, SQLITE_STATIC);
+  if (sqlite3_step(query) == SQLITE_ROW) {
+    result.replies = sqlite3_column_int64(query, 0);
+    result.participants = sqlite3_column_int64(query, 1);
+    result.lastActivity = sqlite3_column_int64(query, 2);
+  }
+  sqlite3_finalize(query);
+  return result;
+}
+
+void insert(sqlite3 *database, const char *cypherkey, const char *author,
+            int64 timestamp, const char *context,
+            const char *type = "post") {
+  sqlite3_stmt *insert;
+  sqlite3_prepare_v2(database,
+                     "INSERT INTO messages(cypherkey, author, sequence, "
+                     "timestamp, context, type) VALUES (?, ?, 1, ?, ?, ?)",
+                     -1, &insert, NULL);
+  sqlite3_bind_text(insert, 1, cypherkey, -1, SQLITE_STATIC);
+  sqlite3_bind_text(insert, 2, author, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(insert, 3, timestamp);
+  if (context != NULL)
+    sqlite3_bind_text(insert, 4, context, -1, SQLITE_STATIC);
+  sqlite3_bind_text(insert, 5, type, -1, SQLITE_STATIC);
+  sqlite3_step(insert);
+  sqlite3_finalize(insert);
+}
+} // namespace
+
+TEST_CASE("Threads follow the messages in them", "[MigrateDB]") {
+  sqlite3 *database;
+  sqlite3_open(":memory:", &database);
+  REQUIRE(prepareDatabase(database) == B_OK);
+  insert(database, "%root", "@a", 1, NULL);
+  insert(database, "%one", "@b", 5, "%root");
+  insert(database, "%two", "@c", 7, "%root");
+  insert(database, "%three", "@b", 9, "%root");
+  insert(database, "%three", "@b", 9, "%root");
+  insert(database, "%vote", "@d", 11, "%root", "vote");
+  insert(database, "%contact", "@e", 12, "%root", "contact");
+  Thread root = thread(database, "%root");
+  CHECK(root.replies == 3);
+  CHECK(root.participants == 2);
+  CHECK(root.lastActivity == 9);
+
+  sqlite3_exec(database, "DELETE FROM messages WHERE cypherkey = '%three'",
+               NULL, NULL, NULL);
+  root = thread(database, "%root");
+  CHECK(root.replies == 2);
+  CHECK(root.participants == 2);
+  CHECK(root.lastActivity == 7);
+
+  sqlite3_exec(database, "DELETE FROM messages WHERE cypherkey = '%vote'",
+               NULL, NULL, NULL);
+  CHECK(thread(database, "%root").replies == 2);
+
+  sqlite3_exec(database,
+               "UPDATE messages SET context = '%other' "
+               "WHERE cypherkey = '%two'",
+               NULL, NULL, NULL);
+  root = thread(database, "%root");
+  CHECK(root.replies == 1);
+  CHECK(root.participants == 1);
+  CHECK(root.lastActivity == 5);
+  CHECK(thread(database, "%other").replies == 1);
+
+  sqlite3_exec(database, "DELETE FROM messages WHERE cypherkey = '%one'", NULL,
+               NULL, NULL);
+  CHECK(thread(database, "%root").replies == 0);
+  sqlite3_close(database);
+}